@@ -0,0 +1,943 @@
+// Microbenchmarks for the inner kernels of the world pipeline. Every kernel
+// runs on terrain from Chunk::generateTerrain() (seed 1337) in one chunk of
+// each of the five biomes. All random inputs come from fixed seeds and each
+// measurement is the median of several repetitions, so numbers are
+// comparable from run to run.
+//
+// Usage: micro_bench [--reps N] [--filter SUBSTRING] [--db PATH]
+//                    [--backend sqlite|region]
+//        micro_bench --determinism THREADS
+//
+// The results are printed to stdout as a single JSON object.
+//
+// --determinism runs no benchmarks. It generates the structures and terrain
+// of the same area of chunks on 1 thread and on THREADS threads, and once
+// more on THREADS threads with every structure created on demand (as after
+// they were evicted), and checks that all three give the same blocks. The
+// exit status is 1 if they do not.
+
+#include "Constants.h"
+#include "Block.h"
+#include "Chunk.h"
+#include "Face.h"
+#include "Mesh.h"
+#include "Player.h"
+#include "Database.h"
+#include "Storage.h"
+#include "TerrainGen.h"
+#include "Structure.h"
+#include "LodTerrain.h"
+#include "Profiler.h"
+#include <sglm/sglm.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <filesystem>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+static const char* BIOME_NAMES[] = { "desert", "jungle", "forest", "plains", "tundra" };
+static constexpr int NUM_BIOMES = (int) Biome::NUM_BIOMES;
+
+// written to by every benchmark so the compiler cannot remove the work
+static volatile unsigned long long sink;
+
+// Run f() reps times and return the median duration in nanoseconds
+template <typename F>
+static double median_ns(int reps, F&& f) {
+    std::vector<double> times;
+    for (int r = 0; r < reps; ++r) {
+        Clock::time_point start = Clock::now();
+        f();
+        times.push_back(std::chrono::duration<double, std::nano>(Clock::now() - start).count());
+    }
+    std::sort(times.begin(), times.end());
+    return times[times.size() / 2];
+}
+
+class MicroBench {
+    struct Result {
+        std::string name;
+        int biome;    // -1 if the result is not tied to a biome
+        int subchunk; // -1 if the result is not tied to a subchunk
+        int palette;  // number of distinct block types, -1 if not applicable
+        double value;
+        const char* unit;
+    };
+
+    // A 5x5 grid of chunks around one chunk of a biome. The inner 3x3 chunks
+    // have terrain so that the center chunk has 4 neighbors with block data
+    // and can be meshed.
+    struct BiomeGrid {
+        int cx, cz;
+        std::array<Chunk*, 25> chunks;
+        std::vector<Block::BlockType> terrain; // terrain of the center chunk
+        Chunk* center() const { return chunks[12]; }
+    };
+
+    int m_reps;
+    std::string m_filter;
+    std::string m_db;
+    database::Backend m_backend;
+    std::array<BiomeGrid, NUM_BIOMES> m_grids;
+    std::vector<Result> m_results;
+
+public:
+    MicroBench(int reps, const std::string& filter, const std::string& db, database::Backend backend) :
+    m_reps{ reps }, m_filter{ filter }, m_db{ db }, m_backend{ backend } {}
+
+    void run() {
+        findBiomeChunks();
+        for (BiomeGrid& grid : m_grids)
+            createGrid(grid);
+        benchBlockList();
+        benchVertexData();
+        benchVisibility();
+        benchBlockData();
+        benchIntersects();
+        benchFrustum();
+        benchNoiseField();
+        benchTerrain();
+        benchSerialize();
+        benchSnapshot();
+        benchDatabase();
+        benchLoadUnderStores();
+        benchSpawn();
+        benchLod();
+        // empties the structure index, so this runs last
+        benchStructures();
+        for (BiomeGrid& grid : m_grids)
+            destroyGrid(grid);
+    }
+
+    void print() const {
+        std::printf("{\n  \"seed\": 1337,\n  \"reps\": %d,\n  \"chunks\": [\n", m_reps);
+        for (int b = 0; b < NUM_BIOMES; ++b) {
+            std::printf("    { \"biome\": \"%s\", \"x\": %d, \"z\": %d }%s\n", BIOME_NAMES[b],
+                        m_grids[b].cx, m_grids[b].cz, b + 1 < NUM_BIOMES ? "," : "");
+        }
+        std::printf("  ],\n  \"results\": [\n");
+        for (size_t i = 0; i < m_results.size(); ++i) {
+            const Result& r = m_results[i];
+            std::printf("    { \"name\": \"%s\"", r.name.c_str());
+            if (r.biome >= 0)
+                std::printf(", \"biome\": \"%s\"", BIOME_NAMES[r.biome]);
+            if (r.subchunk >= 0)
+                std::printf(", \"subchunk\": %d", r.subchunk);
+            if (r.palette >= 0)
+                std::printf(", \"palette\": %d", r.palette);
+            std::printf(", \"value\": %.3f, \"unit\": \"%s\" }%s\n", r.value, r.unit,
+                        i + 1 < m_results.size() ? "," : "");
+        }
+        std::printf("  ]\n}\n");
+    }
+
+private:
+    bool enabled(const std::string& name) const {
+        return m_filter.empty() || name.find(m_filter) != std::string::npos;
+    }
+
+    void report(const std::string& name, int biome, int subchunk, int palette,
+                double value, const char* unit) {
+        m_results.push_back({ name, biome, subchunk, palette, value, unit });
+        std::cerr << name << (biome >= 0 ? std::string(" ") + BIOME_NAMES[biome] : "")
+                  << (subchunk >= 0 ? " subchunk " + std::to_string(subchunk) : "")
+                  << ": " << value << ' ' << unit << '\n';
+    }
+
+    // Search outwards from the origin, ring by ring, for the first chunk of
+    // each biome that is entirely that biome and above water.
+    void findBiomeChunks() {
+        std::array<bool, NUM_BIOMES> found = {};
+        int num_found = 0;
+        for (int ring = 0; num_found < NUM_BIOMES; ++ring) {
+            if (ring > 500) {
+                std::cerr << "could not find a chunk of every biome\n";
+                std::exit(1);
+            }
+            for (int cx = -ring; cx <= ring; ++cx) {
+                for (int cz = -ring; cz <= ring; ++cz) {
+                    if (std::max(std::abs(cx), std::abs(cz)) != ring)
+                        continue;
+                    int b = (int) chunkBiome(cx, cz);
+                    if (b >= 0 && !found[b]) {
+                        found[b] = true;
+                        ++num_found;
+                        m_grids[b].cx = cx;
+                        m_grids[b].cz = cz;
+                    }
+                }
+            }
+        }
+    }
+
+    // returns the biome of the chunk, or -1 if the chunk is mixed or has water
+    static int chunkBiome(int cx, int cz) {
+        int biome = -1;
+        for (int i = 0; i <= 4; ++i) {
+            for (int j = 0; j <= 4; ++j) {
+                int x = cx * CHUNK_WIDTH + i * (CHUNK_WIDTH - 1) / 4;
+                int z = cz * CHUNK_WIDTH + j * (CHUNK_WIDTH - 1) / 4;
+                int b = (int) getBiome(x, z);
+                if ((biome != -1 && b != biome) || getHeight(x, z) <= WATER_HEIGHT)
+                    return -1;
+                biome = b;
+            }
+        }
+        return biome;
+    }
+
+    void createGrid(BiomeGrid& grid) {
+        for (int i = 0; i < 5; ++i) {
+            for (int j = 0; j < 5; ++j) {
+                int x = grid.cx + i - 2, z = grid.cz + j - 2;
+                Chunk* chunk = new Chunk(x, z);
+                grid.chunks[i * 5 + j] = chunk;
+                if (i > 0) {
+                    chunk->addNeighbor(grid.chunks[(i - 1) * 5 + j], MINUS_X);
+                    grid.chunks[(i - 1) * 5 + j]->addNeighbor(chunk, PLUS_X);
+                }
+                if (j > 0) {
+                    chunk->addNeighbor(grid.chunks[i * 5 + j - 1], MINUS_Z);
+                    grid.chunks[i * 5 + j - 1]->addNeighbor(chunk, PLUS_Z);
+                }
+                chunk->generateStructures();
+            }
+        }
+        std::vector<Block::BlockType> data(BLOCKS_PER_CHUNK);
+        for (int i = 1; i < 4; ++i) {
+            for (int j = 1; j < 4; ++j) {
+                Chunk* chunk = grid.chunks[i * 5 + j];
+                chunk->generateTerrain(data.data(), 1337);
+                chunk->setLoading();
+                chunk->addBlockData(data.data());
+                if (chunk == grid.center())
+                    grid.terrain = data;
+            }
+        }
+    }
+
+    static void destroyGrid(BiomeGrid& grid) {
+        for (int i = 1; i < 4; ++i)
+            for (int j = 1; j < 4; ++j)
+                grid.chunks[i * 5 + j]->deleteBlockData();
+        for (Chunk* chunk : grid.chunks)
+            delete chunk;
+    }
+
+    static const Block::BlockType* subchunkBlocks(const BiomeGrid& grid, int subchunk) {
+        return grid.terrain.data() + subchunk * BLOCKS_PER_SUBCHUNK;
+    }
+
+    static int paletteSize(const Block::BlockType* blocks) {
+        std::set<Block::BlockType> palette(blocks, blocks + BLOCKS_PER_SUBCHUNK);
+        return (int) palette.size();
+    }
+
+    void benchBlockList() {
+        std::mt19937 mt(1337);
+        std::uniform_int_distribution<int> xz(0, CHUNK_WIDTH - 1), y(0, SUBCHUNK_HEIGHT - 1);
+        constexpr int N = 4096;
+        std::vector<std::array<int, 3>> positions(N);
+        for (auto& p : positions)
+            p = { xz(mt), y(mt), xz(mt) };
+
+        for (int b = 0; b < NUM_BIOMES; ++b) {
+            for (int sc = 0; sc < NUM_SUBCHUNKS; ++sc) {
+                const Block::BlockType* blocks = subchunkBlocks(m_grids[b], sc);
+                int palette = paletteSize(blocks);
+                Chunk::BlockList list;
+                if (enabled("BlockList::create")) {
+                    double ns = median_ns(m_reps, [&] {
+                        list.create(blocks, BLOCKS_PER_SUBCHUNK);
+                    });
+                    report("BlockList::create", b, sc, palette, ns / 1000.0, "us");
+                }
+                list.create(blocks, BLOCKS_PER_SUBCHUNK);
+                if (enabled("BlockList::get")) {
+                    double ns = median_ns(m_reps, [&] {
+                        unsigned long long sum = 0;
+                        for (const auto& [px, py, pz] : positions)
+                            sum += (unsigned long long) list.get(px, py, pz);
+                        sink = sink + sum;
+                    });
+                    report("BlockList::get", b, sc, palette, ns / N, "ns/block");
+                }
+                if (enabled("BlockList::put")) {
+                    // only put blocks that are already in the palette
+                    double ns = median_ns(m_reps, [&] {
+                        for (int i = 0; i < N; ++i) {
+                            const auto& [px, py, pz] = positions[i];
+                            const auto& [qx, qy, qz] = positions[(i + 1) % N];
+                            list.put(px, py, pz, blocks[Chunk::subchunk_index(qx, qy, qz)]);
+                        }
+                    });
+                    report("BlockList::put", b, sc, palette, ns / N, "ns/block");
+                    list.create(blocks, BLOCKS_PER_SUBCHUNK);
+                }
+                if (enabled("BlockList::get_all")) {
+                    double ns = median_ns(m_reps, [&] {
+                        Block::BlockType* all = list.get_all();
+                        sink = sink + (unsigned long long) all[BLOCKS_PER_SUBCHUNK - 1];
+                        delete[] all;
+                    });
+                    report("BlockList::get_all", b, sc, palette, ns / 1000.0, "us");
+                }
+            }
+        }
+    }
+
+    // including BlockList::get_all(), as in Subchunk::updateMesh()
+    void benchVertexData() {
+        if (!enabled("Subchunk::getVertexData"))
+            return;
+        constexpr int LIM = 600000;
+        std::vector<vertex_attrib_t> buffer(LIM);
+        std::array<unsigned int, Mesh::NUM_RANGES> rangeCounts;
+        for (int b = 0; b < NUM_BIOMES; ++b) {
+            const Chunk* center = m_grids[b].center();
+            for (int sc = 0; sc < NUM_SUBCHUNKS; ++sc) {
+                const Chunk::Subchunk* subchunk = center->m_subchunks[sc];
+                unsigned int bytes = 0;
+                double ns = median_ns(m_reps, [&] {
+                    Block::BlockType* blocks = subchunk->m_blocks.get_all();
+                    bytes = subchunk->getVertexData(center, blocks, LIM * sizeof(vertex_attrib_t), buffer.data(),
+                                                  rangeCounts);
+                    delete[] blocks;
+                });
+                report("Subchunk::getVertexData", b, sc, paletteSize(subchunkBlocks(m_grids[b], sc)),
+                       ns / 1000.0, "us");
+                report("Subchunk::getVertexData bytes", b, sc, -1, bytes, "bytes");
+            }
+        }
+    }
+
+    void benchVisibility() {
+        if (!enabled("Subchunk::updateVisibility"))
+            return;
+        for (int b = 0; b < NUM_BIOMES; ++b) {
+            Chunk* center = m_grids[b].center();
+            for (int sc = 0; sc < NUM_SUBCHUNKS; ++sc) {
+                Chunk::Subchunk* subchunk = center->m_subchunks[sc];
+                Block::BlockType* blocks = subchunk->m_blocks.get_all();
+                double ns = median_ns(m_reps, [&] {
+                    subchunk->updateVisibility(blocks);
+                    sink = sink + subchunk->m_visibility;
+                });
+                delete[] blocks;
+                report("Subchunk::updateVisibility", b, sc, -1, ns / 1000.0, "us");
+            }
+        }
+    }
+
+    // every non-air block of the center chunk whose neighbors are in the same subchunk
+    struct BlockDataInput {
+        Block::BlockType type;
+        int x, y, z;
+        std::array<Block::BlockType, NUM_DIRECTIONS> surrounding;
+    };
+
+    static std::vector<BlockDataInput> blockDataInputs(const BiomeGrid& grid) {
+        std::vector<BlockDataInput> inputs;
+        for (int sc = 0; sc < NUM_SUBCHUNKS; ++sc) {
+            const Block::BlockType* blocks = subchunkBlocks(grid, sc);
+            for (int x = 1; x < CHUNK_WIDTH - 1; ++x) {
+                for (int z = 1; z < CHUNK_WIDTH - 1; ++z) {
+                    for (int y = 1; y < SUBCHUNK_HEIGHT - 1; ++y) {
+                        int i = Chunk::subchunk_index(x, y, z);
+                        if (blocks[i] == Block::BlockType::AIR)
+                            continue;
+                        inputs.push_back({ blocks[i], x, y, z, {
+                            blocks[i + CHUNK_WIDTH * SUBCHUNK_HEIGHT],
+                            blocks[i - CHUNK_WIDTH * SUBCHUNK_HEIGHT],
+                            blocks[i + SUBCHUNK_HEIGHT],
+                            blocks[i - SUBCHUNK_HEIGHT],
+                            blocks[i + 1],
+                            blocks[i - 1],
+                        } });
+                    }
+                }
+            }
+        }
+        return inputs;
+    }
+
+    void benchBlockData() {
+        if (!enabled("Block::getBlockData"))
+            return;
+        vertex_attrib_t buffer[ATTRIBS_PER_FACE * 6];
+        for (int b = 0; b < NUM_BIOMES; ++b) {
+            std::vector<BlockDataInput> inputs = blockDataInputs(m_grids[b]);
+            double ns = median_ns(m_reps, [&] {
+                unsigned long long sum = 0;
+                for (const BlockDataInput& in : inputs)
+                    sum += Block::getBlockData(in.type, in.x, in.y, in.z, buffer, in.surrounding);
+                sink = sink + sum;
+            });
+            report("Block::getBlockData", b, -1, -1, ns / inputs.size(), "ns/block");
+        }
+    }
+
+    // the same conversion from vertex data to faces as Mesh::getFaces()
+    static std::vector<Face> facesOf(const vertex_attrib_t* data, unsigned int bytes,
+                                     int cx, int cy, int cz) {
+        std::vector<Face> faces;
+        unsigned int attribs = bytes / sizeof(vertex_attrib_t);
+        sglm::vec3 offset = { (float) (cx * CHUNK_WIDTH), (float) (cy * SUBCHUNK_HEIGHT),
+                              (float) (cz * CHUNK_WIDTH) };
+        for (unsigned int i = 0; i < attribs; i += ATTRIBS_PER_FACE) {
+            const Vertex* v = reinterpret_cast<const Vertex*>(data + i);
+            sglm::vec3 A = Block::getVertexPosition(v[0]) + offset;
+            sglm::vec3 B = Block::getVertexPosition(v[1]) + offset;
+            sglm::vec3 C = Block::getVertexPosition(v[2]) + offset;
+            sglm::vec3 D = Block::getVertexPosition(v[4]) + offset;
+            sglm::vec3 blockPosition = Block::getBlockPosition(v[0]);
+            faces.emplace_back(A, B, C, D, blockPosition);
+        }
+        return faces;
+    }
+
+    // rays that start just above the surface of the center chunk and point downwards
+    static std::vector<sglm::ray> surfaceRays(const BiomeGrid& grid, int count) {
+        std::mt19937 mt(1337);
+        std::uniform_real_distribution<float> pos(4.0f, CHUNK_WIDTH - 4.0f), dir(-1.0f, 1.0f);
+        std::vector<sglm::ray> rays;
+        for (int i = 0; i < count; ++i) {
+            float x = grid.cx * CHUNK_WIDTH + pos(mt);
+            float z = grid.cz * CHUNK_WIDTH + pos(mt);
+            float y = (float) getHeight((int) x, (int) z) + 2.5f;
+            sglm::vec3 d = sglm::normalize({ dir(mt), -1.0f, dir(mt) });
+            rays.push_back({ { x, y, z }, d, (float) Player::getReach() });
+        }
+        return rays;
+    }
+
+    void benchIntersects() {
+        constexpr int LIM = 600000;
+        constexpr int NUM_RAYS = 256;
+        std::vector<vertex_attrib_t> buffer(LIM);
+        std::array<unsigned int, Mesh::NUM_RANGES> rangeCounts;
+        for (int b = 0; b < NUM_BIOMES; ++b) {
+            const BiomeGrid& grid = m_grids[b];
+            Chunk* center = grid.center();
+            int sc = getHeight(grid.cx * CHUNK_WIDTH + CHUNK_WIDTH / 2,
+                               grid.cz * CHUNK_WIDTH + CHUNK_WIDTH / 2) / SUBCHUNK_HEIGHT;
+            std::vector<sglm::ray> rays = surfaceRays(grid, NUM_RAYS);
+            if (enabled("Face::intersects")) {
+                Block::BlockType* blocks = center->m_subchunks[sc]->m_blocks.get_all();
+                unsigned int bytes = center->m_subchunks[sc]->getVertexData(
+                    center, blocks, LIM * sizeof(vertex_attrib_t), buffer.data(), rangeCounts);
+                delete[] blocks;
+                std::vector<Face> faces = facesOf(buffer.data(), bytes, grid.cx, sc, grid.cz);
+                double ns = median_ns(m_reps, [&] {
+                    unsigned long long hits = 0;
+                    for (const sglm::ray& ray : rays) {
+                        for (const Face& face : faces) {
+                            Face::Intersection isect;
+                            hits += face.intersects(ray, isect);
+                        }
+                    }
+                    sink = sink + hits;
+                });
+                report("Face::intersects", b, sc, -1, ns / ((double) NUM_RAYS * faces.size()), "ns/face");
+            }
+            if (enabled("Mesh::intersects")) {
+                Mesh& mesh = center->m_subchunks[sc]->m_mesh;
+                center->m_subchunks[sc]->updateMesh(center);
+                double ns = median_ns(m_reps, [&] {
+                    unsigned long long hits = 0;
+                    for (const sglm::ray& ray : rays) {
+                        Face::Intersection isect;
+                        hits += mesh.intersects(ray, isect);
+                    }
+                    sink = sink + hits;
+                });
+                mesh.erase();
+                report("Mesh::intersects", b, sc, -1, ns / NUM_RAYS / 1000.0, "us/ray");
+            }
+        }
+    }
+
+    void benchFrustum() {
+        if (!enabled("frustum::contains"))
+            return;
+        constexpr int N = 65536;
+        Player player({ 0.0f, 100.0f, 0.0f }, 1000.0f / 750.0f);
+        const sglm::frustum& frustum = player.getFrustum();
+        std::mt19937 mt(1337);
+        std::uniform_real_distribution<float> xz(-FAR_PLANE, FAR_PLANE), y(0.0f, CHUNK_HEIGHT);
+        std::vector<sglm::vec3> centers(N);
+        for (sglm::vec3& c : centers)
+            c = { xz(mt), y(mt), xz(mt) };
+        double ns = median_ns(m_reps, [&] {
+            unsigned long long inside = 0;
+            for (const sglm::vec3& c : centers)
+                inside += frustum.contains(c, SUB_CHUNK_RADIUS);
+            sink = sink + inside;
+        });
+        report("frustum::contains", -1, -1, -1, ns / N, "ns/call");
+    }
+
+    // alone, and with the fields of its 4 neighbors, whose shared cave
+    // lattice points are copied instead of sampled
+    void benchNoiseField() {
+        if (!enabled("fillNoiseField"))
+            return;
+        NoiseField field;
+        std::array<NoiseField, 4> neighbor_fields;
+        for (int b = 0; b < NUM_BIOMES; ++b) {
+            int cx = m_grids[b].cx, cz = m_grids[b].cz;
+            double ns = median_ns(m_reps, [&] {
+                fillNoiseField(cx, cz, field);
+                sink = sink + field.height[0];
+            });
+            report("fillNoiseField", b, -1, -1, ns / 1000.0, "us");
+
+            fillNoiseField(cx + 1, cz, neighbor_fields[PLUS_X]);
+            fillNoiseField(cx - 1, cz, neighbor_fields[MINUS_X]);
+            fillNoiseField(cx, cz + 1, neighbor_fields[PLUS_Z]);
+            fillNoiseField(cx, cz - 1, neighbor_fields[MINUS_Z]);
+            std::array<const NoiseField*, 4> neighbors;
+            for (int d = 0; d < 4; ++d)
+                neighbors[d] = &neighbor_fields[d];
+            ns = median_ns(m_reps, [&] {
+                fillNoiseField(cx, cz, field, neighbors);
+                sink = sink + field.height[0];
+            });
+            report("fillNoiseField with 4 neighbors", b, -1, -1, ns / 1000.0, "us");
+        }
+    }
+
+    // with the noise field that setLoading() made
+    void benchTerrain() {
+        if (!enabled("Chunk::generateTerrain"))
+            return;
+        std::vector<Block::BlockType> data(BLOCKS_PER_CHUNK);
+        for (int b = 0; b < NUM_BIOMES; ++b) {
+            const Chunk* center = m_grids[b].center();
+            double ns = median_ns(m_reps, [&] {
+                center->generateTerrain(data.data(), 1337);
+            });
+            report("Chunk::generateTerrain", b, -1, -1, ns / 1000.0, "us");
+        }
+    }
+
+    void benchStructures() {
+        if (!enabled("Chunk::generateStructures"))
+            return;
+        for (int b = 0; b < NUM_BIOMES; ++b) {
+            // a separate chunk, so that the grid's chunk keeps its Status,
+            // and an empty index, so that the structures of its region are
+            // placed again. That is done for the whole region at once, so
+            // the result is per chunk of the region.
+            double ns = median_ns(m_reps, [&] {
+                Structure::clearAll();
+                Chunk chunk(m_grids[b].cx, m_grids[b].cz);
+                chunk.generateStructures();
+            });
+            int region_chunks = Structure::REGION_WIDTH * Structure::REGION_WIDTH;
+            report("Chunk::generateStructures", b, -1, -1, ns / 1000.0 / region_chunks, "us/chunk");
+        }
+    }
+
+    // Chunk::serialize() and Chunk::deserialize() of each center chunk with
+    // 0, a few and many random edits, and the size of the saved chunk. With
+    // few edits the chunk is saved as a delta, which is smaller but has to
+    // generate the terrain again when it is loaded.
+    void benchSerialize() {
+        if (!enabled("Chunk::serialize"))
+            return;
+        for (int b = 0; b < NUM_BIOMES; ++b) {
+            Chunk* center = m_grids[b].center();
+            for (int num_edits : { 0, 64, 16384 }) {
+                std::vector<Block::BlockType> expected = m_grids[b].terrain;
+                std::mt19937 mt(1337);
+                std::uniform_int_distribution<int> index(0, BLOCKS_PER_CHUNK - 1);
+                std::uniform_int_distribution<int> type(0, (int) Block::BlockType::OUTLINE - 1);
+                for (int e = 0; e < num_edits; ++e) {
+                    expected[index(mt)] = static_cast<Block::BlockType>(type(mt));
+                }
+                reload(center, expected.data());
+
+                std::string edits = " (" + std::to_string(num_edits) + " edits)";
+                std::vector<unsigned char> data;
+                double ns = median_ns(m_reps, [&] {
+                    center->serialize(data, 1337);
+                    sink = sink + data.back();
+                });
+                report("Chunk::serialize" + edits, b, -1, -1, ns / 1000.0, "us");
+                report("Chunk::serialize size" + edits, b, -1, -1, (double) data.size(), "bytes");
+
+                std::vector<double> times;
+                for (int r = 0; r < m_reps; ++r) {
+                    center->deleteBlockData();
+                    center->setLoading();
+                    Clock::time_point start = Clock::now();
+                    bool loaded = center->deserialize(data.data(), (int) data.size());
+                    times.push_back(std::chrono::duration<double, std::nano>(Clock::now() - start).count());
+                    if (!loaded) {
+                        std::cerr << "Chunk::deserialize failed\n";
+                        std::exit(1);
+                    }
+                }
+                for (int y = 0; y < NUM_SUBCHUNKS; ++y) {
+                    Block::BlockType* blocks = center->m_subchunks[y]->m_blocks.get_all();
+                    if (!std::equal(blocks, blocks + BLOCKS_PER_SUBCHUNK, expected.data() + y * BLOCKS_PER_SUBCHUNK)) {
+                        std::cerr << "Chunk::deserialize returned different blocks\n";
+                        std::exit(1);
+                    }
+                    delete[] blocks;
+                }
+                std::sort(times.begin(), times.end());
+                report("Chunk::deserialize" + edits, b, -1, -1, times[times.size() / 2] / 1000.0, "us");
+            }
+            reload(center, m_grids[b].terrain.data());
+        }
+    }
+
+    // What an autosave costs the main thread for each edited chunk: taking a
+    // snapshot, and the copy of a subchunk that the next edit to it makes
+    // while the snapshot still shares its data. The snapshot must still
+    // serialize to the blocks from before the edit.
+    void benchSnapshot() {
+        if (!enabled("Chunk::takeSnapshot"))
+            return;
+        for (int b = 0; b < NUM_BIOMES; ++b) {
+            Chunk* center = m_grids[b].center();
+            Chunk::BlockList& bottom = center->m_subchunks[0]->m_blocks;
+            std::vector<unsigned char> expected, saved;
+            center->serialize(expected, 1337);
+            std::vector<double> snapshot_times, edit_times;
+            for (int r = 0; r < m_reps; ++r) {
+                Clock::time_point start = Clock::now();
+                Chunk::Snapshot snapshot = center->takeSnapshot();
+                Clock::time_point taken = Clock::now();
+                // a block already in the palette, so that put() does not
+                // rebuild the data anyway
+                bottom.put(r % CHUNK_WIDTH, 0, 0, bottom.get(0, 1, 0));
+                Clock::time_point edited = Clock::now();
+                snapshot_times.push_back(std::chrono::duration<double, std::nano>(taken - start).count());
+                edit_times.push_back(std::chrono::duration<double, std::nano>(edited - taken).count());
+                snapshot.serialize(saved, 1337);
+                if (saved != expected) {
+                    std::cerr << "Chunk::Snapshot changed when the chunk was edited\n";
+                    std::exit(1);
+                }
+                reload(center, m_grids[b].terrain.data());
+            }
+            std::sort(snapshot_times.begin(), snapshot_times.end());
+            std::sort(edit_times.begin(), edit_times.end());
+            report("Chunk::takeSnapshot", b, -1, -1, snapshot_times[m_reps / 2] / 1000.0, "us");
+            report("Chunk::takeSnapshot first edit", b, -1, -1, edit_times[m_reps / 2] / 1000.0, "us");
+        }
+    }
+
+    static void reload(Chunk* chunk, const Block::BlockType* blocks) {
+        chunk->deleteBlockData();
+        chunk->setLoading();
+        chunk->addBlockData(blocks);
+    }
+
+    // Store N chunks and then load them back, timing until the last load
+    // result arrives. Each repetition uses the same keys.
+    void benchDatabase() {
+        if (!enabled("database"))
+            return;
+        constexpr int N = 256;
+        std::filesystem::remove_all(m_db);
+        database::initialize(m_db.c_str(), m_backend);
+        waitForLoads(1, [] { database::request_load(-1000000, -1000000, 0); });
+
+        double store_ns = 0.0, load_ns = 0.0, miss_ns = 0.0;
+        for (int r = 0; r < m_reps; ++r) {
+            Clock::time_point start = Clock::now();
+            waitForLoads(1, [&] {
+                for (int i = 0; i < N; ++i) {
+                    const BiomeGrid& grid = m_grids[i % NUM_BIOMES];
+                    database::Buffer* data = database::acquire_buffer();
+                    grid.center()->serialize(*data, 1337, false);
+                    database::request_store(1000 + i, 0, data);
+                }
+                // the load is answered after every store before it has been written
+                database::request_load(-1000000, -1000000, 0);
+            });
+            Clock::time_point stored = Clock::now();
+            waitForLoads(N, [&] {
+                for (int i = 0; i < N; ++i)
+                    database::request_load(1000 + i, 0, 0);
+            });
+            Clock::time_point loaded = Clock::now();
+            // chunks that were never stored
+            waitForLoads(N, [&] {
+                for (int i = 0; i < N; ++i)
+                    database::request_load(1000 + i, 1, 0);
+            });
+            store_ns += std::chrono::duration<double, std::nano>(stored - start).count();
+            load_ns += std::chrono::duration<double, std::nano>(loaded - stored).count();
+            miss_ns += std::chrono::duration<double, std::nano>(Clock::now() - loaded).count();
+        }
+        database::close();
+        double file_size = 0.0;
+        if (std::filesystem::is_directory(m_db)) {
+            for (const auto& entry : std::filesystem::directory_iterator(m_db))
+                file_size += (double) entry.file_size();
+        } else {
+            file_size = (double) std::filesystem::file_size(m_db);
+        }
+        std::filesystem::remove_all(m_db);
+        report("database store", -1, -1, -1, N * m_reps / (store_ns / 1e9), "chunks/s");
+        report("database load", -1, -1, -1, N * m_reps / (load_ns / 1e9), "chunks/s");
+        report("database miss", -1, -1, -1, miss_ns / (N * m_reps), "ns/chunk");
+        report("database file size", -1, -1, -1, file_size / N / 1024.0, "KB/chunk");
+        report("database round trip", -1, -1, -1, (store_ns + load_ns) / (N * m_reps) / 1000.0, "us/chunk");
+    }
+
+    // The latency of single loads while another thread keeps requesting
+    // stores of other chunks faster than they can be written, as when the
+    // player moves while the chunks behind them are saved. Loads are
+    // requested one at a time, LOAD_INTERVAL apart.
+    void benchLoadUnderStores() {
+        if (!enabled("database load latency"))
+            return;
+        constexpr int N = 128, STORED = 2048, BURST = 32;
+        constexpr auto LOAD_INTERVAL = std::chrono::milliseconds(2);
+        std::filesystem::remove_all(m_db);
+        std::array<std::vector<unsigned char>, NUM_BIOMES> blobs;
+        for (int b = 0; b < NUM_BIOMES; ++b)
+            m_grids[b].center()->serialize(blobs[b], 1337, false);
+        database::initialize(m_db.c_str(), m_backend);
+        for (int i = 0; i < N; ++i) {
+            database::Buffer* data = database::acquire_buffer();
+            *data = blobs[i % NUM_BIOMES];
+            database::request_store(i, 2000, data);
+        }
+        database::close();
+
+        database::initialize(m_db.c_str(), m_backend);
+        std::atomic<bool> done{ false };
+        std::atomic<long long> stores{ 0 };
+        std::thread saver([&] {
+            for (int i = 0; !done; ++i) {
+                database::Buffer* data = database::acquire_buffer();
+                *data = blobs[i % NUM_BIOMES];
+                database::request_store(i % STORED, 3000, data);
+                ++stores;
+                if (i % BURST == BURST - 1)
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        });
+        std::this_thread::sleep_for(std::chrono::milliseconds(50)); // let the store queue fill up
+        std::vector<double> times;
+        for (int r = 0; r < m_reps; ++r) {
+            for (int i = 0; i < N; ++i) {
+                Clock::time_point start = Clock::now();
+                waitForLoads(1, [i] { database::request_load(i, 2000, 0); });
+                times.push_back(std::chrono::duration<double, std::micro>(Clock::now() - start).count());
+                std::this_thread::sleep_until(start + LOAD_INTERVAL);
+            }
+        }
+        done = true;
+        saver.join();
+        database::close();
+        std::filesystem::remove_all(m_db);
+        std::sort(times.begin(), times.end());
+        report("database load latency under stores p50", -1, -1, -1, times[times.size() / 2], "us");
+        report("database load latency under stores p99", -1, -1, -1, times[times.size() * 99 / 100], "us");
+        report("database stores during load latency test", -1, -1, -1, (double) stores, "chunks");
+    }
+
+    // Save every chunk within SPAWN_RADIUS of the origin, reopen the
+    // database and load them all back in the order that World::LoadChunks()
+    // requests them (x, then z).
+    void benchSpawn() {
+        if (!enabled("database spawn"))
+            return;
+        constexpr int SPAWN_RADIUS = 32;
+        std::filesystem::remove_all(m_db);
+        std::array<std::vector<unsigned char>, NUM_BIOMES> blobs;
+        for (int b = 0; b < NUM_BIOMES; ++b)
+            m_grids[b].center()->serialize(blobs[b], 1337, false);
+        std::vector<std::pair<int, int>> keys;
+        for (int x = -SPAWN_RADIUS; x <= SPAWN_RADIUS; ++x)
+            for (int z = -SPAWN_RADIUS; z <= SPAWN_RADIUS; ++z)
+                if (x * x + z * z <= SPAWN_RADIUS * SPAWN_RADIUS)
+                    keys.push_back({ x, z });
+
+        database::initialize(m_db.c_str(), m_backend);
+        for (size_t i = 0; i < keys.size(); ++i) {
+            database::Buffer* data = database::acquire_buffer();
+            *data = blobs[i % NUM_BIOMES];
+            database::request_store(keys[i].first, keys[i].second, data);
+        }
+        database::close();
+
+        double ns = median_ns(m_reps, [&] {
+            database::initialize(m_db.c_str(), m_backend);
+            waitForLoads((int) keys.size(), [&] {
+                for (const auto& [x, z] : keys)
+                    database::request_load(x, z, 0);
+            });
+            database::close();
+        });
+        std::filesystem::remove_all(m_db);
+        report("database spawn load (radius 32)", -1, -1, -1, keys.size() / (ns / 1e9), "chunks/s");
+    }
+
+    // every low-detail tile around a player at the origin with the default
+    // render distance, made from nothing
+    void benchLod() {
+        if (!enabled("LodTerrain"))
+            return;
+        long long tiles = 0;
+        double ns = median_ns(m_reps, [&] {
+            LodTerrain lod;
+            while (lod.update(0, 0, Player::getRenderDist(), Player::getLodDist()))
+                ;
+            lod.upload(INT_MAX);
+            tiles = profiler::get(profiler::Counter::LOD_TILES);
+        });
+        report("LodTerrain all tiles", -1, -1, -1, ns / 1e6, "ms");
+        report("LodTerrain tiles", -1, -1, -1, (double) tiles, "tiles");
+        report("LodTerrain bytes", -1, -1, -1, profiler::get(profiler::Counter::LOD_BYTES) / 1048576.0, "MB");
+    }
+
+    template <typename F>
+    static void waitForLoads(int count, F&& request) {
+        request();
+        std::vector<database::Query> results;
+        while (count > 0) {
+            results.clear();
+            database::get_load_results(results);
+            if (results.empty()) {
+                std::this_thread::yield();
+                continue;
+            }
+            for (const database::Query& q : results) {
+                database::release_buffer(q.data);
+            }
+            count -= (int) results.size();
+        }
+    }
+};
+
+// Chunks within DETERMINISM_RADIUS of the origin get terrain, and their
+// neighbors structures.
+static constexpr int DETERMINISM_RADIUS = 7;
+
+// Generate the structures and then the terrain of the area on the given
+// number of threads, starting from an empty structure index. Each thread
+// takes the next chunk that no thread has taken yet, so the order changes
+// from run to run; with one thread the chunks are taken in reverse. If
+// structures_first is false, generateTerrain() creates the structures it
+// needs. Returns a hash of every chunk's blocks, combined in a fixed order.
+static unsigned long long generate_area(int threads, bool structures_first, double& ms) {
+    constexpr int STRUCTURE_WIDTH = 2 * DETERMINISM_RADIUS + 3;
+    constexpr int TERRAIN_WIDTH = 2 * DETERMINISM_RADIUS + 1;
+    std::vector<Chunk*> chunks;
+    for (int i = 0; i < STRUCTURE_WIDTH * STRUCTURE_WIDTH; ++i)
+        chunks.push_back(new Chunk(i / STRUCTURE_WIDTH - DETERMINISM_RADIUS - 1,
+                                   i % STRUCTURE_WIDTH - DETERMINISM_RADIUS - 1));
+    std::vector<unsigned long long> hashes(TERRAIN_WIDTH * TERRAIN_WIDTH);
+    Structure::clearAll();
+
+    Clock::time_point start = Clock::now();
+    auto run = [&](int count, auto&& work) {
+        std::atomic<int> next{ 0 };
+        auto worker = [&] {
+            for (int i = next++; i < count; i = next++)
+                work(threads == 1 ? count - 1 - i : i);
+        };
+        std::vector<std::thread> pool;
+        for (int t = 1; t < threads; ++t)
+            pool.emplace_back(worker);
+        worker();
+        for (std::thread& t : pool)
+            t.join();
+    };
+    if (structures_first) {
+        run((int) chunks.size(), [&](int i) {
+            chunks[i]->generateStructures();
+        });
+    }
+    run((int) hashes.size(), [&](int i) {
+        thread_local std::vector<Block::BlockType> data(BLOCKS_PER_CHUNK);
+        int x = i / TERRAIN_WIDTH + 1, z = i % TERRAIN_WIDTH + 1;
+        chunks[x * STRUCTURE_WIDTH + z]->generateTerrain(data.data(), WORLD_SEED);
+        unsigned long long hash = 14695981039346656037ull; // FNV-1a
+        for (Block::BlockType block : data)
+            hash = (hash ^ (unsigned char) block) * 1099511628211ull;
+        hashes[i] = hash;
+    });
+    ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+    for (Chunk* chunk : chunks)
+        delete chunk;
+    unsigned long long hash = 14695981039346656037ull;
+    for (unsigned long long h : hashes)
+        hash = (hash ^ h) * 1099511628211ull;
+    return hash;
+}
+
+static int check_determinism(int threads) {
+    double ms_one, ms_many, ms_demand;
+    unsigned long long one = generate_area(1, true, ms_one);
+    unsigned long long many = generate_area(threads, true, ms_many);
+    unsigned long long demand = generate_area(threads, false, ms_demand);
+    bool identical = one == many && one == demand;
+    int chunks = (2 * DETERMINISM_RADIUS + 1) * (2 * DETERMINISM_RADIUS + 1);
+    std::cerr << "1 thread: " << ms_one << " ms, " << threads << " threads: " << ms_many
+              << " ms, on demand: " << ms_demand << " ms\n";
+    std::printf("{\n  \"seed\": %d,\n  \"chunks\": %d,\n  \"threads\": %d,\n", WORLD_SEED, chunks, threads);
+    std::printf("  \"hash_1\": \"%016llx\",\n  \"hash_n\": \"%016llx\",\n", one, many);
+    std::printf("  \"hash_on_demand\": \"%016llx\",\n", demand);
+    std::printf("  \"ms_1\": %.3f,\n  \"ms_n\": %.3f,\n  \"ms_on_demand\": %.3f,\n", ms_one, ms_many, ms_demand);
+    std::printf("  \"identical\": %s\n}\n", identical ? "true" : "false");
+    return identical ? 0 : 1;
+}
+
+int main(int argc, char** argv) {
+    int reps = 7;
+    std::string filter;
+    std::string db = "micro_bench.db";
+    database::Backend backend = database::Backend::SQLITE;
+    int determinism_threads = 0;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--determinism" && i + 1 < argc) {
+            determinism_threads = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--reps" && i + 1 < argc) {
+            reps = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--filter" && i + 1 < argc) {
+            filter = argv[++i];
+        } else if (arg == "--db" && i + 1 < argc) {
+            db = argv[++i];
+        } else if (arg == "--backend" && i + 1 < argc && database::parse_backend(argv[i + 1], backend)) {
+            ++i;
+        } else {
+            std::cerr << "usage: micro_bench [--reps N] [--filter SUBSTRING] [--db PATH]\n"
+                         "                   [--backend sqlite|region]\n"
+                         "       micro_bench --determinism THREADS\n";
+            return 1;
+        }
+    }
+
+    Block::initBlockData();
+    Chunk::initNoise();
+    if (determinism_threads > 0)
+        return check_determinism(determinism_threads);
+    MicroBench bench(reps, filter, db, backend);
+    bench.run();
+    bench.print();
+    return 0;
+}
@@ -0,0 +1,336 @@
+// Headless benchmark of the world pipeline (terrain generation, structures,
+// database loads/stores and meshing). A camera flies along a scripted path at
+// a fixed speed while the World's chunk loader thread runs exactly as it does
+// in the game, but meshes are never uploaded because there is no OpenGL
+// context (see MC_HEADLESS in Mesh.cpp and Shader.cpp).
+//
+// world_bench_gl (see MC_BENCH_GL in CMakeLists.txt) is built from this file
+// without MC_HEADLESS. It makes a surfaceless EGL context and renders every
+// frame like the game does, into an offscreen framebuffer of the game's
+// window size. It must be run from the repository root, where the shaders and
+// textures are. --occlusion-queries turns on the occlusion query pass (see
+// World::setOcclusionQueries()), which does nothing without a context.
+//
+// Usage: world_bench [--seconds N] [--speed S] [--render-dist R]
+//                    [--path straight|square|back] [--db PATH] [--keep-db]
+//                    [--backend sqlite|region] [--trace FILE]
+//                    [--occlusion-queries]
+//
+// The results are printed to stdout as a single JSON object so that runs can
+// be compared against each other. --trace also saves the profiler's trace
+// events (see Profiler.h) when the run ends.
+
+#include "Constants.h"
+#include "Block.h"
+#include "Chunk.h"
+#include "Player.h"
+#include "Shader.h"
+#include "Texture.h"
+#include "World.h"
+#include "Database.h"
+#include "Storage.h"
+#include "Profiler.h"
+
+#include <sys/resource.h>
+
+#ifndef MC_HEADLESS
+#include <glad/glad.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+static constexpr double FRAME_TIME = 1.0 / 60.0; // the game runs with VSync on
+static constexpr int FRAME_WIDTH = 1000, FRAME_HEIGHT = 750; // the game's window
+
+struct Options {
+    double seconds = 30.0;
+    float speed = 30.0f;
+    int render_dist = 15;
+    std::string path = "straight";
+    std::string db = "world_bench.db";
+    bool keep_db = false;
+    database::Backend backend = database::Backend::SQLITE;
+    std::string trace;
+    bool occlusion_queries = false;
+};
+
+static void usage() {
+    std::cerr << "usage: world_bench [--seconds N] [--speed S] [--render-dist R]\n"
+                 "                   [--path straight|square|back] [--db PATH] [--keep-db]\n"
+                 "                   [--backend sqlite|region] [--trace FILE]\n"
+                 "                   [--occlusion-queries]\n";
+    std::exit(1);
+}
+
+static Options parse_args(int argc, char** argv) {
+    Options opts;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--seconds" && has_value)
+            opts.seconds = std::atof(argv[++i]);
+        else if (arg == "--speed" && has_value)
+            opts.speed = (float) std::atof(argv[++i]);
+        else if (arg == "--render-dist" && has_value)
+            opts.render_dist = std::atoi(argv[++i]);
+        else if (arg == "--path" && has_value)
+            opts.path = argv[++i];
+        else if (arg == "--db" && has_value)
+            opts.db = argv[++i];
+        else if (arg == "--keep-db")
+            opts.keep_db = true;
+        else if (arg == "--backend" && has_value) {
+            if (!database::parse_backend(argv[++i], opts.backend))
+                usage();
+        }
+        else if (arg == "--trace" && has_value)
+            opts.trace = argv[++i];
+        else if (arg == "--occlusion-queries")
+            opts.occlusion_queries = true;
+        else
+            usage();
+    }
+    if (opts.seconds <= 0 || opts.speed <= 0 || opts.render_dist < 1 ||
+        (opts.path != "straight" && opts.path != "square" && opts.path != "back")) {
+        usage();
+    }
+#ifdef MC_HEADLESS
+    if (opts.occlusion_queries) {
+        std::cerr << "--occlusion-queries needs a renderer: use world_bench_gl\n";
+        std::exit(1);
+    }
+#endif
+    return opts;
+}
+
+#ifndef MC_HEADLESS
+// Make a surfaceless EGL context current on this thread, with a framebuffer
+// of the game window's size bound, and set the state that Main.cpp sets.
+// Returns false if there is no EGL driver that can do this.
+static bool make_gl_context() {
+    auto get_platform_display = (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (get_platform_display == nullptr) {
+        return false;
+    }
+    EGLDisplay display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, nullptr, nullptr) || !eglBindAPI(EGL_OPENGL_API)) {
+        return false;
+    }
+    const EGLint config_attribs[] = { EGL_SURFACE_TYPE, EGL_PBUFFER_BIT, EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+    EGLConfig config;
+    EGLint num_configs = 0;
+    if (!eglChooseConfig(display, config_attribs, &config, 1, &num_configs) || num_configs == 0) {
+        return false;
+    }
+    const EGLint context_attribs[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 3,
+        EGL_CONTEXT_MINOR_VERSION, 3,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE
+    };
+    EGLContext context = eglCreateContext(display, config, EGL_NO_CONTEXT, context_attribs);
+    if (context == EGL_NO_CONTEXT || !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context) ||
+        !gladLoadGLLoader((GLADloadproc) eglGetProcAddress)) {
+        return false;
+    }
+
+    // a surfaceless context has no default framebuffer
+    GLuint framebuffer, renderbuffers[2];
+    glGenFramebuffers(1, &framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glGenRenderbuffers(2, renderbuffers);
+    glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[0]);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, FRAME_WIDTH, FRAME_HEIGHT);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, renderbuffers[0]);
+    glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[1]);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, FRAME_WIDTH, FRAME_HEIGHT);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, renderbuffers[1]);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        return false;
+    }
+    glViewport(0, 0, FRAME_WIDTH, FRAME_HEIGHT);
+    glClearColor(0.2f, 0.3f, 0.8f, 1.0f);
+    glEnable(GL_DEPTH_TEST);
+    glEnable(GL_CULL_FACE);
+    return true;
+}
+#endif
+
+// peak resident set size of this process in kilobytes
+static long peak_rss_kb() {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+static double percentile(std::vector<double> values, double p) {
+    if (values.empty())
+        return 0.0;
+    std::sort(values.begin(), values.end());
+    size_t index = (size_t) (p * (values.size() - 1) + 0.5);
+    return values[index];
+}
+
+int main(int argc, char** argv) {
+    Options opts = parse_args(argc, argv);
+    if (!opts.keep_db) {
+        std::filesystem::remove_all(opts.db); // a region directory or a SQLite file
+    }
+
+#ifndef MC_HEADLESS
+    if (!make_gl_context()) {
+        std::cerr << "could not make a surfaceless EGL context\n";
+        return 1;
+    }
+    const char* renderer = (const char*) glGetString(GL_RENDERER);
+#else
+    const char* renderer = "none";
+#endif
+    World::setOcclusionQueries(opts.occlusion_queries);
+
+    database::initialize(opts.db.c_str(), opts.backend);
+    Block::initBlockData();
+    Chunk::initNoise(database::world_seed());
+    Player::setRenderDist(opts.render_dist);
+
+    Player player({ 0.0f, 100.0f, 0.0f }, (float) FRAME_WIDTH / FRAME_HEIGHT);
+    player.setSpeed(opts.speed);
+    Shader shader(BLOCK_VERTEX, BLOCK_FRAGMENT);
+    Shader lod_shader(LOD_VERTEX, BLOCK_FRAGMENT);
+#ifndef MC_HEADLESS
+    Texture texture_sheet(TEXTURE_SHEET, 0);
+    shader.addTexture(&texture_sheet, "u3_texture");
+    lod_shader.addTexture(&texture_sheet, "u3_texture");
+#endif
+
+    std::vector<double> frame_ms;
+    std::vector<int> request_depths, result_depths;
+    int num_frames = std::max(1, (int) (opts.seconds / FRAME_TIME));
+    frame_ms.reserve(num_frames);
+    request_depths.reserve(num_frames);
+    result_depths.reserve(num_frames);
+
+    // the square path turns 90 degrees every 10 seconds and the back path
+    // turns around every 10 seconds
+    int frames_per_side = (int) (10.0 / FRAME_TIME);
+    float mouse_x = 0.0f;
+    player.look(mouse_x, 0.0f);
+
+    World::Stats stats;
+    long long subchunks_rendered = 0, subchunks_occluded = 0, subchunks_hidden = 0;
+    Clock::time_point start = Clock::now();
+    {
+        World world(&shader, &lod_shader, &player);
+        Clock::time_point next_frame = Clock::now();
+        for (int frame = 0; frame < num_frames; ++frame) {
+            Clock::time_point frame_start = Clock::now();
+            if (opts.path != "straight" && frame > 0 && frame % frames_per_side == 0) {
+                // Player::look() takes mouse coordinates. 900 pixels at the
+                // default sensitivity is a 90 degree turn.
+                mouse_x += opts.path == "square" ? 900.0f : 1800.0f;
+                player.look(mouse_x, 0.0f);
+            }
+            player.move(Movement::FORWARD, (float) FRAME_TIME);
+            world.update(false);
+#ifndef MC_HEADLESS
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+#endif
+            world.renderAll();
+#ifndef MC_HEADLESS
+            glFinish(); // in place of the game's buffer swap, which waits for the frame
+#endif
+            Clock::time_point frame_end = Clock::now();
+            subchunks_rendered += player.chunks_rendered.first;
+            subchunks_occluded += player.chunks_occluded;
+            subchunks_hidden += player.chunks_hidden;
+            frame_ms.push_back(std::chrono::duration<double, std::milli>(frame_end - frame_start).count());
+            request_depths.push_back(database::pending_requests());
+            result_depths.push_back(database::pending_results());
+            profiler::end_frame();
+
+            // sleep until the next frame would start, like VSync does
+            next_frame += std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(FRAME_TIME));
+            std::this_thread::sleep_until(next_frame);
+        }
+        stats = world.getStats();
+    } // ~World() stops the chunk loader thread and stores updated chunks
+    database::close();
+    if (!opts.trace.empty() && !profiler::dump_trace(opts.trace.c_str())) {
+        std::cerr << "could not write " << opts.trace << '\n';
+    }
+    double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+    double mean_ms = 0.0;
+    for (double ms : frame_ms)
+        mean_ms += ms;
+    mean_ms /= std::max<size_t>(frame_ms.size(), 1);
+    int max_requests = *std::max_element(request_depths.begin(), request_depths.end());
+    int max_results = *std::max_element(result_depths.begin(), result_depths.end());
+
+    std::printf("{\n");
+    std::printf("  \"path\": \"%s\",\n", opts.path.c_str());
+    std::printf("  \"backend\": \"%s\",\n", opts.backend == database::Backend::SQLITE ? "sqlite" : "region");
+    std::printf("  \"seconds\": %.3f,\n", elapsed);
+    std::printf("  \"speed\": %.1f,\n", opts.speed);
+    std::printf("  \"render_distance\": %d,\n", opts.render_dist);
+    std::printf("  \"frames\": %d,\n", (int) frame_ms.size());
+    std::printf("  \"chunks_generated\": %d,\n", stats.generated);
+    std::printf("  \"chunks_loaded\": %d,\n", stats.loaded);
+    std::printf("  \"chunks_meshed\": %d,\n", stats.meshed);
+    std::printf("  \"generated_per_sec\": %.2f,\n", stats.generated / elapsed);
+    std::printf("  \"meshed_per_sec\": %.2f,\n", stats.meshed / elapsed);
+    std::printf("  \"prefetch_hits\": %lld,\n", profiler::get(profiler::Counter::DB_PREFETCH_HITS));
+    std::printf("  \"loads_cancelled\": %lld,\n", profiler::get(profiler::Counter::LOADS_CANCELLED));
+    std::printf("  \"loads_stale\": %lld,\n", profiler::get(profiler::Counter::LOADS_STALE));
+    std::printf("  \"structures\": %lld,\n", profiler::get(profiler::Counter::STRUCTURES));
+    std::printf("  \"structure_bytes\": %lld,\n", profiler::get(profiler::Counter::STRUCTURE_BYTES));
+    std::printf("  \"lod_tiles\": %lld,\n", profiler::get(profiler::Counter::LOD_TILES));
+    std::printf("  \"lod_bytes\": %lld,\n", profiler::get(profiler::Counter::LOD_BYTES));
+    std::printf("  \"renderer\": \"%s\",\n", renderer);
+    std::printf("  \"subchunks_per_frame\": { \"rendered\": %.1f, \"occluded\": %.1f },\n",
+                (double) subchunks_rendered / num_frames, (double) subchunks_occluded / num_frames);
+    // the skip rate as the F3 window shows it: of the subchunks that would
+    // have been drawn without the queries, the ones that were not
+    long long would_draw = subchunks_rendered + subchunks_hidden;
+    std::printf("  \"occlusion_queries\": { \"enabled\": %s, \"hidden_per_frame\": %.1f, \"skip_rate\": %.4f },\n",
+                opts.occlusion_queries ? "true" : "false", (double) subchunks_hidden / num_frames,
+                would_draw > 0 ? (double) subchunks_hidden / would_draw : 0.0);
+    std::printf("  \"vertices_per_frame\": { \"drawn\": %.0f, \"culled\": %.0f },\n",
+                (double) profiler::get(profiler::Counter::VERTICES_DRAWN) / num_frames,
+                (double) profiler::get(profiler::Counter::VERTICES_CULLED) / num_frames);
+    std::printf("  \"frame_ms\": { \"mean\": %.3f, \"p50\": %.3f, \"p99\": %.3f, \"max\": %.3f },\n",
+                mean_ms, percentile(frame_ms, 0.50), percentile(frame_ms, 0.99),
+                percentile(frame_ms, 1.0));
+    std::printf("  \"queue_depth\": { \"requests_p50\": %.0f, \"requests_max\": %d, "
+                "\"results_p50\": %.0f, \"results_max\": %d },\n",
+                percentile(std::vector<double>(request_depths.begin(), request_depths.end()), 0.5),
+                max_requests,
+                percentile(std::vector<double>(result_depths.begin(), result_depths.end()), 0.5),
+                max_results);
+    std::printf("  \"zones\": {\n");
+    for (int z = 0; z < profiler::NUM_ZONES; ++z) {
+        profiler::Zone zone = static_cast<profiler::Zone>(z);
+        profiler::ZoneTotals totals = profiler::totals(zone);
+        std::printf("    \"%s\": { \"count\": %lld, \"avg_ms\": %.3f, \"max_ms\": %.3f }%s\n",
+                    profiler::name(zone), totals.count,
+                    totals.count > 0 ? totals.total_ms / totals.count : 0.0, totals.max_ms,
+                    z + 1 < profiler::NUM_ZONES ? "," : "");
+    }
+    std::printf("  },\n");
+    std::printf("  \"peak_rss_kb\": %ld\n", peak_rss_kb());
+    std::printf("}\n");
+    return 0;
+}
@@ -85,7 +85,7 @@ namespace sglm {
     }
 
     float magnitude(const vec3& v) {
-        return std::sqrtf(v.x * v.x + v.y * v.y + v.z * v.z);
+        return std::sqrt(v.x * v.x + v.y * v.y + v.z * v.z);
     }
 
     vec3 normalize(const vec3& v) {
@@ -152,7 +152,7 @@ namespace sglm {
     }
 
     mat4 perspective(float v_fov, float ar, float near, float far) {
-        float a = 1.0f / std::tanf(v_fov / 2.0f), n = near, f = far;
+        float a = 1.0f / std::tan(v_fov / 2.0f), n = near, f = far;
         return {
             a / ar, 0,                     0,  0,
             0,      a,                     0,  0,
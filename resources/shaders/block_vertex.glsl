@@ -9,7 +9,7 @@ uniform mat4 u0_model;
 uniform mat4 u1_view;
 uniform mat4 u2_projection;
 
-const float light[4] = { 0.4, 0.6, 0.8, 1.0 };
+const float light[4] = float[4](0.4, 0.6, 0.8, 1.0);
 
 void main() {
 
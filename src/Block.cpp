@@ -346,9 +346,13 @@ namespace Block {
         }
     }
 
-    // Return the number of vertex_attrib_t that have been added to data
+    // Return the number of vertex_attrib_t that have been added to data. If
+    // faceDirs is not null, the direction of each face that was added is
+    // written to it (NO_DIR for faces that are always rendered). Every face
+    // with a direction is on that side of the block and faces that way.
     int getBlockData(BlockType type, int x, int y, int z, vertex_attrib_t* data,
-                     const std::array<BlockType, NUM_DIRECTIONS>& surrounding) {
+                     const std::array<BlockType, NUM_DIRECTIONS>& surrounding,
+                     Direction* faceDirs) {
         assert(x >= 0 && y >= 0 && z >= 0);
         assert(x < CHUNK_WIDTH && z < CHUNK_WIDTH);
         assert(y < SUBCHUNK_HEIGHT);
@@ -370,6 +374,9 @@ namespace Block {
             if (d[face] != NO_DIR && isSolid(surrounding[d[face]])) {
                 continue;
             }
+            if (faceDirs != nullptr) {
+                *faceDirs++ = d[face];
+            }
             // retrieve the face's data
             for (int vert = 0; vert < VERTICES_PER_FACE; ++vert) {
                 int index = face * VERTICES_PER_FACE + vert;
@@ -381,6 +388,13 @@ namespace Block {
         return size;
     }
 
+    // The texture of one face of a normal block: the bottom left corner of the
+    // texture on the texture sheet, packed like the texture bits of v3.
+    vertex_attrib_t getFaceTexture(BlockType type, Direction face) {
+        assert(isNormal(type) && face < NUM_DIRECTIONS);
+        return blockData[(int) type][face * VERTICES_PER_FACE].v3 & 0x3FF;
+    }
+
     sglm::vec3 getBlockPosition(const Vertex& vertex) {
         float x = (float) (vertex.v1 >> 11);
         float y = (float) ((vertex.v1 >> 5) & 0x1F);
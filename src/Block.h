@@ -43,8 +43,10 @@ namespace Block {
 
     void initBlockData();
     int getBlockData(BlockType type, int x, int y, int z, vertex_attrib_t* data,
-                     const std::array<BlockType, NUM_DIRECTIONS>& surrounding);
+                     const std::array<BlockType, NUM_DIRECTIONS>& surrounding,
+                     Direction* faceDirs = nullptr);
 
+    vertex_attrib_t getFaceTexture(BlockType type, Direction face);
     sglm::vec3 getVertexPosition(const Vertex& vertex);
     sglm::vec3 getBlockPosition(const Vertex& vertex);
     bool isReal(BlockType type);
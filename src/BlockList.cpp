@@ -3,6 +3,10 @@
 
 #include <cmath>
 #include <cassert>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <algorithm>
 
 // Methods for the class Chunk::BlockList. This class is used to reduce the
 // memory usage of storing each block in a chunk. This class finds the block
@@ -16,14 +20,9 @@ static constexpr int NO_BLOCK = (int) Block::BlockType::NO_BLOCK;
 typedef unsigned long long uint64;
 
 Chunk::BlockList::BlockList() {
-    m_data = nullptr;
     deleteAll();
 }
 
-Chunk::BlockList::~BlockList() {
-    delete[] m_data;
-}
-
 void Chunk::BlockList::create(const Block::BlockType* blocks, int size) {
     assert(blocks != nullptr);
     deleteAll();
@@ -38,8 +37,7 @@ void Chunk::BlockList::deleteAll() {
     m_bitmask = m_size = m_data_size = m_bits_per_block = m_blocks_per_ll = 0;
     m_index.fill(NO_BLOCK);
     m_palette.clear();
-    delete[] m_data;
-    m_data = nullptr;
+    m_data.reset();
     m_built = false;
 }
 
@@ -55,6 +53,7 @@ void Chunk::BlockList::put(int x, int y, int z, Block::BlockType block) {
     assert(m_built);
     assert(Block::isReal(block));
     add_block(block, true);
+    unshare();
     int block_index = Chunk::subchunk_index(x, y, z);
     int data_index = block_index / m_blocks_per_ll;
     int i = block_index % m_blocks_per_ll;
@@ -95,11 +94,15 @@ void Chunk::BlockList::add_block(Block::BlockType block, bool rebuild) {
     }
 }
 
+// the number of bits needed to store an index into a palette of the given size
+static int bits_for(size_t palette_size) {
+    int num_bits = static_cast<int>(std::ceil(std::log2(palette_size)));
+    return num_bits == 0 ? 1 : num_bits;
+}
+
 void Chunk::BlockList::build(const Block::BlockType* blocks) {
     assert(m_palette.size() > 0);
-    int num_bits = static_cast<int>(std::ceil(std::log2(m_palette.size())));
-    if (num_bits == 0)
-        num_bits = 1;
+    int num_bits = bits_for(m_palette.size());
     assert(num_bits > 0 && num_bits <= 16);
     if (num_bits == m_bits_per_block) {
         return;
@@ -116,18 +119,38 @@ void Chunk::BlockList::build(const Block::BlockType* blocks) {
     m_built = true;
 }
 
-// create m_data and fill it with the given blocks
-void Chunk::BlockList::fill_data(const Block::BlockType* blocks, int num_bits) {
+// create m_data (uninitialized) with room for m_size blocks of num_bits each
+void Chunk::BlockList::allocate_data(int num_bits) {
     m_bits_per_block = num_bits;
     assert(std::pow(2, m_bits_per_block) >= m_palette.size());
     m_bitmask = static_cast<uint64>(std::pow(2, m_bits_per_block) - 1);
-    delete[] m_data;
 
     // fit as many blocks into a 64-bit integer as we can,
     // without overflowing into the next one.
     m_blocks_per_ll = 64 / num_bits;
     m_data_size = m_size / m_blocks_per_ll + (m_size % m_blocks_per_ll != 0);
-    m_data = new uint64[m_data_size];
+    m_data = std::make_shared_for_overwrite<uint64[]>(m_data_size);
+}
+
+// Called before m_data is changed in place. If a copy of this BlockList (a
+// Chunk::Snapshot) still shares m_data, give this BlockList its own copy of
+// the data so that the snapshot does not change. Only the thread that edits
+// the chunk makes copies, so the count can not go up while this runs.
+void Chunk::BlockList::unshare() {
+    if (m_data.use_count() == 1) {
+        // a snapshot on another thread may have just let go of m_data. Its
+        // reads must happen before the writes that follow.
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return;
+    }
+    std::shared_ptr<uint64[]> data = std::make_shared_for_overwrite<uint64[]>(m_data_size);
+    std::copy(m_data.get(), m_data.get() + m_data_size, data.get());
+    m_data = std::move(data);
+}
+
+// create m_data and fill it with the given blocks
+void Chunk::BlockList::fill_data(const Block::BlockType* blocks, int num_bits) {
+    allocate_data(num_bits);
 
     // fill in m_data
     int block_index = 0;
@@ -145,3 +168,113 @@ void Chunk::BlockList::fill_data(const Block::BlockType* blocks, int num_bits) {
         }
     }
 }
+
+// Each BlockList is saved as its palette followed by runs of equal palette
+// indices, in the same order as m_data (y changes fastest, so most runs are
+// parts of columns):
+//   1 byte:             palette size (P)
+//   P bytes:            the palette (block ids)
+//   for each run:       run length (varint, 7 bits per byte), palette index (1 byte)
+// The runs add up to exactly m_size blocks. Appends the encoding to out.
+void Chunk::BlockList::encode(std::vector<unsigned char>& out) const {
+    assert(m_built);
+    assert(m_palette.size() < 256);
+    out.push_back((unsigned char) m_palette.size());
+    for (Block::BlockType block : m_palette) {
+        out.push_back((unsigned char) block);
+    }
+    auto add_run = [&out](unsigned int length, uint64 index) {
+        for (; length >= 0x80; length >>= 7) {
+            out.push_back((unsigned char) (length | 0x80));
+        }
+        out.push_back((unsigned char) length);
+        out.push_back((unsigned char) index);
+    };
+    // a word that holds m_blocks_per_ll copies of the given index
+    auto repeated = [this](uint64 index) {
+        uint64 word = 0;
+        for (int j = 0; j < m_blocks_per_ll; ++j) {
+            word |= index << (j * m_bits_per_block);
+        }
+        return word;
+    };
+    uint64 run_index = m_data[0] & m_bitmask;
+    uint64 run_word = repeated(run_index);
+    unsigned int run_length = 0;
+    int block_index = 0;
+    for (int i = 0; i < m_data_size; ++i) {
+        uint64 cur = m_data[i];
+        // whole words that continue the current run are common (stone, air)
+        if (cur == run_word && block_index + m_blocks_per_ll <= m_size) {
+            run_length += m_blocks_per_ll;
+            block_index += m_blocks_per_ll;
+            continue;
+        }
+        for (int j = 0; j < m_blocks_per_ll && block_index < m_size; ++j, ++block_index) {
+            uint64 index = cur & m_bitmask;
+            cur >>= m_bits_per_block;
+            if (index != run_index) {
+                add_run(run_length, run_index);
+                run_index = index;
+                run_word = repeated(index);
+                run_length = 0;
+            }
+            ++run_length;
+        }
+    }
+    add_run(run_length, run_index);
+}
+
+// Replace the contents of this BlockList with size blocks read from an
+// encoding made by encode(). The palette indices are written straight into
+// m_data. Returns a pointer to the first byte after the encoding, or nullptr
+// if the encoding is invalid (the BlockList is then left empty).
+const unsigned char* Chunk::BlockList::decode(const unsigned char* in, const unsigned char* end, int size) {
+    deleteAll();
+    if (in >= end || *in == 0 || end - in <= *in) {
+        return nullptr;
+    }
+    int palette_size = *in++;
+    for (int i = 0; i < palette_size; ++i) {
+        int block = *in++;
+        if (block >= (int) Block::BlockType::NUM_BLOCK_TYPES || m_index[block] != NO_BLOCK ||
+            !Block::isReal(static_cast<Block::BlockType>(block))) {
+            deleteAll();
+            return nullptr;
+        }
+        m_index[block] = i;
+        m_palette.push_back(static_cast<Block::BlockType>(block));
+    }
+    m_size = size;
+    allocate_data(bits_for(m_palette.size()));
+    std::fill(m_data.get(), m_data.get() + m_data_size, 0ULL);
+    int block_index = 0;
+    while (block_index < m_size) {
+        unsigned int length = 0;
+        int shift = 0;
+        while (in < end && (*in & 0x80) && shift < 28) {
+            length |= (unsigned int) (*in++ & 0x7F) << shift;
+            shift += 7;
+        }
+        if (in + 1 >= end) {
+            deleteAll();
+            return nullptr;
+        }
+        length |= (unsigned int) *in++ << shift;
+        uint64 index = *in++;
+        if (length == 0 || length > (unsigned int) (m_size - block_index) || index >= m_palette.size()) {
+            deleteAll();
+            return nullptr;
+        }
+        if (index == 0) {
+            block_index += length; // m_data starts as all zeros
+            continue;
+        }
+        for (int last = block_index + length; block_index < last; ++block_index) {
+            int shift_bits = m_bits_per_block * (block_index % m_blocks_per_ll);
+            m_data[block_index / m_blocks_per_ll] |= index << shift_bits;
+        }
+    }
+    m_built = true;
+    return in;
+}
@@ -3,6 +3,8 @@
 #include "Shader.h"
 #include "Mesh.h"
 #include "Face.h"
+#include "TerrainGen.h"
+#include "Profiler.h"
 #include <sglm/sglm.h>
 #include <new>
 #include <algorithm>
@@ -29,19 +31,23 @@ Chunk::~Chunk() {
 bool Chunk::wasUpdated() const { return m_updated; }
 void Chunk::updateHandled() { m_updated = false; }
 Chunk::Status Chunk::getStatus() const { return m_status; }
-void Chunk::setLoading() { m_status = Status::LOADING; }
-void Chunk::setToDelete() { m_toDelete = true; }
-
-// The caller is responsible for freeing the returned array.
-const void* Chunk::getBlockData() const {
-    Block::BlockType* data = new Block::BlockType[BLOCKS_PER_CHUNK];
-    for (int y = 0; y < NUM_SUBCHUNKS; ++y) {
-        Block::BlockType* subchunk_data = m_subchunks[y]->m_blocks.get_all();
-        std::copy(subchunk_data, subchunk_data + BLOCKS_PER_SUBCHUNK, data + y * BLOCKS_PER_SUBCHUNK);
-        delete[] subchunk_data;
+// The chunk's blocks are about to be loaded or generated. Both need its
+// noise field, and so do delta saves of it later. The cave lattice points on
+// its sides are copied from the neighbors that already have a noise field.
+void Chunk::setLoading() {
+    if (m_noise == nullptr) {
+        std::array<const NoiseField*, 4> neighbors;
+        for (int d = 0; d < 4; ++d) {
+            neighbors[d] = m_neighbors[d] == nullptr ? nullptr : m_neighbors[d]->m_noise.get();
+        }
+        std::shared_ptr<NoiseField> noise = std::make_shared<NoiseField>();
+        fillNoiseField(m_X, m_Z, *noise, neighbors);
+        m_noise = noise;
     }
-    return data;
+    m_status = Status::LOADING;
 }
+void Chunk::cancelLoading() { assert(m_status == Status::LOADING); m_status = Status::STRUCTURES; }
+void Chunk::setToDelete() { m_toDelete = true; }
 
 void Chunk::put(int x, int y, int z, Block::BlockType block) {
     assert(m_status >= Status::TERRAIN);
@@ -95,23 +101,136 @@ Block::BlockType Chunk::get(int x, int y, int z) const {
 }
 
 // the view and projection matrices must be set before this function is called.
-int Chunk::render(Shader* shader, const sglm::frustum& frustum) {
+// true if subchunk y can be drawn this frame: it is in the frustum and, if
+// view.frame is not 0, World::findVisible() visited it. The subchunks that
+// cannot be found that way are added to view.occluded.
+static bool can_be_seen(const Chunk* chunk, int y, unsigned int visitedFrame,
+                        const Mesh& mesh, Chunk::View& view) {
+    if (!chunk->inFrustum(y, *view.frustum)) {
+        return false;
+    }
+    if (view.frame != 0 && visitedFrame != view.frame) {
+        view.occluded += mesh.generated();
+        return false;
+    }
+    return true;
+}
+
+// The camera is in or right next to subchunk y, where the near plane can cut
+// off the box of an occlusion query.
+static bool near_camera(int cx, int y, int cz, const sglm::vec3& camera) {
+    constexpr float MARGIN = 1.0f;
+    float x0 = (float) (cx * CHUNK_WIDTH), y0 = (float) (y * SUBCHUNK_HEIGHT), z0 = (float) (cz * CHUNK_WIDTH);
+    return camera.x > x0 - MARGIN && camera.x < x0 + CHUNK_WIDTH + MARGIN &&
+           camera.y > y0 - MARGIN && camera.y < y0 + SUBCHUNK_HEIGHT + MARGIN &&
+           camera.z > z0 - MARGIN && camera.z < z0 + CHUNK_WIDTH + MARGIN;
+}
+
+// The ranges of the mesh of subchunk y (see Mesh::NUM_RANGES) that can have
+// faces that face the camera. A face in direction d is on side d of its block
+// and faces that way, so it can only be seen from that side of it. The +x
+// faces of a subchunk are all at x > x0, so none of them can be seen unless
+// camera.x > x0, and so on for the other directions.
+static unsigned int facing_ranges(int cx, int y, int cz, const sglm::vec3& camera) {
+    float x0 = (float) (cx * CHUNK_WIDTH), y0 = (float) (y * SUBCHUNK_HEIGHT), z0 = (float) (cz * CHUNK_WIDTH);
+    unsigned int ranges = 1u << NUM_DIRECTIONS; // faces of no single direction
+    ranges |= (unsigned int) (camera.x > x0) << PLUS_X;
+    ranges |= (unsigned int) (camera.x < x0 + CHUNK_WIDTH) << MINUS_X;
+    ranges |= (unsigned int) (camera.z > z0) << PLUS_Z;
+    ranges |= (unsigned int) (camera.z < z0 + CHUNK_WIDTH) << MINUS_Z;
+    ranges |= (unsigned int) (camera.y > y0) << PLUS_Y;
+    ranges |= (unsigned int) (camera.y < y0 + SUBCHUNK_HEIGHT) << MINUS_Y;
+    return ranges;
+}
+
+// Render the subchunks that can be seen (see can_be_seen()), but only the
+// faces that can face the camera (see facing_ranges()). With occlusion
+// queries, a subchunk whose query from the last frame says that its box was
+// hidden is not rendered, and one whose query is still pending is rendered
+// on the condition that the GPU does not have a result that says so.
+int Chunk::render(Shader* shader, View& view) {
     int subChunksRendered = 0;
     float cx = (float) (m_X * CHUNK_WIDTH);
     float cz = (float) (m_Z * CHUNK_WIDTH);
     for (int i = 0; i < NUM_SUBCHUNKS; ++i) {
+        const Mesh& mesh = m_subchunks[i]->m_mesh;
+        if (!can_be_seen(this, i, m_subchunks[i]->m_visitedFrame, mesh, view)) {
+            continue;
+        }
+        Mesh::Occlusion occlusion = Mesh::Occlusion::UNKNOWN;
+        if (view.occlusionQueries && mesh.generated() && !near_camera(m_X, i, m_Z, view.camera)) {
+            occlusion = mesh.getOcclusion(view.frame);
+        }
+        if (occlusion == Mesh::Occlusion::HIDDEN) {
+            ++view.hidden;
+            continue;
+        }
         float cy = (float) (i * SUBCHUNK_HEIGHT);
-        float ox = CHUNK_WIDTH / 2.0f;
-        float oy = SUBCHUNK_HEIGHT / 2.0f;
-        float oz = CHUNK_WIDTH / 2.0f;
-        if (frustum.contains({ cx + ox, cy + oy, cz + oz }, SUB_CHUNK_RADIUS)) {
-            shader->addUniformMat4f("u0_model", sglm::translate({ cx, cy, cz }));
-            subChunksRendered += m_subchunks[i]->m_mesh.render(shader);
+        shader->addUniformMat4f("u0_model", sglm::translate({ cx, cy, cz }));
+        unsigned int ranges = facing_ranges(m_X, i, m_Z, view.camera);
+        unsigned int drawn = mesh.getVertexCount(ranges);
+        profiler::add(profiler::Counter::VERTICES_DRAWN, drawn);
+        profiler::add(profiler::Counter::VERTICES_CULLED, mesh.getVertexCount() - drawn);
+        if (occlusion == Mesh::Occlusion::PENDING) {
+            subChunksRendered += mesh.renderConditional(shader, ranges);
+        } else {
+            subChunksRendered += mesh.render(shader, ranges);
         }
     }
     return subChunksRendered;
 }
 
+// Issue an occlusion query for each subchunk that can be seen, by drawing
+// box (a 1x1x1 cube) over the whole subchunk. The queries are tested against
+// the depth buffer of this frame and used by render() in the next frame.
+// Must be called between Mesh::startQueries() and Mesh::endQueries().
+void Chunk::queryOcclusion(Shader* shader, const View& view, const Mesh& box) {
+    View counted = view; // can_be_seen() counts the subchunks again
+    for (int i = 0; i < NUM_SUBCHUNKS; ++i) {
+        Mesh& mesh = m_subchunks[i]->m_mesh;
+        if (!mesh.generated() || near_camera(m_X, i, m_Z, view.camera) ||
+            !can_be_seen(this, i, m_subchunks[i]->m_visitedFrame, mesh, counted)) {
+            continue;
+        }
+        float x = (float) (m_X * CHUNK_WIDTH), y = (float) (i * SUBCHUNK_HEIGHT), z = (float) (m_Z * CHUNK_WIDTH);
+        sglm::mat4 model = {
+            CHUNK_WIDTH, 0,               0,           0,
+            0,           SUBCHUNK_HEIGHT, 0,           0,
+            0,           0,               CHUNK_WIDTH, 0,
+            x,           y,               z,           1,
+        };
+        shader->addUniformMat4f("u0_model", model);
+        mesh.beginQuery(view.frame);
+        box.render(shader);
+        mesh.endQuery();
+    }
+}
+
+bool Chunk::inFrustum(int y, const sglm::frustum& frustum) const {
+    float cx = (float) (m_X * CHUNK_WIDTH) + CHUNK_WIDTH / 2.0f;
+    float cy = (float) (y * SUBCHUNK_HEIGHT) + SUBCHUNK_HEIGHT / 2.0f;
+    float cz = (float) (m_Z * CHUNK_WIDTH) + CHUNK_WIDTH / 2.0f;
+    return frustum.contains({ cx, cy, cz }, SUB_CHUNK_RADIUS);
+}
+
+// true if subchunk y can be seen through from face from to face to. A chunk
+// without a mesh hides nothing.
+bool Chunk::connects(int y, Direction from, Direction to) const {
+    if (m_status != Status::FULL) {
+        return true;
+    }
+    return (m_subchunks[y]->m_visibility >> (from * NUM_DIRECTIONS + to)) & 1;
+}
+
+// Returns false if subchunk y was already visited in this frame.
+bool Chunk::visit(int y, unsigned int frame) {
+    if (m_subchunks[y]->m_visitedFrame == frame) {
+        return false;
+    }
+    m_subchunks[y]->m_visitedFrame = frame;
+    return true;
+}
+
 // called (basically) every frame by World::update()
 bool Chunk::update() {
     bool rendered = false;
@@ -142,6 +261,12 @@ void Chunk::addBlockData(const Block::BlockType* blockData) {
     for (int y = 0; y < NUM_SUBCHUNKS; ++y) {
         m_subchunks[y]->m_blocks.create(blockData + y * BLOCKS_PER_SUBCHUNK, BLOCKS_PER_SUBCHUNK);
     }
+    setTerrain();
+}
+
+// Called once the block data of every subchunk has been created.
+void Chunk::setTerrain() {
+    assert(m_status == Status::LOADING);
     for (int neighbor = 0; neighbor < 4; ++neighbor) {
         Chunk* n = m_neighbors[neighbor];
         assert(n->m_neighbors[neighbor + (neighbor % 2 ? -1 : 1)] == this);
@@ -151,6 +276,18 @@ void Chunk::addBlockData(const Block::BlockType* blockData) {
     m_status = Status::TERRAIN;
 }
 
+Chunk::Snapshot Chunk::takeSnapshot() const {
+    assert(m_status >= Status::TERRAIN);
+    Snapshot snapshot;
+    snapshot.m_X = m_X;
+    snapshot.m_Z = m_Z;
+    snapshot.m_noise = getNoiseField();
+    for (int y = 0; y < NUM_SUBCHUNKS; ++y) {
+        snapshot.m_blocks[y] = m_subchunks[y]->m_blocks;
+    }
+    return snapshot;
+}
+
 void Chunk::deleteBlockData() {
     assert(m_status == Status::TERRAIN || m_status == Status::FULL);
     for (Subchunk* subchunk : m_subchunks) {
@@ -9,17 +9,23 @@
 
 #include <vector>
 #include <array>
+#include <memory>
+#include <utility>
 
 // Each chunk is a 16x128x16 section of the world. All the blocks of a chunk
 // are generated, loaded, and stored together. Each chunk is divided into 8
 // 16x16x16 meshes.
 
+class MicroBench; // bench/MicroBench.cpp, times the private kernels below
+struct NoiseField; // TerrainGen.h
+
 class Chunk {
+    friend class MicroBench;
 
 public:
     enum class Status : unsigned char {
         EMPTY,          // chunk is created, but nothing has been generated/loaded yet
-        STRUCTURES,     // structures originating in this chunk have been created
+        STRUCTURES,     // the structures of this chunk's region have been created
         LOADING,        // This chunk is currently getting data from the db or from generateTerrain
         TERRAIN,        // This chunk's terrain has been generated (or loaded from db)
         FULL,           // This chunk is fully generated (has 4 neighbors with
@@ -27,14 +33,15 @@ public:
     };
 
 private:
-    // Implementation in BlockList.cpp
+    // Implementation in BlockList.cpp. Copying a BlockList shares m_data
+    // between the copies until one of them is written to (see unshare()).
     class BlockList {
         typedef unsigned long long uint64;
 
         std::vector<Block::BlockType> m_palette; // map from condensed id to block id
         std::array<int, (int) Block::BlockType::NUM_BLOCK_TYPES> m_index; // map from block id to condensed id
         uint64 m_bitmask;     // has m_bits_per_block least-significant bits set to 1
-        uint64* m_data;       // stores the condensed block ids
+        std::shared_ptr<uint64[]> m_data; // stores the condensed block ids
         int m_data_size;      // the number of uint64s in m_data
         int m_bits_per_block; // number of bits used to represent each block
         int m_blocks_per_ll;  // number of blocks in each uint64 in m_data
@@ -44,24 +51,31 @@ private:
 
     public:
         BlockList();
-        ~BlockList();
 
         Block::BlockType get(int x, int y, int z) const;
         void put(int x, int y, int z, Block::BlockType block);
         Block::BlockType* get_all() const;
         void create(const Block::BlockType* blocks, int size);
         void deleteAll();
+        void encode(std::vector<unsigned char>& out) const;
+        const unsigned char* decode(const unsigned char* in, const unsigned char* end, int size);
 
     private:
         void add_block(Block::BlockType block, bool rebuild);
         void build(const Block::BlockType* blocks);
+        void allocate_data(int num_bits);
         void fill_data(const Block::BlockType* blocks, int num_bits);
+        void unshare();
     };
 
     // Implementation in Subchunk.cpp
     struct Subchunk {
         const int m_Y;
         int m_mesh_size; // number of attributes
+        // bit (a * NUM_DIRECTIONS + b) is set if face a of the subchunk can be
+        // seen from face b through blocks that are not solid
+        unsigned long long m_visibility;
+        unsigned int m_visitedFrame; // see World::findVisible()
         Mesh m_mesh;
         BlockList m_blocks;
 
@@ -69,10 +83,31 @@ private:
         void updateMesh(const Chunk* this_chunk);
 
     private:
-        unsigned int getVertexData(const Chunk* this_chunk, int byte_lim,
-                                   vertex_attrib_t* data) const;
+        friend class ::MicroBench;
+        unsigned int getVertexData(const Chunk* this_chunk, const Block::BlockType* blocks,
+                                   int byte_lim, vertex_attrib_t* data,
+                                   std::array<unsigned int, Mesh::NUM_RANGES>& rangeCounts) const;
+        void updateVisibility(const Block::BlockType* blocks);
     };
 
+public:
+    // The blocks of a chunk at one moment, so that they can be saved on
+    // another thread while the chunk keeps changing. Taking a snapshot does
+    // not copy the block data: a subchunk's data is only copied if the chunk
+    // is edited while the snapshot still shares it.
+    class Snapshot {
+        friend class Chunk;
+        int m_X, m_Z;
+        std::array<BlockList, NUM_SUBCHUNKS> m_blocks;
+        std::shared_ptr<const NoiseField> m_noise; // for saving as a delta
+
+    public:
+        std::pair<int, int> getPosition() const { return { m_X, m_Z }; }
+        // see Chunk::serialize()
+        void serialize(std::vector<unsigned char>& out, int seed, bool allowDelta = true) const; // in Serialize.cpp
+    };
+
+private:
     const int m_X, m_Z;
     std::array<Subchunk*, NUM_SUBCHUNKS> m_subchunks;
     std::array<Chunk*, 4> m_neighbors;
@@ -80,6 +115,7 @@ private:
     bool m_updated;
     Status m_status;
     bool m_toDelete; // true if block data should be deleted
+    std::shared_ptr<const NoiseField> m_noise; // made by setLoading()
 
 public:
     Chunk(int x, int z);
@@ -88,12 +124,30 @@ public:
     Block::BlockType get(int x, int y, int z) const;
     void put(int x, int y, int z, Block::BlockType block);
 
+    // what World::renderAll() renders in one frame, and what it skipped
+    struct View {
+        const sglm::frustum* frustum;
+        sglm::vec3 camera;
+        unsigned int frame;     // see World::findVisible(), 0 if there was no search
+        bool occlusionQueries;  // see queryOcclusion()
+        int occluded;           // not found by World::findVisible()
+        int hidden;             // hidden by an occlusion query
+    };
+
     bool update();
-    int render(Shader* shader, const sglm::frustum& frustum);
+    int render(Shader* shader, View& view);
+    void queryOcclusion(Shader* shader, const View& view, const Mesh& box);
+    bool inFrustum(int y, const sglm::frustum& frustum) const;
+    bool connects(int y, Direction from, Direction to) const;
+    bool visit(int y, unsigned int frame);
 
     void addBlockData(const Block::BlockType* blockData);
     void deleteBlockData();
-    const void* getBlockData() const;
+    Snapshot takeSnapshot() const;
+    void serialize(std::vector<unsigned char>& out, int seed, bool allowDelta = true) const; // in Serialize.cpp
+    bool deserialize(const unsigned char* data, int size); // in Serialize.cpp
+    // a snapshot of blocks (BLOCKS_PER_CHUNK of them) that are not in a chunk
+    static void serializeBlocks(const Block::BlockType* blocks, std::vector<unsigned char>& out); // in Serialize.cpp
 
     void addNeighbor(Chunk* chunk, Direction direction);
     void removeNeighbor(Direction direction);
@@ -104,14 +158,19 @@ public:
     void updateHandled();
     Status getStatus() const;
     void setLoading();
+    void cancelLoading(); // back to Status::STRUCTURES
     void setToDelete();
 
-    static void initNoise(); // in TerrainGen.cpp
+    static void initNoise(int seed = WORLD_SEED); // in TerrainGen.cpp
     void generateTerrain(Block::BlockType* data, int seed) const; // in TerrainGen.cpp
 
     void generateStructures();
 
 private:
+    std::shared_ptr<const NoiseField> getNoiseField() const; // in TerrainGen.cpp
+    static void generateTerrain(int cx, int cz, const NoiseField& noise,
+                                Block::BlockType* data, int seed); // in TerrainGen.cpp
+    void setTerrain();
     static int chunk_index(int x, int y, int z);
     static int subchunk_index(int x, int y, int z);
 };
@@ -20,10 +20,14 @@ inline const char* WINDOW_TITLE = "Minecraft in OpenGL";
 // Paths to resources from the solution directory
 inline const char* BLOCK_VERTEX = "resources/shaders/block_vertex.glsl";
 inline const char* BLOCK_FRAGMENT = "resources/shaders/block_fragment.glsl";
+inline const char* LOD_VERTEX = "resources/shaders/lod_vertex.glsl";
 inline const char* UI_VERTEX = "resources/shaders/ui_vertex.glsl";
 inline const char* UI_FRAGMENT = "resources/shaders/ui_fragment.glsl";
 inline const char* TEXTURE_SHEET = "resources/textures/texture_sheet.png";
 
+// File that F4 writes profiler trace events to (see Profiler.h)
+inline const char* TRACE_FILE = "trace.json";
+
 // This is about the distance from the center of a 16x16x16 sub-chunk to one
 // of its corners. This value is used during frustum culling to determine
 // whether a sub-chunk is within the view frustum. It is much easier to treat
@@ -54,7 +58,13 @@ inline constexpr int SUBCHUNK_HEIGHT = 32;
 inline constexpr int NUM_SUBCHUNKS = CHUNK_HEIGHT / SUBCHUNK_HEIGHT;
 inline constexpr int BLOCKS_PER_SUBCHUNK = BLOCKS_PER_CHUNK / NUM_SUBCHUNKS;
 
+// Seed of a new world. Each world stores the seed its terrain is generated
+// with (see database::world_seed()), since chunks are saved as changes to
+// that terrain (see Serialize.cpp), and tools/Pregenerate.cpp can make a
+// world with another seed.
+inline constexpr int WORLD_SEED = 1337;
+
 inline constexpr float NEAR_PLANE = 0.1f;
-inline constexpr float FAR_PLANE = 600.0f;
+inline constexpr float FAR_PLANE = 600.0f; // at least (see Player::getFarPlane())
 
 #endif
@@ -1,9 +1,16 @@
 #include "Database.h"
-#include <sqlite3/sqlite3.h>
+#include "Storage.h"
+#include "Profiler.h"
+#include "SpscRing.h"
+#include "Constants.h"
 #include <thread>
+#include <atomic>
 #include <mutex>
+#include <condition_variable>
 #include <queue>
-#include <iostream>
+#include <map>
+#include <set>
+#include <vector>
 #include <cassert>
 #include <cstring>
 #include <chrono>
@@ -12,119 +19,831 @@ using namespace std::chrono_literals;
 
 namespace database {
 
-    static const char* DATABASE_FILE_NAME = "MCDB.db";
-    static const char* CREATE_TABLE = "CREATE TABLE IF NOT EXISTS mcdb_table (x INT,"
-        "z INT, data BLOB NOT NULL, CONSTRAINT mcdb_pk PRIMARY KEY (x, z));";
-    static const char* SELECT_ROW = "SELECT data FROM mcdb_table WHERE x = ? AND z = ?";
-    static const char* INSERT_ROW = "INSERT OR REPLACE INTO mcdb_table VALUES (?, ?, ?)";
+    // After the first store arrives, the writer waits this long for more
+    // stores so that they are all written in one transaction.
+    static constexpr auto STORE_BATCH_WINDOW = 20ms;
 
-    static std::queue<Query> request_queue;
+    // Loads are done by NUM_READERS reader threads, each with its own
+    // connection from Storage::openReader(), so they never wait for the
+    // writer thread to finish storing. A reader takes at most MAX_LOAD_BATCH
+    // loads at a time so that a burst of loads is shared between readers.
+    // If the backend has no readers, the writer thread does the loads too,
+    // all that are queued at once.
+    static constexpr int NUM_READERS = 2;
+    static constexpr size_t MAX_LOAD_BATCH = 64;
+
+    // Loads that need the storage, stores, cancels and prefetches are pushed
+    // into a ring of the thread that makes them, made on its first request
+    // after initialize(). They are taken from every ring and handed to the
+    // readers and the writer by the dispatcher thread, or by the reader that
+    // a load woke up if it gets there first, so that a load does not wait
+    // for two threads to be scheduled. A thread that finds its ring full
+    // waits for the dispatcher, which never waits for anything but the
+    // mutexes.
+    static constexpr int QUERY_CANCEL = 3;
+    static constexpr int QUERY_PREFETCH = 4;
+    static constexpr size_t REQUEST_RING_SIZE = 1024;
+    static constexpr auto RING_FULL_WAIT = 100us;
+    using RequestRing = SpscRing<Query, REQUEST_RING_SIZE>;
+    static std::vector<RequestRing*> request_rings; // guarded by request_rings_mutex
+    static std::mutex request_rings_mutex;
+    static unsigned int session; // of the rings, changed by close() so that no thread uses an old ring
+    static std::atomic<unsigned int> request_signal; // changed after every push, the dispatcher waits on it
+    static std::atomic<int> undispatched; // loads and stores in the rings
+    static std::atomic<int> stores_in_rings;
+    static std::atomic<int> loads_in_rings; // counted after the push, so a reader that sees it finds the load
+    static std::mutex dispatch_mutex; // held while taking requests from the rings
+    // Set by close(). The dispatcher stops once the rings are empty, and no
+    // thread waits for results to be taken any more.
+    static std::atomic<bool> closing;
+
+    // Every chunk that is in the storage or waiting to be stored, with the
+    // number of its stores that are still in the request rings. A load of
+    // any other chunk, or of a staged chunk, is answered by request_load()
+    // itself, without a trip through the rings. Guarded by key_mutex, which
+    // is only held to look up or change a few keys. A thread that holds
+    // request_queue_mutex may lock key_mutex, but not the other way around.
+    static std::map<std::pair<int, int>, int> stored_keys;
+    static std::mutex key_mutex;
+
+    // Loads are taken in the order they were requested (chunks that are
+    // waiting to be stored are answered by the dispatcher). A
+    // cancelled load is left in load_queue with type QUERY_NONE. The queue is
+    // emptied whenever every load in it has been taken, so it does not
+    // allocate once it has grown to the most loads that are queued at once.
+    // Stores are kept per (x, z) so that storing a chunk that is already
+    // waiting to be stored replaces the old data instead of writing the
+    // chunk twice.
+    static std::vector<Query> load_queue;
+    static size_t load_queue_head; // the next load to take
+    static size_t num_queued_loads; // not taken or cancelled
+    static std::map<std::pair<int, int>, Query> store_queue;
     static std::mutex request_queue_mutex;
+    static std::condition_variable load_cv;  // readers wait for loads and prefetches
+    static std::condition_variable store_cv; // the writer waits for stores
+
+    // Stores that the writer has taken from store_queue and not yet
+    // committed. A load of a chunk in store_queue or here is answered with a
+    // copy of the data, since a reader could still see the old data. Guarded
+    // by request_queue_mutex.
+    static std::map<std::pair<int, int>, Buffer*> writing;
+
+    // Chunks that request_prefetch() asked for are read when there are no
+    // loads to do, and kept in the staging cache until they are requested,
+    // stored or evicted (oldest first). prefetch_queue and prefetch_keys are
+    // guarded by request_queue_mutex, staging_cache by key_mutex.
+    static constexpr size_t STAGING_CAPACITY = 256;
+    static constexpr size_t MAX_PREFETCH_BATCH = 64;
+    struct Staged {
+        Buffer* data;
+        unsigned long long age;
+    };
+    static std::queue<std::pair<int, int>> prefetch_queue;
+    static std::set<std::pair<int, int>> prefetch_keys; // the keys in prefetch_queue
+    static std::map<std::pair<int, int>, Staged> staging_cache;
+    static unsigned long long staging_age;
+
+    // Prefetches that a thread is reading, with the batch that reads them.
+    // Storing a chunk removes it, so a reader that saw the old data does not
+    // stage it. Guarded by key_mutex.
+    static std::map<std::pair<int, int>, unsigned long long> reading;
+    static unsigned long long last_batch; // guarded by request_queue_mutex
 
-    static std::queue<Query> result_queue;
-    static std::mutex result_queue_mutex;
-
-    static bool thread_should_close;
-
-    static inline void check(int error_code, int sqlite_call_index) {
-#ifndef NDEBUG
-        if (error_code != SQLITE_OK && error_code != SQLITE_DONE) {
-            std::cout << "Error on sqlite call #" << sqlite_call_index << std::endl;
-            std::cout << "SQLiteError: " << sqlite3_errstr(error_code) << std::endl;
-        }
-#else
-        (void) error_code, sqlite_call_index; // avoid unused variable warnings
-#endif
-    }
-
-    static void db_thread_func() {
-        check(sqlite3_initialize(), 1);
-        sqlite3* db = nullptr;
-        check(sqlite3_open(DATABASE_FILE_NAME, &db), 2);
-        check(sqlite3_exec(db, CREATE_TABLE, nullptr, nullptr, nullptr), 3);
-        sqlite3_stmt* select_stmt = nullptr;
-        sqlite3_stmt* insert_stmt = nullptr;
-        check(sqlite3_prepare_v2(db, SELECT_ROW, -1, &select_stmt, nullptr), 4);
-        check(sqlite3_prepare_v2(db, INSERT_ROW, -1, &insert_stmt, nullptr), 5);
-
-        while (!thread_should_close || !request_queue.empty()) {
-            Query request = { QUERY_NONE, 0, 0, 0, nullptr };
-            if (!request_queue.empty()) {
-                request_queue_mutex.lock();
-                request = request_queue.front();
-                request_queue.pop();
-                request_queue_mutex.unlock();
-            }
-            if (request.type == QUERY_LOAD) {
-                assert(request.data == nullptr);
-                check(sqlite3_bind_int(select_stmt, 1, request.x), 6);
-                check(sqlite3_bind_int(select_stmt, 2, request.z), 7);
-                if (sqlite3_step(select_stmt) == SQLITE_DONE) {
-                    result_queue_mutex.lock();
-                    result_queue.emplace(QUERY_LOAD, request.x, request.z, 0, nullptr);
-                    result_queue_mutex.unlock();
-                } else {
-                    int blob_size = sqlite3_column_bytes(select_stmt, 0);
-                    const void* blob_data = sqlite3_column_blob(select_stmt, 0);
-                    void* block_data = new unsigned char[blob_size];
-                    memcpy(block_data, blob_data, blob_size);
-                    result_queue_mutex.lock();
-                    result_queue.emplace(QUERY_LOAD, request.x, request.z, 0, block_data);
-                    result_queue_mutex.unlock();
+    // Each database thread sends its results to the thread that takes them
+    // (see get_load_results()) through its own ring. A reader or the writer
+    // that finds its ring full waits for results to be taken, and the
+    // dispatcher keeps what does not fit and pushes it later. Loads that
+    // request_load() answers itself go into immediate_results, guarded by
+    // key_mutex, since any thread may make them.
+    static constexpr size_t RESULT_RING_SIZE = 1024;
+    using ResultRing = SpscRing<Query, RESULT_RING_SIZE>;
+    static std::vector<ResultRing*> result_rings; // one per reader, then the writer's and the dispatcher's
+    static std::vector<Query> immediate_results;
+    static std::atomic<bool> has_immediate_results;
+    static std::atomic<int> num_results; // in the rings, immediate_results and the dispatcher's overflow
+
+    // At most MAX_POOLED_BUFFERS released buffers are kept. Pooled buffers
+    // keep their capacity, which is the size of the largest chunk they held.
+    static constexpr size_t MAX_POOLED_BUFFERS = 256;
+    static std::vector<Buffer*> buffer_pool;
+    static std::mutex buffer_pool_mutex;
+
+    static bool thread_should_close; // guarded by request_queue_mutex
+    static Storage* storage; // nullptr if it could not be opened
+    static int seed; // of the world, see world_seed()
+    static std::vector<Storage*> readers; // empty if the storage has no readers
+
+    // Counted before it is pushed so that num_results is never too small. If
+    // the ring is full, wait until the requesting thread has taken results,
+    // unless the database is closing and no more results will be taken.
+    static void push_result(ResultRing& ring, const Query& result) {
+        profiler::set(profiler::Counter::DB_RESULT_QUEUE, ++num_results);
+        while (!ring.push(result)) {
+            if (closing) {
+                --num_results;
+                release_buffer(result.data);
+                return;
+            }
+            std::this_thread::sleep_for(RING_FULL_WAIT);
+        }
+    }
+
+    // Push as many answers as fit and keep the rest for the next call, so
+    // that the dispatcher never waits for results to be taken. The answers
+    // were already counted.
+    static void push_answers(ResultRing& ring, std::vector<Query>& answers) {
+        size_t pushed = 0;
+        while (pushed < answers.size() && ring.push(answers[pushed])) {
+            ++pushed;
+        }
+        answers.erase(answers.begin(), answers.begin() + pushed);
+    }
+
+    // Called with key_mutex locked.
+    static void push_immediate_result(const Query& result) {
+        immediate_results.push_back(result);
+        has_immediate_results.store(true, std::memory_order_release);
+        profiler::set(profiler::Counter::DB_RESULT_QUEUE, ++num_results);
+    }
+
+    static void signal_dispatcher() {
+        request_signal.fetch_add(1, std::memory_order_release);
+        request_signal.notify_one();
+    }
+
+    // Counted before it is pushed so that pending_requests() is never too
+    // small. A load also wakes a reader without locking request_queue_mutex,
+    // so the reader may miss it; then the dispatcher hands it over.
+    static void push_request(const Query& request) {
+        struct Producer {
+            RequestRing* ring = nullptr;
+            unsigned int session = 0;
+        };
+        thread_local Producer producer;
+        if (producer.ring == nullptr || producer.session != session) {
+            producer.ring = new RequestRing;
+            producer.session = session;
+            request_rings_mutex.lock();
+            request_rings.push_back(producer.ring);
+            request_rings_mutex.unlock();
+        }
+        if (request.type == QUERY_LOAD || request.type == QUERY_STORE) {
+            ++undispatched;
+        }
+        if (request.type == QUERY_STORE) {
+            ++stores_in_rings;
+        }
+        while (!producer.ring->push(request)) {
+            std::this_thread::sleep_for(RING_FULL_WAIT);
+        }
+        if (request.type == QUERY_LOAD) {
+            ++loads_in_rings;
+            (readers.empty() ? store_cv : load_cv).notify_one();
+        }
+        signal_dispatcher();
+    }
+
+    static bool is_being_stored(const std::pair<int, int>& key) {
+        return store_queue.count(key) || writing.count(key);
+    }
+
+    static bool has_loads() {
+        return num_queued_loads > 0 || !prefetch_queue.empty();
+    }
+
+    // Called with request_queue_mutex locked.
+    static int count_requests() {
+        return undispatched + (int) (num_queued_loads + store_queue.size());
+    }
+
+    static void update_request_counter() {
+        profiler::set(profiler::Counter::DB_REQUEST_QUEUE, count_requests());
+    }
+
+    // Take queued loads (and their generations), or prefetches if there are
+    // no loads. Returns the number of loads (the rest of keys are
+    // prefetches) and sets batch. Called with request_queue_mutex locked.
+    static size_t take_loads(std::vector<std::pair<int, int>>& keys, std::vector<unsigned int>& generations,
+                             unsigned long long& batch) {
+        size_t max_loads = readers.empty() ? num_queued_loads : MAX_LOAD_BATCH;
+        for (; load_queue_head < load_queue.size() && keys.size() < max_loads; ++load_queue_head) {
+            const Query& load = load_queue[load_queue_head];
+            if (load.type == QUERY_LOAD) {
+                keys.push_back({ load.x, load.z });
+                generations.push_back(load.generation);
+            }
+        }
+        size_t num_loads = keys.size();
+        num_queued_loads -= num_loads;
+        if (num_queued_loads == 0) {
+            load_queue.clear();
+            load_queue_head = 0;
+        }
+        batch = ++last_batch;
+        // read ahead only when no chunk is waiting to be loaded, and skip
+        // chunks that were stored after they were queued
+        if (num_loads == 0 && !prefetch_queue.empty()) {
+            key_mutex.lock();
+            for (; !prefetch_queue.empty() && keys.size() < MAX_PREFETCH_BATCH; prefetch_queue.pop()) {
+                const std::pair<int, int>& key = prefetch_queue.front();
+                prefetch_keys.erase(key);
+                if (!is_being_stored(key)) {
+                    keys.push_back(key);
+                    reading[key] = batch;
                 }
-                check(sqlite3_reset(select_stmt), 8);
             }
-            else if (request.type == QUERY_STORE) {
-                assert(request.data != nullptr);
-                check(sqlite3_bind_int(insert_stmt, 1, request.x), 9);
-                check(sqlite3_bind_int(insert_stmt, 2, request.z), 10);
-                check(sqlite3_bind_blob(insert_stmt, 3, request.data, request.size, SQLITE_STATIC), 11);
-                check(sqlite3_step(insert_stmt), 12);
-                check(sqlite3_reset(insert_stmt), 13);
-                delete[] request.data;
+            key_mutex.unlock();
+        }
+        update_request_counter();
+        return num_loads;
+    }
+
+    // Put the chunks that batch prefetched into the staging cache, unless
+    // the chunk was stored while it was being read or a store of it is
+    // still in a request ring. Called with key_mutex locked.
+    static void stage(const std::vector<std::pair<int, int>>& keys, const std::vector<Buffer*>& buffers,
+                      const std::vector<bool>& found, size_t first, unsigned long long batch,
+                      std::vector<Buffer*>& unused) {
+        for (size_t i = first; i < keys.size(); ++i) {
+            auto r = reading.find(keys[i]);
+            bool current = r != reading.end() && r->second == batch;
+            if (current) {
+                reading.erase(r);
             }
-            else {
-                // the request queue was empty, so sleep for 100ms
-                std::this_thread::sleep_for(100ms);
+            if (!current || !found[i] || stored_keys[keys[i]] > 0 || staging_cache.count(keys[i])) {
+                unused.push_back(buffers[i]);
+                continue;
             }
+            staging_cache[keys[i]] = { buffers[i], staging_age++ };
+        }
+        while (staging_cache.size() > STAGING_CAPACITY) {
+            auto oldest = staging_cache.begin();
+            for (auto itr = staging_cache.begin(); itr != staging_cache.end(); ++itr) {
+                if (itr->second.age < oldest->second.age) {
+                    oldest = itr;
+                }
+            }
+            unused.push_back(oldest->second.data);
+            staging_cache.erase(oldest);
+        }
+    }
+
+    // Read keys from the storage in one batch, push the results of the first
+    // num_loads keys and stage the rest.
+    static void load(Storage* from, ResultRing& results, const std::vector<std::pair<int, int>>& keys,
+                     const std::vector<unsigned int>& generations, size_t num_loads, unsigned long long batch) {
+        std::vector<Buffer*> buffers, unused;
+        std::vector<bool> found;
+        {
+            PROFILE_ZONE(profiler::Zone::DB_LOAD);
+            for (size_t i = 0; i < keys.size(); ++i) {
+                buffers.push_back(acquire_buffer());
+            }
+            if (from != nullptr) {
+                from->begin();
+                from->loadBatch(keys, buffers, found);
+                from->commit();
+            } else {
+                found.assign(keys.size(), false);
+            }
+        }
+        for (size_t i = 0; i < num_loads; ++i) {
+            if (!found[i]) {
+                release_buffer(buffers[i]);
+            }
+            push_result(results, { QUERY_LOAD, keys[i].first, keys[i].second, found[i] ? buffers[i] : nullptr, generations[i] });
+        }
+        if (keys.size() > num_loads) {
+            key_mutex.lock();
+            stage(keys, buffers, found, num_loads, batch, unused);
+            key_mutex.unlock();
+        }
+        for (Buffer* buffer : unused) {
+            release_buffer(buffer);
+        }
+    }
+
+    // Answer a load from memory if it can be, or queue it. The chunk may
+    // have been staged since request_load() looked. Called by the
+    // dispatcher with request_queue_mutex and key_mutex locked. Returns true
+    // if it was queued.
+    static bool dispatch_load(const Query& load, std::vector<Query>& answers) {
+        std::pair<int, int> key = { load.x, load.z };
+        auto staged = staging_cache.find(key);
+        if (staged != staging_cache.end()) {
+            answers.push_back({ QUERY_LOAD, load.x, load.z, staged->second.data, load.generation });
+            staging_cache.erase(staged);
+            profiler::add(profiler::Counter::DB_PREFETCH_HITS, 1);
+            return false;
+        }
+        const Buffer* pending = nullptr;
+        if (auto s = store_queue.find(key); s != store_queue.end()) {
+            pending = s->second.data;
+        } else if (auto w = writing.find(key); w != writing.end()) {
+            pending = w->second;
+        }
+        if (pending != nullptr) {
+            Buffer* data = acquire_buffer();
+            *data = *pending;
+            answers.push_back({ QUERY_LOAD, load.x, load.z, data, load.generation });
+            return false;
+        }
+        load_queue.push_back(load);
+        ++num_queued_loads;
+        return true;
+    }
+
+    // Only loads that no thread has taken yet are cancelled. World keeps few
+    // loads in flight, so the queue is short.
+    static void dispatch_cancel(const Query& cancel) {
+        for (size_t i = load_queue_head; i < load_queue.size(); ++i) {
+            Query& load = load_queue[i];
+            if (load.type == QUERY_LOAD && load.x == cancel.x && load.z == cancel.z) {
+                load.type = QUERY_NONE;
+                --num_queued_loads;
+            }
+        }
+    }
+
+    // If this chunk is already waiting to be stored, its old data is
+    // replaced (and released) so the chunk is only written once. Loads of
+    // it are answered from the new data until the writer has committed it.
+    // A prefetch of the chunk that a reader took since request_store() is
+    // forgotten here, so the reader does not stage the old data.
+    static void dispatch_store(const Query& store, std::vector<Buffer*>& unused) {
+        std::pair<int, int> key = { store.x, store.z };
+        --stored_keys[key];
+        auto [itr, inserted] = store_queue.try_emplace(key, store);
+        if (!inserted) {
+            unused.push_back(itr->second.data);
+            itr->second.data = store.data;
+        }
+        reading.erase(key);
+        if (auto s = staging_cache.find(key); s != staging_cache.end()) {
+            unused.push_back(s->second.data);
+            staging_cache.erase(s);
         }
-        check(sqlite3_finalize(select_stmt), 14);
-        check(sqlite3_finalize(insert_stmt), 15);
-        check(sqlite3_close(db), 17);
     }
 
-    void request_load(int x, int z) {
+    // Ignored if the chunk was never stored, or is already staged, queued
+    // or being read to be prefetched, or waiting to be stored. Returns true
+    // if it was queued.
+    static bool dispatch_prefetch(const Query& prefetch) {
+        std::pair<int, int> key = { prefetch.x, prefetch.z };
+        bool queued = stored_keys.count(key) && !staging_cache.count(key) && !reading.count(key) && !is_being_stored(key) &&
+            prefetch_keys.insert(key).second;
+        if (queued) {
+            prefetch_queue.push(key);
+        }
+        return queued;
+    }
+
+    // Hand a batch of requests to the readers and the writer, in the order
+    // each thread made them, under one lock. Loads that were answered from
+    // memory are appended to answers and counted. Called with dispatch_mutex
+    // locked.
+    static void dispatch(const std::vector<Query>& requests, std::vector<Query>& answers,
+                         std::vector<Buffer*>& unused) {
+        bool stores = false;
+        size_t loads = 0; // queued loads and prefetches
+        int dispatched = 0;
+        size_t num_answers = answers.size();
         request_queue_mutex.lock();
-        request_queue.emplace(QUERY_LOAD, x, z, 0, nullptr);
+        key_mutex.lock();
+        for (const Query& request : requests) {
+            switch (request.type) {
+                case QUERY_LOAD:
+                    loads += dispatch_load(request, answers);
+                    --loads_in_rings;
+                    ++dispatched;
+                    break;
+                case QUERY_STORE:
+                    dispatch_store(request, unused);
+                    --stores_in_rings;
+                    stores = true;
+                    ++dispatched;
+                    break;
+                case QUERY_CANCEL:
+                    dispatch_cancel(request);
+                    break;
+                case QUERY_PREFETCH:
+                    loads += dispatch_prefetch(request);
+                    break;
+            }
+        }
+        key_mutex.unlock();
+        undispatched -= dispatched;
+        num_results += (int) (answers.size() - num_answers);
+        update_request_counter();
         request_queue_mutex.unlock();
+        // a reader takes at most MAX_LOAD_BATCH loads, so wake more of them
+        // only if there are more
+        if (loads > 0 && readers.empty()) {
+            store_cv.notify_one();
+        } else if (loads > MAX_LOAD_BATCH) {
+            load_cv.notify_all();
+        } else if (loads > 0) {
+            load_cv.notify_one();
+        }
+        if (stores) {
+            store_cv.notify_one();
+        }
+        for (Buffer* buffer : unused) {
+            release_buffer(buffer);
+        }
+        unused.clear();
+    }
+
+    // The state of the thread that takes requests from the rings, guarded by
+    // dispatch_mutex. The answers that did not fit in the dispatcher's
+    // result ring are kept in dispatch_answers and pushed on the next pass.
+    static std::vector<RequestRing*> dispatch_rings;
+    static std::vector<Query> dispatch_requests, dispatch_answers;
+    static std::vector<Buffer*> dispatch_unused;
+
+    // Take every request from the rings and dispatch them, then push the
+    // answers that fit. Called with dispatch_mutex locked. Returns false if
+    // the rings were empty.
+    static bool dispatch_pass() {
+        request_rings_mutex.lock();
+        dispatch_rings = request_rings;
+        request_rings_mutex.unlock();
+        dispatch_requests.clear();
+        for (RequestRing* ring : dispatch_rings) {
+            ring->popAll(dispatch_requests);
+        }
+        if (!dispatch_requests.empty()) {
+            dispatch(dispatch_requests, dispatch_answers, dispatch_unused);
+        }
+        push_answers(*result_rings.back(), dispatch_answers);
+        return !dispatch_requests.empty();
     }
-    
-    void request_store(int x, int z, int size, const void* data) {
+
+    // Called by a reader (or the writer if there are no readers) that was
+    // woken for loads that are still in the rings. Answers that do not fit
+    // are left to the dispatcher.
+    static void dispatch_for_loads(std::unique_lock<std::mutex>& lock) {
+        lock.unlock();
+        dispatch_mutex.lock();
+        dispatch_pass();
+        bool answers_left = !dispatch_answers.empty();
+        dispatch_mutex.unlock();
+        if (answers_left) {
+            signal_dispatcher();
+        }
+        lock.lock();
+    }
+
+    static void reader_thread_func(Storage* reader, ResultRing* results) {
+        std::vector<std::pair<int, int>> keys;
+        std::vector<unsigned int> generations;
+        while (true) {
+            std::unique_lock<std::mutex> lock(request_queue_mutex);
+            load_cv.wait(lock, [] { return thread_should_close || has_loads() || loads_in_rings > 0; });
+            if (loads_in_rings > 0) {
+                dispatch_for_loads(lock);
+                if (!thread_should_close && !has_loads()) {
+                    continue; // another reader took them
+                }
+            }
+            if (num_queued_loads == 0 && (thread_should_close || prefetch_queue.empty())) {
+                break; // thread_should_close is set and no loads are left
+            }
+            unsigned long long batch;
+            size_t num_loads = take_loads(keys, generations, batch);
+            lock.unlock();
+            if (!keys.empty()) {
+                load(reader, *results, keys, generations, num_loads, batch);
+            }
+            keys.clear();
+            generations.clear();
+        }
+    }
+
+    static void writer_thread_func() {
+        const bool does_loads = readers.empty();
+        std::vector<Query> stores;
+        std::vector<std::pair<int, int>> keys;
+        std::vector<unsigned int> generations;
+        while (true) {
+            // wait for stores, then take everything that is queued
+            std::unique_lock<std::mutex> lock(request_queue_mutex);
+            store_cv.wait(lock, [does_loads] {
+                return thread_should_close || !store_queue.empty() || (does_loads && (has_loads() || loads_in_rings > 0));
+            });
+            if (does_loads && loads_in_rings > 0) {
+                dispatch_for_loads(lock);
+                if (!thread_should_close && store_queue.empty() && !has_loads()) {
+                    continue; // the loads were answered from memory
+                }
+            }
+            bool loads_left = does_loads && (num_queued_loads > 0 || (!thread_should_close && !prefetch_queue.empty()));
+            if (store_queue.empty() && !loads_left) {
+                break; // thread_should_close is set and nothing is left to do
+            }
+            if (!(does_loads && has_loads()) && !thread_should_close) {
+                store_cv.wait_for(lock, STORE_BATCH_WINDOW, [does_loads] {
+                    return thread_should_close || (does_loads && (num_queued_loads > 0 || loads_in_rings > 0));
+                });
+                if (does_loads && loads_in_rings > 0) {
+                    dispatch_for_loads(lock);
+                }
+            }
+            for (const auto& [key, store] : store_queue) {
+                stores.push_back(store);
+                writing[key] = store.data;
+            }
+            store_queue.clear();
+            unsigned long long batch = 0;
+            size_t num_loads = does_loads ? take_loads(keys, generations, batch) : 0;
+            update_request_counter();
+            lock.unlock();
+
+            if (!stores.empty() && storage != nullptr) {
+                storage->begin();
+                for (const Query& request : stores) {
+                    PROFILE_ZONE(profiler::Zone::DB_STORE);
+                    assert(request.type == QUERY_STORE && request.data != nullptr);
+                    storage->store(request.x, request.z, *request.data);
+                }
+                storage->commit();
+            }
+            // once committed, readers see the new data
+            lock.lock();
+            for (const Query& request : stores) {
+                writing.erase({ request.x, request.z });
+            }
+            lock.unlock();
+            for (const Query& request : stores) {
+                release_buffer(request.data);
+            }
+            if (!keys.empty()) {
+                load(storage, *result_rings[readers.size()], keys, generations, num_loads, batch);
+            }
+            stores.clear();
+            keys.clear();
+            generations.clear();
+        }
+    }
+
+    // Answers that did not fit in the result ring are pushed again
+    // RING_FULL_WAIT later if no requests arrive before.
+    static void dispatcher_thread_func() {
+        while (true) {
+            // read before the rings, so that a push after they were read
+            // ends the wait below
+            unsigned int signal = request_signal.load(std::memory_order_acquire);
+            bool should_close = closing.load(std::memory_order_acquire);
+            dispatch_mutex.lock();
+            bool dispatched = dispatch_pass();
+            bool answers_left = !dispatch_answers.empty();
+            dispatch_mutex.unlock();
+            if (dispatched) {
+                continue;
+            }
+            if (should_close) {
+                break; // every request made before close() has been dispatched
+            } else if (answers_left) {
+                std::this_thread::sleep_for(RING_FULL_WAIT);
+            } else {
+                request_signal.wait(signal, std::memory_order_acquire);
+            }
+        }
+    }
+
+    // Misses and staged chunks are answered here. Other loads go through the
+    // request ring, after any store of the chunk that this thread made.
+    void request_load(int x, int z, unsigned int generation) {
+        std::pair<int, int> key = { x, z };
+        key_mutex.lock();
+        if (stored_keys.find(key) == stored_keys.end()) {
+            push_immediate_result({ QUERY_LOAD, x, z, nullptr, generation });
+            key_mutex.unlock();
+            return;
+        }
+        auto staged = staging_cache.find(key);
+        if (staged != staging_cache.end()) {
+            push_immediate_result({ QUERY_LOAD, x, z, staged->second.data, generation });
+            staging_cache.erase(staged);
+            key_mutex.unlock();
+            profiler::add(profiler::Counter::DB_PREFETCH_HITS, 1);
+            return;
+        }
+        key_mutex.unlock();
+        push_request({ QUERY_LOAD, x, z, nullptr, generation });
+    }
+
+    void cancel_load(int x, int z) {
+        push_request({ QUERY_CANCEL, x, z, nullptr, 0 });
+    }
+
+    // The chunk is counted as stored before the store is pushed, so that a
+    // load of it right after goes through the ring and sees the new data.
+    // Its staged data is old, so it is dropped.
+    void request_store(int x, int z, Buffer* data) {
+        assert(data != nullptr);
+        std::pair<int, int> key = { x, z };
+        Buffer* staged = nullptr;
+        key_mutex.lock();
+        ++stored_keys[key];
+        reading.erase(key);
+        if (auto s = staging_cache.find(key); s != staging_cache.end()) {
+            staged = s->second.data;
+            staging_cache.erase(s);
+        }
+        key_mutex.unlock();
+        release_buffer(staged);
+        push_request({ QUERY_STORE, x, z, data, 0 });
+    }
+
+    void request_prefetch(int x, int z) {
+        push_request({ QUERY_PREFETCH, x, z, nullptr, 0 });
+    }
+
+    void get_load_results(std::vector<Query>& out) {
+        size_t taken = 0;
+        if (has_immediate_results.load(std::memory_order_acquire)) {
+            key_mutex.lock();
+            out.insert(out.end(), immediate_results.begin(), immediate_results.end());
+            taken += immediate_results.size();
+            immediate_results.clear();
+            has_immediate_results = false;
+            key_mutex.unlock();
+        }
+        for (ResultRing* ring : result_rings) {
+            taken += ring->popAll(out);
+        }
+        if (taken > 0) {
+            profiler::set(profiler::Counter::DB_RESULT_QUEUE, num_results -= (int) taken);
+        }
+    }
+
+    int pending_requests() {
         request_queue_mutex.lock();
-        request_queue.emplace(QUERY_STORE, x, z, size, data);
+        int size = count_requests();
         request_queue_mutex.unlock();
+        return size;
+    }
+
+    // A store is pending from request_store() until the writer has
+    // committed it.
+    int pending_stores() {
+        request_queue_mutex.lock();
+        int size = stores_in_rings + (int) (store_queue.size() + writing.size());
+        request_queue_mutex.unlock();
+        return size;
+    }
+
+    int world_seed() {
+        return seed;
+    }
+
+    int pending_results() {
+        return num_results;
+    }
+
+    Buffer* acquire_buffer() {
+        Buffer* buffer = nullptr;
+        buffer_pool_mutex.lock();
+        if (!buffer_pool.empty()) {
+            buffer = buffer_pool.back();
+            buffer_pool.pop_back();
+        }
+        buffer_pool_mutex.unlock();
+        return buffer != nullptr ? buffer : new Buffer;
+    }
+
+    void release_buffer(Buffer* buffer) {
+        if (buffer == nullptr) {
+            return;
+        }
+        buffer->clear();
+        buffer_pool_mutex.lock();
+        if (buffer_pool.size() < MAX_POOLED_BUFFERS) {
+            buffer_pool.push_back(buffer);
+            buffer = nullptr;
+        }
+        buffer_pool_mutex.unlock();
+        delete buffer;
     }
 
-    Query get_load_result() {
-        Query result = { QUERY_NONE, 0, 0, 0, nullptr };
-        result_queue_mutex.lock();
-        if (!result_queue.empty()) {
-            result = result_queue.front();
-            result_queue.pop();
+    static std::thread dispatcher_thread;
+    static std::thread writer_thread;
+    static std::vector<std::thread> reader_threads;
+
+    Storage* open_storage(Backend backend, const char* path) {
+        switch (backend) {
+            case Backend::SQLITE: return open_sqlite_storage(path);
+            case Backend::REGION: return open_region_storage(path);
         }
-        result_queue_mutex.unlock();
-        return result;
+        return nullptr;
     }
 
-    static std::thread db_thread;
+    bool parse_backend(const char* name, Backend& backend) {
+        if (std::strcmp(name, "sqlite") == 0) {
+            backend = Backend::SQLITE;
+        } else if (std::strcmp(name, "region") == 0) {
+            backend = Backend::REGION;
+        } else {
+            return false;
+        }
+        return true;
+    }
 
-    void initialize() {
+    // If the storage can not be opened, every load is answered as if the
+    // chunk was never stored and stores are dropped. A world without a seed
+    // is new or was generated with WORLD_SEED, so that is stored as its seed.
+    void initialize(const char* path, Backend backend) {
         thread_should_close = false;
-        db_thread = std::thread(db_thread_func);
+        storage = open_storage(backend, path);
+        stored_keys.clear();
+        seed = WORLD_SEED;
+        if (storage != nullptr) {
+            if (!storage->loadSeed(seed)) {
+                seed = WORLD_SEED;
+                storage->storeSeed(seed);
+            }
+            for (const std::pair<int, int>& key : storage->keys()) {
+                stored_keys[key] = 0;
+            }
+            for (int i = 0; i < NUM_READERS; ++i) {
+                Storage* reader = storage->openReader();
+                if (reader == nullptr) {
+                    break;
+                }
+                readers.push_back(reader);
+            }
+        }
+        for (size_t i = 0; i < readers.size() + 2; ++i) {
+            result_rings.push_back(new ResultRing);
+        }
+        for (size_t i = 0; i < readers.size(); ++i) {
+            reader_threads.emplace_back(reader_thread_func, readers[i], result_rings[i]);
+        }
+        writer_thread = std::thread(writer_thread_func);
+        closing = false;
+        dispatcher_thread = std::thread(dispatcher_thread_func);
     }
 
+    // No thread may make a request while the database is closed.
     void close() {
+        // first hand every request to the readers and the writer
+        closing = true;
+        signal_dispatcher();
+        dispatcher_thread.join();
+        request_queue_mutex.lock();
         thread_should_close = true;
-        db_thread.join();
+        request_queue_mutex.unlock();
+        load_cv.notify_all();
+        store_cv.notify_one();
+        for (std::thread& thread : reader_threads) {
+            thread.join();
+        }
+        writer_thread.join();
+        reader_threads.clear();
+        for (Storage* reader : readers) {
+            delete reader;
+        }
+        readers.clear();
+        delete storage;
+        storage = nullptr;
+        stored_keys.clear();
+        for (const auto& [_, staged] : staging_cache) {
+            release_buffer(staged.data);
+        }
+        staging_cache.clear();
+        prefetch_queue = {};
+        prefetch_keys.clear();
+        reading.clear();
+        load_queue.clear();
+        load_queue_head = 0;
+        num_queued_loads = 0;
+        // answers that never fit in the result ring
+        for (const Query& answer : dispatch_answers) {
+            release_buffer(answer.data);
+        }
+        num_results -= (int) dispatch_answers.size();
+        dispatch_answers.clear();
+        for (RequestRing* ring : request_rings) {
+            delete ring;
+        }
+        request_rings.clear();
+        ++session;
+        // results that were never taken, such as loads the caller cancelled
+        std::vector<Query> results;
+        get_load_results(results);
+        for (const Query& result : results) {
+            release_buffer(result.data);
+        }
+        for (ResultRing* ring : result_rings) {
+            delete ring;
+        }
+        result_rings.clear();
+        buffer_pool_mutex.lock();
+        for (Buffer* buffer : buffer_pool) {
+            delete buffer;
+        }
+        buffer_pool.clear();
+        buffer_pool_mutex.unlock();
     }
 }
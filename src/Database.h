@@ -1,24 +1,63 @@
 #ifndef DATABASE_H_INCLUDED
 #define DATABASE_H_INCLUDED
 
+#include <vector>
+
 namespace database {
 
     inline constexpr int QUERY_NONE = 0;
     inline constexpr int QUERY_LOAD = 1;
     inline constexpr int QUERY_STORE = 2;
 
+    // Chunk data is passed between threads in buffers that are reused, so
+    // loads and stores don't allocate once the pool has warmed up. Whoever
+    // holds a buffer owns it: request_store() takes ownership of its buffer
+    // and the receiver of a load result must release the result's buffer.
+    using Buffer = std::vector<unsigned char>;
+    Buffer* acquire_buffer(); // empty, but keeps the capacity of its last use
+    void release_buffer(Buffer* buffer);
+
     struct Query {
         int type;
         int x, z;
-        int size;
-        const void* data;
+        Buffer* data; // nullptr if a loaded chunk is not in the database
+        unsigned int generation; // of a load: the one passed to request_load()
+    };
+
+    inline constexpr const char* DEFAULT_FILE_NAME = "MCDB.db";
+
+    // SQLite: a single file with one table, keyed by (x, z)
+    // Region files: a directory with one file per 32x32 chunks (RegionStorage.cpp)
+    enum class Backend {
+        SQLITE, REGION
     };
 
-    void initialize();
+    // path is the SQLite file or the region directory
+    void initialize(const char* path = DEFAULT_FILE_NAME, Backend backend = Backend::SQLITE);
     void close();
-    void request_load(int x, int z);
-    void request_store(int x, int z, int size, const void* data);
-    Query get_load_result();
+    // The seed that the terrain of the open world is generated with. Pass it
+    // to Chunk::initNoise() and wherever chunks are generated or saved.
+    int world_seed();
+    // The result of the load has the same generation, so the caller can tell
+    // the result of a load it cancelled from the result of a later load of
+    // the same chunk.
+    void request_load(int x, int z, unsigned int generation);
+    // Drop a load that the database has not started reading. If it has, the
+    // result still arrives.
+    void cancel_load(int x, int z);
+    void request_store(int x, int z, Buffer* data);
+    // Read a chunk that will probably be requested soon ahead of time. A
+    // later request_load() of the chunk is answered from memory.
+    void request_prefetch(int x, int z);
+    // Append the results of every load that has finished to out. Requests
+    // can be made by any thread and the requests of one thread are handled
+    // in order, but the results must all be taken by the same thread. There
+    // is no limit on the loads in flight: results that are not taken are
+    // kept until they are, or until close().
+    void get_load_results(std::vector<Query>& out);
+    int pending_requests();
+    int pending_stores(); // stores that are not committed yet
+    int pending_results();
 
 }
 
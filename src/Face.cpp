@@ -3,6 +3,7 @@
 #include "Block.h"
 #include <sglm/sglm.h>
 #include <cstring>
+#include <cstddef>
 #include <cmath>
 #include <cassert>
 
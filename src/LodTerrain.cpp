@@ -0,0 +1,326 @@
+#include "LodTerrain.h"
+#include "Constants.h"
+#include "Block.h"
+#include "TerrainGen.h"
+#include "Profiler.h"
+#include <sglm/sglm.h>
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
+#include <vector>
+#include <cassert>
+
+// A LOD vertex is represented using 3 16-bit integers (see lod_vertex.glsl):
+//
+// v1: x pos: 1111110000000000
+//     z pos: 0000001111110000
+//     light: 0000000000000011
+//
+// v2: y pos: 0000000011111111
+//
+// v3: x tex: 0000001111100000
+//     y tex: 0000000000011111
+//
+// The x and z positions are the corners of columns within the tile (0 to 32)
+// and the y position is the top of a block (0 to 128). The light and the
+// texture coordinates are the same as those of a block vertex (see Block.cpp).
+
+// Tiles within 2 render distances have cells of 2x2 columns, then 4x4 and
+// 8x8. The tile of a cell is farther away the bigger it is, so each cell
+// covers about the same number of pixels.
+static int step_for(int dist_sq, int renderDist) {
+    if (dist_sq <= 4 * renderDist * renderDist)
+        return 2;
+    if (dist_sq <= 9 * renderDist * renderDist)
+        return 4;
+    return 8;
+}
+
+// A tile keeps its step while it is within this many chunks of where that
+// step starts or ends, so that the tiles near those distances are not made
+// again every time the player moves into another chunk.
+static constexpr int STEP_MARGIN = 2;
+
+static bool keeps_step(int step, int x, int z, int px, int pz, int renderDist) {
+    int dx = std::abs(x - px), dz = std::abs(z - pz);
+    int nearer_x = std::max(dx - STEP_MARGIN, 0), nearer_z = std::max(dz - STEP_MARGIN, 0);
+    int farther_x = dx + STEP_MARGIN, farther_z = dz + STEP_MARGIN;
+    return step_for(nearer_x * nearer_x + nearer_z * nearer_z, renderDist) <= step &&
+           step <= step_for(farther_x * farther_x + farther_z * farther_z, renderDist);
+}
+
+// the chunk loader thread makes at most this many tiles per update(), so
+// that chunks near the player keep loading while the tiles are made
+static constexpr int MAX_BUILDS_PER_UPDATE = 32;
+
+// the radius of a sphere around a whole tile (for frustum culling)
+static constexpr float TILE_RADIUS = 68.0f;
+
+// the corners of each face of a box from (0, 0, 0) to (1, 1, 1), in the
+// same order as the faces of a block
+static constexpr int CORNERS[NUM_DIRECTIONS][4][3] = {
+    { { 1, 0, 1 }, { 1, 0, 0 }, { 1, 1, 0 }, { 1, 1, 1 } }, // +x
+    { { 0, 0, 0 }, { 0, 0, 1 }, { 0, 1, 1 }, { 0, 1, 0 } }, // -x
+    { { 0, 0, 1 }, { 1, 0, 1 }, { 1, 1, 1 }, { 0, 1, 1 } }, // +z
+    { { 1, 0, 0 }, { 0, 0, 0 }, { 0, 1, 0 }, { 1, 1, 0 } }, // -z
+    { { 0, 1, 1 }, { 1, 1, 1 }, { 1, 1, 0 }, { 0, 1, 0 } }, // +y
+    { { 0, 0, 0 }, { 1, 0, 0 }, { 1, 0, 1 }, { 0, 0, 1 } }, // -y
+};
+static constexpr int LIGHT[NUM_DIRECTIONS] = { 2, 2, 1, 1, 3, 0 };
+
+// add the face of the box from (x0, y0, z0) to (x1, y1, z1) in direction dir
+static void add_face(std::vector<vertex_attrib_t>& out, Direction dir, vertex_attrib_t tex,
+                     int x0, int y0, int z0, int x1, int y1, int z1) {
+    static constexpr int ORDER[VERTICES_PER_FACE] = { 0, 1, 2, 2, 3, 0 };
+    static constexpr int TEX[4][2] = { { 0, 0 }, { 1, 0 }, { 1, 1 }, { 0, 1 } };
+    for (int corner : ORDER) {
+        const int* c = CORNERS[dir][corner];
+        int x = c[0] ? x1 : x0, y = c[1] ? y1 : y0, z = c[2] ? z1 : z0;
+        out.push_back((vertex_attrib_t) ((x << 10) | (z << 4) | LIGHT[dir]));
+        out.push_back((vertex_attrib_t) y);
+        out.push_back((vertex_attrib_t) (tex + (TEX[corner][0] << 5) + TEX[corner][1]));
+    }
+}
+
+static int floor_div(int a, int b) {
+    return a / b - (a % b < 0);
+}
+
+// the top of the highest block (terrain or water) of column (x, z)
+static int top_at(int x, int z) {
+    return std::max(getHeight(x, z), WATER_HEIGHT) + 1;
+}
+
+// The lowest top of the cells of step x step columns that contain a column
+// of the segment of length columns from (x, z) along z (or along x). This is
+// as low as the terrain next to a tile can be where it has such cells.
+static int lowest_top(int x, int z, int length, bool alongZ, int step) {
+    int across = (floor_div(alongZ ? x : z, step) * step) + step / 2;
+    int start = alongZ ? z : x;
+    int lowest = INT_MAX;
+    for (int a = floor_div(start, step) * step; a < start + length; a += step) {
+        int middle = a + step / 2;
+        lowest = std::min(lowest, alongZ ? top_at(across, middle) : top_at(middle, across));
+    }
+    return lowest;
+}
+
+// Make the vertices of the tile of chunk (cx, cz) with cells of step x step
+// columns. Each cell is a box from the bottom of the world to the top of
+// its middle column, with the texture of that column's surface, and only
+// the faces of the boxes that can be seen are added.
+//
+// The terrain next to the tile may be another tile with a different step,
+// or a chunk in full detail if touchesFull. So that there are no gaps
+// between them, each face on the side of the tile goes down to the lowest
+// top the terrain on the other side can have with any of those steps.
+static void build_tile(int cx, int cz, int step, bool touchesFull, std::vector<vertex_attrib_t>& out) {
+    constexpr int MAX_CELLS = CHUNK_WIDTH / 2;
+    int n = CHUNK_WIDTH / step;
+    int x0 = cx * CHUNK_WIDTH, z0 = cz * CHUNK_WIDTH;
+    int top[MAX_CELLS][MAX_CELLS];
+    vertex_attrib_t top_tex[MAX_CELLS][MAX_CELLS], side_tex[MAX_CELLS][MAX_CELLS];
+    for (int i = 0; i < n; ++i) {
+        for (int j = 0; j < n; ++j) {
+            int x = x0 + i * step + step / 2, z = z0 + j * step + step / 2;
+            int height = getHeight(x, z);
+            Block::BlockType surface = Block::BlockType::GRASS;
+            if (height <= WATER_HEIGHT) {
+                surface = Block::BlockType::WATER;
+            } else {
+                Biome biome = getBiome(x, z);
+                if (biome == Biome::DESERT) {
+                    surface = Block::BlockType::SAND;
+                } else if (biome == Biome::TUNDRA) {
+                    surface = Block::BlockType::SNOW;
+                }
+            }
+            Block::BlockType side = surface == Block::BlockType::GRASS ? Block::BlockType::STONE : surface;
+            top[i][j] = std::max(height, WATER_HEIGHT) + 1;
+            top_tex[i][j] = Block::getFaceTexture(surface, PLUS_Y);
+            side_tex[i][j] = Block::getFaceTexture(side, PLUS_X);
+        }
+    }
+
+    // the steps the terrain next to the tile can have
+    int steps[4] = { 2, 4, 8, 1 };
+    int num_steps = touchesFull ? 4 : 3;
+    auto outside = [&](int x, int z, bool alongZ) {
+        int lowest = INT_MAX;
+        for (int s = 0; s < num_steps; ++s) {
+            lowest = std::min(lowest, lowest_top(x, z, step, alongZ, steps[s]));
+        }
+        return lowest;
+    };
+
+    out.clear();
+    for (int i = 0; i < n; ++i) {
+        for (int j = 0; j < n; ++j) {
+            int bx0 = i * step, bx1 = bx0 + step, bz0 = j * step, bz1 = bz0 + step;
+            int y = top[i][j];
+            add_face(out, PLUS_Y, top_tex[i][j], bx0, 0, bz0, bx1, y, bz1);
+            int below[4];
+            below[PLUS_X] = i + 1 < n ? top[i + 1][j] : outside(x0 + CHUNK_WIDTH, z0 + bz0, true);
+            below[MINUS_X] = i > 0 ? top[i - 1][j] : outside(x0 - 1, z0 + bz0, true);
+            below[PLUS_Z] = j + 1 < n ? top[i][j + 1] : outside(x0 + bx0, z0 + CHUNK_WIDTH, false);
+            below[MINUS_Z] = j > 0 ? top[i][j - 1] : outside(x0 + bx0, z0 - 1, false);
+            for (int d = 0; d < 4; ++d) {
+                if (below[d] < y) {
+                    Direction dir = static_cast<Direction>(d);
+                    add_face(out, dir, side_tex[i][j], bx0, below[d], bz0, bx1, y, bz1);
+                }
+            }
+        }
+    }
+}
+
+LodTerrain::LodTerrain() : m_bytes{ 0 }, m_center{ 0, 0 }, m_renderDist{ 0 }, m_lodDist{ 0 } {}
+
+LodTerrain::~LodTerrain() {
+    for (const auto& [_, tile] : m_tiles) {
+        delete tile;
+    }
+    for (Tile* tile : m_removed) {
+        delete tile;
+    }
+}
+
+bool LodTerrain::isFull(int px, int pz, int cx, int cz, int renderDist) {
+    auto within = [&](int x, int z) {
+        return (x - px) * (x - px) + (z - pz) * (z - pz) <= renderDist * renderDist;
+    };
+    return within(cx, cz) && within(cx + 1, cz) && within(cx - 1, cz) &&
+           within(cx, cz + 1) && within(cx, cz - 1);
+}
+
+// Only this thread adds tiles to m_tiles or removes them, so it reads
+// m_tiles without locking m_tilesMutex and locks it only to change it.
+bool LodTerrain::update(int px, int pz, int renderDist, int lodDist) {
+    bool changed = false;
+    if (m_center != std::make_pair(px, pz) || m_renderDist != renderDist || m_lodDist != lodDist) {
+        m_center = { px, pz };
+        m_renderDist = renderDist;
+        m_lodDist = lodDist;
+        changed = removeTiles();
+        findBuilds();
+    }
+
+    // m_builds is sorted farthest first
+    std::vector<std::pair<Build, std::vector<vertex_attrib_t>>> built;
+    while (!m_builds.empty() && (int) built.size() < MAX_BUILDS_PER_UPDATE) {
+        const Build& b = m_builds.back();
+        built.emplace_back(b, std::vector<vertex_attrib_t>());
+        build_tile(b.x, b.z, b.step, b.touchesFull, built.back().second);
+        m_builds.pop_back();
+    }
+    if (built.empty()) {
+        return changed;
+    }
+    m_tilesMutex.lock();
+    for (auto& [b, vertices] : built) {
+        Tile*& tile = m_tiles[{ b.x, b.z }];
+        if (tile == nullptr) {
+            tile = new Tile();
+        }
+        tile->step = b.step;
+        tile->touchesFull = b.touchesFull;
+        tile->vertices.swap(vertices);
+        m_changed.push_back({ b.x, b.z });
+    }
+    m_tilesMutex.unlock();
+    return true;
+}
+
+// Remove the tiles that are too far away or whose chunks are rendered in
+// full detail. Returns true if any were removed.
+bool LodTerrain::removeTiles() {
+    auto [px, pz] = m_center;
+    bool removed = false;
+    m_tilesMutex.lock();
+    for (auto itr = m_tiles.begin(); itr != m_tiles.end();) {
+        auto [x, z] = itr->first;
+        int dist_sq = (x - px) * (x - px) + (z - pz) * (z - pz);
+        if (dist_sq > m_lodDist * m_lodDist || isFull(px, pz, x, z, m_renderDist)) {
+            m_removed.push_back(itr->second);
+            itr = m_tiles.erase(itr);
+            removed = true;
+        } else {
+            ++itr;
+        }
+    }
+    m_tilesMutex.unlock();
+    return removed;
+}
+
+// Find the tiles that are missing or that have to be made again, because
+// their step or their neighbors changed.
+void LodTerrain::findBuilds() {
+    auto [px, pz] = m_center;
+    int renderDist = m_renderDist, lodDist = m_lodDist;
+    m_builds.clear();
+    for (int x = px - lodDist; x <= px + lodDist; ++x) {
+        for (int z = pz - lodDist; z <= pz + lodDist; ++z) {
+            int dist_sq = (x - px) * (x - px) + (z - pz) * (z - pz);
+            if (dist_sq > lodDist * lodDist || isFull(px, pz, x, z, renderDist)) {
+                continue;
+            }
+            int step = step_for(dist_sq, renderDist);
+            bool touchesFull = isFull(px, pz, x + 1, z, renderDist) || isFull(px, pz, x - 1, z, renderDist) ||
+                               isFull(px, pz, x, z + 1, renderDist) || isFull(px, pz, x, z - 1, renderDist);
+            auto itr = m_tiles.find({ x, z });
+            if (itr == m_tiles.end() || itr->second->touchesFull != touchesFull ||
+                !keeps_step(itr->second->step, x, z, px, pz, renderDist)) {
+                m_builds.push_back({ dist_sq, x, z, step, touchesFull });
+            }
+        }
+    }
+    std::sort(m_builds.begin(), m_builds.end(), [](const Build& a, const Build& b) {
+        return a.dist_sq > b.dist_sq;
+    });
+}
+
+// Delete the tiles that were removed and upload the vertices of at most
+// maxTiles tiles.
+void LodTerrain::upload(int maxTiles) {
+    m_tilesMutex.lock();
+    for (Tile* tile : m_removed) {
+        m_bytes -= (long long) tile->mesh.getVertexCount() * VERTEX_SIZE;
+        delete tile;
+    }
+    m_removed.clear();
+    size_t i = 0;
+    for (int uploaded = 0; i < m_changed.size() && uploaded < maxTiles; ++i) {
+        auto itr = m_tiles.find(m_changed[i]);
+        if (itr == m_tiles.end() || itr->second->vertices.empty()) {
+            continue;
+        }
+        Tile* tile = itr->second;
+        unsigned int size = (unsigned int) (tile->vertices.size() * sizeof(vertex_attrib_t));
+        m_bytes -= (long long) tile->mesh.getVertexCount() * VERTEX_SIZE;
+        tile->mesh.generate(size, tile->vertices.data(), false);
+        m_bytes += size;
+        std::vector<vertex_attrib_t>().swap(tile->vertices);
+        ++uploaded;
+    }
+    m_changed.erase(m_changed.begin(), m_changed.begin() + i);
+    profiler::set(profiler::Counter::LOD_TILES, (long long) m_tiles.size());
+    profiler::set(profiler::Counter::LOD_BYTES, m_bytes);
+    m_tilesMutex.unlock();
+}
+
+// Returns the number of tiles rendered.
+int LodTerrain::render(Shader* shader, const sglm::frustum& frustum) {
+    int rendered = 0;
+    m_tilesMutex.lock();
+    for (const auto& [pos, tile] : m_tiles) {
+        float x = (float) (pos.first * CHUNK_WIDTH);
+        float z = (float) (pos.second * CHUNK_WIDTH);
+        float half = CHUNK_WIDTH / 2.0f;
+        if (frustum.contains({ x + half, CHUNK_HEIGHT / 2.0f, z + half }, TILE_RADIUS)) {
+            shader->addUniformMat4f("u0_model", sglm::translate({ x, 0.0f, z }));
+            rendered += tile->mesh.render(shader);
+        }
+    }
+    m_tilesMutex.unlock();
+    return rendered;
+}
@@ -0,0 +1,71 @@
+#ifndef LOD_TERRAIN_H_INCLUDED
+#define LOD_TERRAIN_H_INCLUDED
+
+#include "Constants.h"
+#include "Mesh.h"
+#include "Shader.h"
+#include <sglm/sglm.h>
+#include <map>
+#include <mutex>
+#include <vector>
+#include <utility>
+
+// Low-detail meshes of the terrain beyond the render distance, one tile per
+// chunk position. A tile is made from the height and biome noise alone, so
+// no blocks are generated or stored for it: each cell of STEP x STEP columns
+// is a box at the height of the column in its middle. Tiles farther away
+// have bigger cells (see LodTerrain.cpp). Implementation in LodTerrain.cpp.
+//
+// The chunk loader thread decides which tiles exist and makes their vertices,
+// the main thread uploads and renders them.
+class LodTerrain {
+    struct Tile {
+        int step;                              // columns per cell: 2, 4 or 8
+        bool touchesFull;                      // next to a chunk rendered in full detail
+        std::vector<vertex_attrib_t> vertices; // made by the loader, not uploaded yet
+        Mesh mesh;
+    };
+
+    std::map<std::pair<int, int>, Tile*> m_tiles;
+    // Tiles with vertices to upload, and tiles that are no longer in m_tiles
+    // and that the main thread deletes. Guarded by m_tilesMutex, like m_tiles
+    // and every Tile.
+    std::vector<std::pair<int, int>> m_changed;
+    std::vector<Tile*> m_removed;
+    std::mutex m_tilesMutex;
+    long long m_bytes; // of the uploaded meshes (main thread only)
+
+    // a tile to make on the chunk loader thread
+    struct Build {
+        int dist_sq; // from the player's chunk
+        int x, z;
+        int step;
+        bool touchesFull;
+    };
+
+    // chunk loader thread only
+    std::pair<int, int> m_center; // the player's chunk at the last update()
+    int m_renderDist;             // and the distances
+    int m_lodDist;
+    std::vector<Build> m_builds;  // the tiles still to make for those
+
+    bool removeTiles();
+    void findBuilds();
+
+public:
+    LodTerrain();
+    ~LodTerrain();
+
+    // chunk loader thread: create, rebuild and remove tiles for a player in
+    // chunk (px, pz). Returns true if anything changed.
+    bool update(int px, int pz, int renderDist, int lodDist);
+    // main thread
+    void upload(int maxTiles);
+    int render(Shader* shader, const sglm::frustum& frustum);
+
+    // true if the chunk (cx, cz) is rendered in full detail when the player
+    // is in chunk (px, pz): it and its 4 neighbors are within renderDist
+    static bool isFull(int px, int pz, int cx, int cz, int renderDist);
+};
+
+#endif
@@ -4,6 +4,7 @@
 #include "Texture.h"
 #include "World.h"
 #include "Database.h"
+#include "Profiler.h"
 
 #include <glad/glad.h>
 #include <GLFW/GLFW3.h>
@@ -13,6 +14,8 @@
 
 #include <iostream>
 #include <cstdlib>
+#include <chrono>
+#include <thread>
 
 // from UI.cpp
 void initialize_HUD();
@@ -25,11 +28,27 @@ static bool mouse_captured = false;
 static bool mine_block = false;
 static bool f3_opened = false;
 
+// Wait until the database has stored the chunks that were edited since the
+// last autosave, showing how many are left.
+static void show_save_progress() {
+    using namespace std::chrono_literals;
+    int left = database::pending_stores();
+    if (left == 0) {
+        return;
+    }
+    for (; left > 0; left = database::pending_stores()) {
+        std::cout << "\rSaving the world: " << left << " chunks left   " << std::flush;
+        std::this_thread::sleep_for(100ms);
+    }
+    std::cout << "\rSaving the world: done               \n";
+}
+
 // called by std::at_exit()
 static void close_app() {
     ImGui_ImplOpenGL3_Shutdown();
     ImGui_ImplGlfw_Shutdown();
     ImGui::DestroyContext();
+    show_save_progress();
     database::close();
     glfwTerminate();
 }
@@ -74,6 +93,7 @@ static void key_callback(GLFWwindow* window, int key, int /* scancode */, int ac
     // If the escape key is pressed, close the window.
     // If F2 is pressed, toggle capturing/releasing the mouse
     // If F3 is pressed, toggle opening the debug window
+    // If F4 is pressed, save the profiler's trace events to TRACE_FILE
     if (key == GLFW_KEY_ESCAPE && action == GLFW_PRESS) {
         glfwSetWindowShouldClose(window, true);
     }
@@ -88,6 +108,11 @@ static void key_callback(GLFWwindow* window, int key, int /* scancode */, int ac
     else if (key == GLFW_KEY_F3 && action == GLFW_PRESS) {
         f3_opened = !f3_opened;
     }
+    else if (key == GLFW_KEY_F4 && action == GLFW_PRESS) {
+        if (profiler::dump_trace(TRACE_FILE)) {
+            std::cout << "Saved trace to " << TRACE_FILE << '\n';
+        }
+    }
 }
 
 static void processInput(GLFWwindow* window, float deltaTime) {
@@ -165,7 +190,7 @@ int main() {
     window_size_callback(nullptr, scr_width, scr_height);
     database::initialize();
     Block::initBlockData();
-    Chunk::initNoise();
+    Chunk::initNoise(database::world_seed());
 
     // initialize imgui
     ImGui::CreateContext();
@@ -184,12 +209,14 @@ int main() {
     std::cout << "Starting Application...\n";
 
     Shader blockShader(BLOCK_VERTEX, BLOCK_FRAGMENT);
+    Shader lodShader(LOD_VERTEX, BLOCK_FRAGMENT);
     Shader uiShader(UI_VERTEX, UI_FRAGMENT);
     Texture textureSheet(TEXTURE_SHEET, 0);
     blockShader.addTexture(&textureSheet, "u3_texture");
+    lodShader.addTexture(&textureSheet, "u3_texture");
     uiShader.addTexture(&textureSheet, "u3_texture");
     
-    World chunkLoader(&blockShader, &player);
+    World chunkLoader(&blockShader, &lodShader, &player);
 
     // variables for deltaTime
     double previousTime = glfwGetTime();
@@ -224,6 +251,7 @@ int main() {
 #endif
 
         glfwSwapBuffers(window);
+        profiler::end_frame();
     }
     return 0;
 }
@@ -3,19 +3,42 @@
 #include "Shader.h"
 #include "Face.h"
 #include "Block.h"
+#include "Profiler.h"
+#ifndef MC_HEADLESS
 #include <glad/glad.h>
+#endif
 #include <vector>
+#include <mutex>
+#include <cstring>
 #include <cassert>
 
+// When MC_HEADLESS is defined (see the benchmark targets in CMakeLists.txt) no
+// OpenGL context exists. Meshes still record their vertex count and faces so
+// that meshing and ray intersections behave normally, but nothing is uploaded.
+
+// The queries of destroyed meshes. Subchunk meshes are destroyed by the
+// chunk loader thread, which has no OpenGL context, so their queries are
+// deleted by the main thread in deleteReleasedQueries().
+static std::vector<unsigned int> released_queries;
+static std::mutex released_queries_mutex;
+
 Mesh::Mesh() {
     m_vertexCount = 0;
+    m_rangeStarts.fill(0);
     m_vertexArrayID = 0;
     m_vertexBufferID = 0;
     m_generated = false;
+    m_queryID = 0;
+    m_queryFrame = 0;
 }
 
 Mesh::~Mesh() {
     erase();
+    if (m_queryID != 0) {
+        released_queries_mutex.lock();
+        released_queries.push_back(m_queryID);
+        released_queries_mutex.unlock();
+    }
 }
 
 void Mesh::generate(unsigned int size, const void* data, bool setFaceData,
@@ -27,6 +50,7 @@ void Mesh::generate(unsigned int size, const void* data, bool setFaceData,
     if (size == 0) {
         return;
     }
+#ifndef MC_HEADLESS
     glGenVertexArrays(1, &m_vertexArrayID);
     glGenBuffers(1, &m_vertexBufferID);
 
@@ -40,9 +64,15 @@ void Mesh::generate(unsigned int size, const void* data, bool setFaceData,
     // tell openGL the layout of our vertex data
     glEnableVertexAttribArray(0);
     glVertexAttribIPointer(0, ATTRIBS_PER_VERTEX, GL_UNSIGNED_SHORT, VERTEX_SIZE, 0);
+#endif
+
+    profiler::add(profiler::Counter::GL_UPLOAD_BYTES, size);
 
     // store the number of vertices
     m_vertexCount = size / VERTEX_SIZE;
+    // until setRanges() is called, every face is in the last range
+    m_rangeStarts.fill(0);
+    m_rangeStarts[NUM_RANGES] = m_vertexCount;
 
     // set the face data (used for collisions)
     if (setFaceData) {
@@ -60,8 +90,11 @@ void Mesh::erase() {
     if (m_generated) {
         m_generated = false;
         m_vertexCount = 0;
+        m_rangeStarts.fill(0);
+#ifndef MC_HEADLESS
         glDeleteVertexArrays(1, &m_vertexArrayID);
         glDeleteBuffers(1, &m_vertexBufferID);
+#endif
         m_faces.clear();
     }
 }
@@ -92,20 +125,144 @@ void Mesh::getFaces(const vertex_attrib_t* data, int cx, int cy, int cz) {
     }
 }
 
+// vertexCounts: the number of vertices in each range, in order
+void Mesh::setRanges(const std::array<unsigned int, NUM_RANGES>& vertexCounts) {
+    unsigned int start = 0;
+    for (int range = 0; range < NUM_RANGES; ++range) {
+        m_rangeStarts[range] = start;
+        start += vertexCounts[range];
+    }
+    assert(start == m_vertexCount);
+    m_rangeStarts[NUM_RANGES] = start;
+}
+
 unsigned int Mesh::getVertexCount() const {
     return m_vertexCount;
 }
 
-bool Mesh::render(const Shader* shader) const {
+unsigned int Mesh::getVertexCount(unsigned int ranges) const {
+    unsigned int count = 0;
+    for (int range = 0; range < NUM_RANGES; ++range) {
+        if (ranges & (1u << range)) {
+            count += m_rangeStarts[range + 1] - m_rangeStarts[range];
+        }
+    }
+    return count;
+}
+
+// The ranges in the mask that are next to each other are drawn as one, and
+// all of them with one draw call.
+bool Mesh::render(const Shader* shader, unsigned int ranges) const {
     if (m_generated) {
+#ifndef MC_HEADLESS
+        GLint firsts[NUM_RANGES];
+        GLsizei counts[NUM_RANGES];
+        GLsizei draws = 0;
+        for (int range = 0; range < NUM_RANGES; ++range) {
+            GLsizei count = (GLsizei) (m_rangeStarts[range + 1] - m_rangeStarts[range]);
+            if (!(ranges & (1u << range)) || count == 0) {
+                continue;
+            }
+            if (draws > 0 && (unsigned int) (firsts[draws - 1] + counts[draws - 1]) == m_rangeStarts[range]) {
+                counts[draws - 1] += count;
+            } else {
+                firsts[draws] = (GLint) m_rangeStarts[range];
+                counts[draws++] = count;
+            }
+        }
         shader->bind();
         glBindVertexArray(m_vertexArrayID);
-        glDrawArrays(GL_TRIANGLES, 0, m_vertexCount);
+        if (draws == 1) {
+            glDrawArrays(GL_TRIANGLES, firsts[0], counts[0]);
+        } else if (draws > 1) {
+            glMultiDrawArrays(GL_TRIANGLES, firsts, counts, draws);
+        }
+#else
+        (void) shader;
+        (void) ranges;
+#endif
         return true;
     }
     return false;
 }
 
+// Headless builds never issue a query, so every result is UNKNOWN.
+
+// main thread only
+void Mesh::deleteReleasedQueries() {
+    std::vector<unsigned int> queries;
+    released_queries_mutex.lock();
+    queries.swap(released_queries);
+    released_queries_mutex.unlock();
+#ifndef MC_HEADLESS
+    if (!queries.empty()) {
+        glDeleteQueries((GLsizei) queries.size(), queries.data());
+    }
+#endif
+}
+
+void Mesh::startQueries() {
+#ifndef MC_HEADLESS
+    glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+    glDepthMask(GL_FALSE);
+#endif
+}
+
+void Mesh::endQueries() {
+#ifndef MC_HEADLESS
+    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+    glDepthMask(GL_TRUE);
+#endif
+}
+
+void Mesh::beginQuery(unsigned int frame) {
+#ifndef MC_HEADLESS
+    if (m_queryID == 0) {
+        glGenQueries(1, &m_queryID);
+    }
+    glBeginQuery(GL_ANY_SAMPLES_PASSED_CONSERVATIVE, m_queryID);
+    m_queryFrame = frame;
+#else
+    (void) frame;
+#endif
+}
+
+void Mesh::endQuery() {
+#ifndef MC_HEADLESS
+    glEndQuery(GL_ANY_SAMPLES_PASSED_CONSERVATIVE);
+#endif
+}
+
+// Never waits for the GPU.
+Mesh::Occlusion Mesh::getOcclusion(unsigned int frame) const {
+    if (m_queryID == 0 || m_queryFrame + 1 != frame) {
+        return Occlusion::UNKNOWN;
+    }
+#ifndef MC_HEADLESS
+    GLuint available = 0, passed = 0;
+    glGetQueryObjectuiv(m_queryID, GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!available) {
+        return Occlusion::PENDING;
+    }
+    glGetQueryObjectuiv(m_queryID, GL_QUERY_RESULT, &passed);
+    return passed ? Occlusion::VISIBLE : Occlusion::HIDDEN;
+#else
+    return Occlusion::UNKNOWN;
+#endif
+}
+
+bool Mesh::renderConditional(const Shader* shader, unsigned int ranges) const {
+#ifndef MC_HEADLESS
+    if (m_generated && m_queryID != 0) {
+        glBeginConditionalRender(m_queryID, GL_QUERY_NO_WAIT);
+        render(shader, ranges);
+        glEndConditionalRender();
+        return true;
+    }
+#endif
+    return render(shader, ranges);
+}
+
 bool Mesh::intersects(const sglm::ray& ray, Face::Intersection& isect) {
     bool foundIntersection = false;
     for (const Face& face : m_faces) {
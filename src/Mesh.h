@@ -1,18 +1,41 @@
 #ifndef MESH_H_INCLUDED
 #define MESH_H_INCLUDED
 
+#include "Constants.h"
 #include "Shader.h"
 #include "Face.h"
+#include <array>
 #include <vector>
 
 class Mesh {
+public:
+    // A mesh of a subchunk has its faces in ranges by the direction they face
+    // (see Chunk::Subchunk::getVertexData()), then the faces that face no
+    // single direction, such as plants. render() only draws the ranges in a
+    // bit mask (bit d for direction d). Other meshes have all their faces in
+    // the last range.
+    static constexpr int NUM_RANGES = NUM_DIRECTIONS + 1;
+    static constexpr unsigned int ALL_RANGES = (1u << NUM_RANGES) - 1;
+
+private:
     bool m_generated;
     unsigned int m_vertexArrayID;
     unsigned int m_vertexBufferID;
     unsigned int m_vertexCount;
+    std::array<unsigned int, NUM_RANGES + 1> m_rangeStarts; // first vertex of each range, then m_vertexCount
     std::vector<Face> m_faces;
+    unsigned int m_queryID;    // occlusion query (0 until the first one)
+    unsigned int m_queryFrame; // the frame it was issued in
 
 public:
+    // the result of an occlusion query in the frame after it was issued
+    enum class Occlusion : unsigned char {
+        UNKNOWN, // no query was issued in the last frame
+        PENDING, // the GPU has not finished it yet
+        VISIBLE,
+        HIDDEN,
+    };
+
     Mesh();
     ~Mesh();
 
@@ -20,10 +43,24 @@ public:
                   int cx = 0, int cy = 0, int cz = 0);
     bool generated() const;
     void erase();
+    void setRanges(const std::array<unsigned int, NUM_RANGES>& vertexCounts);
     unsigned int getVertexCount() const;
-    bool render(const Shader* shader) const;
+    unsigned int getVertexCount(unsigned int ranges) const;
+    bool render(const Shader* shader, unsigned int ranges = ALL_RANGES) const;
     bool intersects(const sglm::ray& ray, Face::Intersection& isect);
 
+    // Occlusion queries (see Chunk::queryOcclusion()). Between startQueries()
+    // and endQueries() nothing is drawn to the screen or the depth buffer.
+    static void startQueries();
+    static void endQueries();
+    static void deleteReleasedQueries(); // of the meshes destroyed since the last call
+    void beginQuery(unsigned int frame);
+    void endQuery();
+    Occlusion getOcclusion(unsigned int frame) const;
+    // render unless the GPU has a result for the pending query that says
+    // that the query's box was hidden
+    bool renderConditional(const Shader* shader, unsigned int ranges = ALL_RANGES) const;
+
 private:
     void getFaces(const vertex_attrib_t* data, int cx, int cy, int cz);
 };
@@ -5,6 +5,7 @@
 #include "Constants.h"
 #include <cassert>
 #include <cmath>
+#include <algorithm>
 
 inline constexpr sglm::vec3 WORLD_UP{ 0.0f, 1.0f, 0.0f };
 inline constexpr float DEFAULT_YAW = -90.0f;
@@ -41,8 +42,22 @@ int Player::getUnRenderDist() {
     return Player::render_dist + 1;
 }
 
+// One ring past the un-render distance, so that chunks are not removed and
+// added again while the player moves back and forth across it.
+// generateTerrain() creates the structures it needs, so they need no rings.
 int Player::getLoadRadius() {
-    return Player::getUnRenderDist() + (100 / CHUNK_WIDTH) + 1;
+    return Player::getUnRenderDist() + 1;
+}
+
+// Chunks beyond the render distance and within this radius are drawn with
+// low-detail meshes (see LodTerrain.h).
+int Player::getLodDist() {
+    return Player::render_dist * 4;
+}
+
+// far enough to see the low-detail meshes
+float Player::getFarPlane() {
+    return std::max(FAR_PLANE, (float) ((Player::getLodDist() + 1) * CHUNK_WIDTH));
 }
 
 int Player::getReach() {
@@ -92,7 +107,8 @@ void Player::setViewMatrix() {
 }
 
 void Player::setProjectionMatrix() {
-    m_projectionMatrix = sglm::perspective(sglm::radians(m_fov), m_aspectRatio, NEAR_PLANE, FAR_PLANE);
+    m_farPlane = getFarPlane();
+    m_projectionMatrix = sglm::perspective(sglm::radians(m_fov), m_aspectRatio, NEAR_PLANE, m_farPlane);
     m_frustum.create(m_viewMatrix, m_projectionMatrix);
 }
 
@@ -151,6 +167,18 @@ void Player::setFOV(float fov) {
     setProjectionMatrix();
 }
 
+void Player::setSpeed(float speed) {
+    assert(speed > 0.0f);
+    m_movementSpeed = speed;
+}
+
+// called every frame, because the render distance can change at any time
+void Player::updateFarPlane() {
+    if (m_farPlane != getFarPlane()) {
+        setProjectionMatrix();
+    }
+}
+
 float Player::getFOV() const {
     return m_fov;
 }
@@ -19,6 +19,7 @@ class Player {
     float m_yaw, m_pitch;                             // euler angles (in degrees)
     float m_movementSpeed, m_mouseSensitivity, m_fov; // camera options
     float m_aspectRatio;
+    float m_farPlane; // getFarPlane() when the projection matrix was made
     
     // store info about the block this player is looking at
     Mesh m_blockOutline;
@@ -26,10 +27,14 @@ class Player {
 
 public:
     std::pair<int, int> chunks_rendered = { 0, 0 };
+    int chunks_occluded = 0; // subchunks in the frustum that cannot be seen
+    int chunks_hidden = 0;   // and that can, but whose occlusion query failed
     static int getRenderDist();
     static void setRenderDist(int radius);
     static int getUnRenderDist();
     static int getLoadRadius();
+    static int getLodDist();
+    static float getFarPlane();
     static int getReach();
     static void setReach(int reach);
 
@@ -39,6 +44,8 @@ public:
     void renderOutline(const Shader* shader) const;
     void setAspectRatio(float aspectRatio);
     void setFOV(float fov);
+    void setSpeed(float speed);
+    void updateFarPlane();
     float getFOV() const;
     const Face::Intersection& getViewRayIsect() const;
     void setViewRayIsect(const Face::Intersection* isect);
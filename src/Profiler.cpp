@@ -0,0 +1,184 @@
+#include "Profiler.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+namespace profiler {
+
+    static const char* ZONE_NAMES[NUM_ZONES] = {
+        "update", "render", "mesh", "terrain gen", "structure gen", "db load", "db store", "autosave",
+    };
+
+    static const char* COUNTER_NAMES[NUM_COUNTERS] = {
+        "GL upload bytes", "db request queue", "db result queue", "db prefetch hits", "loads cancelled",
+        "loads stale", "chunks empty", "chunks structures", "chunks loading", "chunks terrain", "chunks full",
+        "structures", "structure bytes", "lod tiles", "lod bytes", "vertices drawn", "vertices culled",
+    };
+
+    const char* name(Zone zone) {
+        return ZONE_NAMES[(int) zone];
+    }
+
+    const char* name(Counter counter) {
+        return COUNTER_NAMES[(int) counter];
+    }
+
+#ifndef MC_NO_PROFILER
+
+    using Clock = std::chrono::steady_clock;
+    static const Clock::time_point start_time = Clock::now();
+
+    static long long now_ns() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start_time).count();
+    }
+
+    struct ZoneData {
+        std::atomic<long long> count{ 0 };
+        std::atomic<long long> total_ns{ 0 };
+        std::atomic<long long> max_ns{ 0 };
+    };
+
+    static ZoneData zones[NUM_ZONES];
+    static std::atomic<long long> counters[NUM_COUNTERS];
+
+    // Counters that are only added to. Their histories record the amount
+    // added each frame instead of the current value.
+    static bool is_total(Counter counter) {
+        return counter == Counter::GL_UPLOAD_BYTES || counter == Counter::DB_PREFETCH_HITS ||
+            counter == Counter::LOADS_CANCELLED || counter == Counter::LOADS_STALE ||
+            counter == Counter::VERTICES_DRAWN || counter == Counter::VERTICES_CULLED;
+    }
+
+    // Trace events go into a ring buffer. Once it is full the oldest events
+    // are overwritten, so a dump holds the most recent TRACE_CAPACITY zones.
+    struct TraceEvent {
+        long long start_ns, duration_ns;
+        Zone zone;
+        int thread;
+    };
+    static constexpr unsigned long long TRACE_CAPACITY = 1 << 16;
+    static TraceEvent trace[TRACE_CAPACITY];
+    static std::atomic<unsigned long long> trace_next{ 0 };
+
+    static int thread_index() {
+        static std::atomic<int> next_thread{ 0 };
+        thread_local int index = next_thread++;
+        return index;
+    }
+
+    ScopedZone::ScopedZone(Zone zone) : m_zone{ zone }, m_start{ now_ns() } {}
+
+    ScopedZone::~ScopedZone() {
+        long long duration = now_ns() - m_start;
+        ZoneData& data = zones[(int) m_zone];
+        ++data.count;
+        data.total_ns += duration;
+        long long max = data.max_ns;
+        while (duration > max && !data.max_ns.compare_exchange_weak(max, duration));
+        unsigned long long i = trace_next++ % TRACE_CAPACITY;
+        trace[i] = { m_start, duration, m_zone, thread_index() };
+    }
+
+    void add(Counter counter, long long value) {
+        counters[(int) counter] += value;
+    }
+
+    void set(Counter counter, long long value) {
+        counters[(int) counter] = value;
+    }
+
+    long long get(Counter counter) {
+        return counters[(int) counter];
+    }
+
+    ZoneTotals totals(Zone zone) {
+        const ZoneData& data = zones[(int) zone];
+        return { data.count, data.total_ns / 1e6, data.max_ns / 1e6 };
+    }
+
+    static History frame_times;
+    static History zone_histories[NUM_ZONES];
+    static History counter_histories[NUM_COUNTERS];
+
+    static void push(History& history, float value) {
+        history.values[history.offset] = value;
+        history.offset = (history.offset + 1) % HISTORY_SIZE;
+    }
+
+    void end_frame() {
+        static long long last_frame = now_ns();
+        static long long last_zone_ns[NUM_ZONES] = {};
+        static long long last_counter[NUM_COUNTERS] = {};
+
+        long long now = now_ns();
+        push(frame_times, (now - last_frame) / 1e6f);
+        last_frame = now;
+        for (int z = 0; z < NUM_ZONES; ++z) {
+            long long total = zones[z].total_ns;
+            push(zone_histories[z], (total - last_zone_ns[z]) / 1e6f);
+            last_zone_ns[z] = total;
+        }
+        for (int c = 0; c < NUM_COUNTERS; ++c) {
+            long long value = counters[c];
+            if (is_total((Counter) c)) {
+                push(counter_histories[c], (float) (value - last_counter[c]));
+                last_counter[c] = value;
+            } else {
+                push(counter_histories[c], (float) value);
+            }
+        }
+    }
+
+    const History& frame_history() {
+        return frame_times;
+    }
+
+    const History& zone_history(Zone zone) {
+        return zone_histories[(int) zone];
+    }
+
+    const History& counter_history(Counter counter) {
+        return counter_histories[(int) counter];
+    }
+
+    bool dump_trace(const char* file_name) {
+        FILE* file = std::fopen(file_name, "w");
+        if (file == nullptr) {
+            return false;
+        }
+        // Events that are being written while we copy may be torn, which only
+        // affects the few events that were recorded during the dump.
+        unsigned long long end = trace_next;
+        unsigned long long begin = end > TRACE_CAPACITY ? end - TRACE_CAPACITY : 0;
+        std::fprintf(file, "{\"traceEvents\":[\n");
+        for (unsigned long long i = begin; i < end; ++i) {
+            const TraceEvent& e = trace[i % TRACE_CAPACITY];
+            std::fprintf(file, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                         "\"ts\":%.3f,\"dur\":%.3f}%s\n", name(e.zone), e.thread,
+                         e.start_ns / 1e3, e.duration_ns / 1e3, i + 1 < end ? "," : "");
+        }
+        std::fprintf(file, "],\"displayTimeUnit\":\"ms\"}\n");
+        return std::fclose(file) == 0;
+    }
+
+#else
+
+    static History empty_history;
+
+    const History& frame_history() {
+        return empty_history;
+    }
+
+    const History& zone_history(Zone) {
+        return empty_history;
+    }
+
+    const History& counter_history(Counter) {
+        return empty_history;
+    }
+
+#endif
+
+}
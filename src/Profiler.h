@@ -0,0 +1,120 @@
+#ifndef PROFILER_H_INCLUDED
+#define PROFILER_H_INCLUDED
+
+// Lightweight instrumentation that can be used from any thread. A zone times
+// a scope (PROFILE_ZONE(profiler::Zone::MESH)) and a counter is a single
+// atomic value. Once per frame the main thread calls end_frame(), which
+// records how much time each zone took during that frame so the F3 window
+// can draw histograms. Every zone is also written to a ring buffer of trace
+// events that dump_trace() saves in the Chrome trace event format (open it
+// in chrome://tracing or https://ui.perfetto.dev).
+//
+// Define MC_NO_PROFILER to compile all of this out.
+
+namespace profiler {
+
+    enum class Zone : unsigned char {
+        UPDATE,        // World::update() (main thread)
+        RENDER,        // World::renderAll() (main thread)
+        MESH,          // Chunk::Subchunk::updateMesh()
+        TERRAIN_GEN,   // Chunk::generateTerrain()
+        STRUCTURE_GEN, // Chunk::generateStructures()
+        DB_LOAD,       // one batch of loads on a database reader thread
+        DB_STORE,      // one store on the database writer thread
+        AUTOSAVE,      // World::autosave() (main thread)
+        NUM_ZONES
+    };
+
+    enum class Counter : unsigned char {
+        GL_UPLOAD_BYTES,   // bytes of vertex data given to OpenGL
+        DB_REQUEST_QUEUE,  // requests waiting for the database threads
+        DB_RESULT_QUEUE,   // results waiting for the chunk loader thread
+        DB_PREFETCH_HITS,  // loads answered from the prefetched chunks
+        LOADS_CANCELLED,   // loads cancelled because the player moved away first
+        LOADS_STALE,       // results of cancelled loads that the database had already read
+        CHUNKS_EMPTY,      // number of chunks with each Chunk::Status
+        CHUNKS_STRUCTURES,
+        CHUNKS_LOADING,
+        CHUNKS_TERRAIN,
+        CHUNKS_FULL,
+        STRUCTURES,        // structures in the structure index (see Structure.h)
+        STRUCTURE_BYTES,   // memory used by those structures
+        LOD_TILES,         // low-detail tiles beyond the render distance (see LodTerrain.h)
+        LOD_BYTES,         // vertex data of those tiles given to OpenGL
+        VERTICES_DRAWN,    // vertices of subchunks drawn
+        VERTICES_CULLED,   // and of their faces skipped because they face away (see Chunk::render())
+        NUM_COUNTERS
+    };
+
+    inline constexpr int NUM_ZONES = (int) Zone::NUM_ZONES;
+    inline constexpr int NUM_COUNTERS = (int) Counter::NUM_COUNTERS;
+    inline constexpr int HISTORY_SIZE = 240; // frames
+
+    // the last HISTORY_SIZE values, oldest first starting at values[offset]
+    struct History {
+        float values[HISTORY_SIZE];
+        int offset;
+    };
+
+    // totals since the program started
+    struct ZoneTotals {
+        long long count;
+        double total_ms;
+        double max_ms;
+    };
+
+    const char* name(Zone zone);
+    const char* name(Counter counter);
+
+#ifndef MC_NO_PROFILER
+
+    class ScopedZone {
+        Zone m_zone;
+        long long m_start; // nanoseconds
+
+    public:
+        explicit ScopedZone(Zone zone);
+        ~ScopedZone();
+        ScopedZone(const ScopedZone&) = delete;
+        ScopedZone& operator=(const ScopedZone&) = delete;
+    };
+
+    // add() is for counters that only grow (GL_UPLOAD_BYTES). Their history
+    // records how much was added during each frame. set() is for counters
+    // that hold a current value (queue depths, chunk counts).
+    void add(Counter counter, long long value);
+    void set(Counter counter, long long value);
+    long long get(Counter counter);
+    ZoneTotals totals(Zone zone);
+
+    // main thread only
+    void end_frame();
+    const History& frame_history(); // frame times in ms
+    const History& zone_history(Zone zone); // ms spent in the zone each frame
+    const History& counter_history(Counter counter);
+
+    // Write the trace events that are still in the ring buffer to file_name.
+    // Returns false if the file could not be written.
+    bool dump_trace(const char* file_name);
+
+#define PROFILE_ZONE(zone) profiler::ScopedZone profiler_scoped_zone(zone)
+
+#else
+
+    inline void add(Counter, long long) {}
+    inline void set(Counter, long long) {}
+    inline long long get(Counter) { return 0; }
+    inline ZoneTotals totals(Zone) { return { 0, 0.0, 0.0 }; }
+    inline void end_frame() {}
+    const History& frame_history();
+    const History& zone_history(Zone zone);
+    const History& counter_history(Counter counter);
+    inline bool dump_trace(const char*) { return false; }
+
+#define PROFILE_ZONE(zone)
+
+#endif
+
+}
+
+#endif
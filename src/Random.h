@@ -0,0 +1,50 @@
+#ifndef RANDOM_H_INCLUDED
+#define RANDOM_H_INCLUDED
+
+#include <cstdint>
+
+// What a Random is used for. Each purpose gets its own numbers, so that
+// adding draws for one purpose never changes the numbers of another.
+enum class RandomPurpose : uint32_t {
+    DECORATION,     // plants and cacti on top of the terrain, per column
+    STRUCTURE,      // which structure (if any) starts in a column
+    STRUCTURE_SHAPE // the height of a structure, per start column
+};
+
+// A stream of random numbers that only depends on (seed, x, z, purpose).
+// The n-th number of the stream is a hash of that key and n, so there is
+// no shared engine to reseed: any thread can make a Random for any column
+// at any time and get the same numbers, which keeps generated chunks the
+// same no matter which thread generates them or in which order. Unlike the
+// distributions in <random>, range() gives the same numbers with every
+// standard library.
+class Random {
+    uint64_t m_key;
+    uint64_t m_counter = 0;
+
+    // the finalizer of splitmix64
+    static uint64_t mix(uint64_t v) {
+        v = (v ^ (v >> 30)) * 0xBF58476D1CE4E5B9ull;
+        v = (v ^ (v >> 27)) * 0x94D049BB133111EBull;
+        return v ^ (v >> 31);
+    }
+
+public:
+    Random(int seed, int x, int z, RandomPurpose purpose) {
+        uint64_t position = ((uint64_t) (uint32_t) x << 32) | (uint32_t) z;
+        uint64_t stream = ((uint64_t) (uint32_t) seed << 32) | (uint32_t) purpose;
+        m_key = mix(mix(position) ^ stream);
+    }
+
+    uint32_t next() {
+        return (uint32_t) (mix(m_key + ++m_counter * 0x9E3779B97F4A7C15ull) >> 32);
+    }
+
+    // uniform in [min, max]
+    int range(int min, int max) {
+        uint64_t size = (uint64_t) (max - min) + 1;
+        return min + (int) ((next() * size) >> 32);
+    }
+};
+
+#endif
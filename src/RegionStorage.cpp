@@ -0,0 +1,641 @@
+#include "Storage.h"
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <filesystem>
+#include <iostream>
+#include <cassert>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// A world is a directory of region files and a text file named seed that
+// holds the world's seed. Region file r.<rx>.<rz>.mcr holds
+// the REGION_WIDTH x REGION_WIDTH chunks with x >> 5 == rx and z >> 5 == rz:
+//   header (HEADER_SECTORS sectors): for each chunk, (x & 31) + (z & 31) * 32,
+//       the first sector of its data and its length in bytes (two
+//       little-endian uint32s). A length of 0 means it has not been stored.
+//   data: each chunk takes a run of whole sectors
+//
+// A batch (see Storage::begin()) writes the data of its stores to free
+// sectors and waits until it is on the disk. Only then does it write the
+// header of each region it changed, and it waits for those too. So after a
+// crash every header entry points at data that was completely written: the
+// chunk's old data, or its new data if its header got written. A batch is
+// not atomic: a crash between two header writes keeps only some of its
+// chunks' new data. A store outside a batch is a batch of its own.
+//
+// The sectors of a chunk's old data are not reused until its new header is
+// on the disk and no reader that began before that could still read them.
+// On POSIX systems reads come from a read-only mapping of the file, so a
+// load is one copy from the page cache, and openReader() gives readers
+// that load on other threads without locking anything (see RegionReader).
+
+namespace database {
+
+    static constexpr int REGION_WIDTH = 32; // chunks
+    static constexpr int CHUNKS_PER_REGION = REGION_WIDTH * REGION_WIDTH;
+    static constexpr int SECTOR_SIZE = 4096;
+    static constexpr int HEADER_SECTORS = CHUNKS_PER_REGION * 8 / SECTOR_SIZE;
+    static constexpr size_t MAX_OPEN_REGIONS = 64;
+    static constexpr int MAX_READERS = 4;
+
+    static uint32_t read_u32(const unsigned char* p) {
+        return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+    }
+
+    static void write_u32(unsigned char* p, uint32_t value) {
+        for (int i = 0; i < 4; ++i) {
+            p[i] = (unsigned char) (value >> (i * 8));
+        }
+    }
+
+    static int sectors_for(uint32_t length) {
+        return (int) ((length + SECTOR_SIZE - 1) / SECTOR_SIZE);
+    }
+
+    // Wait until everything written to file is on the disk.
+    static void sync_file(std::FILE* file) {
+        std::fflush(file);
+#if defined(_WIN32)
+        _commit(_fileno(file));
+#elif defined(__APPLE__)
+        fsync(fileno(file));
+#else
+        fdatasync(fileno(file));
+#endif
+    }
+
+    // Shared by a RegionStorage and its readers. commits counts the commits
+    // of the storage. A reader's slot is 1 + commits when its batch began,
+    // or 0 between batches. Sectors freed by commit number c can be reused
+    // once no slot is between 1 and c: every reader then sees a header that
+    // does not point at them.
+    struct ReaderEpochs {
+        std::atomic<unsigned long long> commits{ 0 };
+        std::atomic<unsigned long long> slots[MAX_READERS] = {};
+
+        bool canReuse(unsigned long long commit) const {
+            for (const auto& slot : slots) {
+                unsigned long long began = slot.load();
+                if (began != 0 && began <= commit) {
+                    return false;
+                }
+            }
+            return true;
+        }
+    };
+
+    class Region {
+        std::string m_path;
+        std::FILE* m_file;
+        uint32_t m_sector[CHUNKS_PER_REGION];
+        uint32_t m_length[CHUNKS_PER_REGION];
+        std::vector<bool> m_used; // one per sector of the file
+        bool m_dirty; // the header differs from the one on the disk
+        std::vector<bool> m_stored; // one per chunk, stored since the last writeHeader()
+        // (first, count) of sectors that only the header on the disk points at
+        std::vector<std::pair<uint32_t, uint32_t>> m_replaced;
+        // sectors replaced by the commit numbered .first
+        std::vector<std::pair<unsigned long long, std::pair<uint32_t, uint32_t>>> m_retired;
+#ifndef _WIN32
+        int m_fd;
+        const unsigned char* m_map;
+        size_t m_mapSize;
+#endif
+
+    public:
+        Region(const std::string& path, std::FILE* file) : m_path{ path }, m_file{ file }, m_dirty{ false },
+                                                           m_stored(CHUNKS_PER_REGION, false) {
+#ifndef _WIN32
+            m_fd = -1;
+            m_map = nullptr;
+            m_mapSize = 0;
+#endif
+            std::fseek(m_file, 0, SEEK_END);
+            long file_size = std::ftell(m_file);
+            if (file_size < HEADER_SECTORS * SECTOR_SIZE) {
+                // new file: write an empty header
+                std::vector<unsigned char> zeros(HEADER_SECTORS * SECTOR_SIZE, 0);
+                std::fseek(m_file, 0, SEEK_SET);
+                std::fwrite(zeros.data(), 1, zeros.size(), m_file);
+                sync_file(m_file);
+                file_size = (long) zeros.size();
+            }
+            m_used.assign(file_size / SECTOR_SIZE, false);
+            std::fill(m_used.begin(), m_used.begin() + HEADER_SECTORS, true);
+
+            unsigned char header[HEADER_SECTORS * SECTOR_SIZE];
+            std::fseek(m_file, 0, SEEK_SET);
+            if (std::fread(header, 1, sizeof(header), m_file) != sizeof(header)) {
+                std::memset(header, 0, sizeof(header));
+            }
+            for (int i = 0; i < CHUNKS_PER_REGION; ++i) {
+                m_sector[i] = read_u32(header + i * 8);
+                m_length[i] = read_u32(header + i * 8 + 4);
+                if (m_length[i] == 0) {
+                    continue;
+                }
+                // ignore entries that point outside the file or at sectors
+                // that another chunk uses
+                uint32_t first = m_sector[i], last = first + sectors_for(m_length[i]);
+                bool valid = first >= HEADER_SECTORS && last <= m_used.size() &&
+                    std::none_of(m_used.begin() + first, m_used.begin() + last, [](bool b) { return b; });
+                if (valid) {
+                    std::fill(m_used.begin() + first, m_used.begin() + last, true);
+                } else {
+                    std::cout << m_path << ": ignoring invalid entry " << i << std::endl;
+                    m_sector[i] = m_length[i] = 0;
+                }
+            }
+        }
+
+        ~Region() {
+            unmap();
+            std::fclose(m_file);
+        }
+
+        Region(const Region&) = delete;
+        Region& operator=(const Region&) = delete;
+
+        bool load(int index, Buffer& out) {
+            out.clear();
+            if (m_length[index] == 0) {
+                return false;
+            }
+            size_t offset = (size_t) m_sector[index] * SECTOR_SIZE;
+            size_t length = m_length[index];
+#ifndef _WIN32
+            if (m_dirty) {
+                std::fflush(m_file); // so that the mapping sees this batch's data
+            }
+            if (offset + length > m_mapSize) {
+                map();
+            }
+            if (offset + length <= m_mapSize) {
+                out.assign(m_map + offset, m_map + offset + length);
+                return true;
+            }
+#endif
+            out.resize(length);
+            std::fseek(m_file, (long) offset, SEEK_SET);
+            if (std::fread(out.data(), 1, length, m_file) != length) {
+                out.clear();
+                return false;
+            }
+            return true;
+        }
+
+        // Write the data to free sectors. The header on the disk is only
+        // pointed at it by writeHeader(), so the sectors of the old data stay
+        // in use until then.
+        void store(int index, const Buffer& data) {
+            assert(!data.empty());
+            int num_sectors = sectors_for((uint32_t) data.size());
+            uint32_t first = allocate(num_sectors);
+
+            static const unsigned char zeros[SECTOR_SIZE] = {};
+            std::fseek(m_file, (long) first * SECTOR_SIZE, SEEK_SET);
+            std::fwrite(data.data(), 1, data.size(), m_file);
+            std::fwrite(zeros, 1, (size_t) num_sectors * SECTOR_SIZE - data.size(), m_file);
+
+            if (m_length[index] != 0) {
+                uint32_t old = m_sector[index];
+                uint32_t count = sectors_for(m_length[index]);
+                if (m_stored[index]) {
+                    // stored earlier in this batch: the header on the disk
+                    // never pointed at it
+                    std::fill(m_used.begin() + old, m_used.begin() + old + count, false);
+                } else {
+                    m_replaced.push_back({ old, count });
+                }
+            }
+            m_sector[index] = first;
+            m_length[index] = (uint32_t) data.size();
+            m_stored[index] = true;
+            m_dirty = true;
+        }
+
+        bool isDirty() const {
+            return m_dirty;
+        }
+
+        // Wait until the data written by store() is on the disk.
+        void syncData() {
+            sync_file(m_file);
+        }
+
+        // Write the whole header and wait until it is on the disk. The
+        // sectors it no longer points at are freed by reclaim() once the
+        // commit numbered commit can no longer be seen by a reader.
+        void writeHeader(unsigned long long commit) {
+            unsigned char header[HEADER_SECTORS * SECTOR_SIZE];
+            for (int i = 0; i < CHUNKS_PER_REGION; ++i) {
+                write_u32(header + i * 8, m_sector[i]);
+                write_u32(header + i * 8 + 4, m_length[i]);
+            }
+            std::fseek(m_file, 0, SEEK_SET);
+            std::fwrite(header, 1, sizeof(header), m_file);
+            sync_file(m_file);
+            for (const auto& [first, count] : m_replaced) {
+                m_retired.push_back({ commit, { first, count } });
+            }
+            m_replaced.clear();
+            std::fill(m_stored.begin(), m_stored.end(), false);
+            m_dirty = false;
+        }
+
+        void reclaim(const ReaderEpochs& epochs) {
+            auto reusable = [&](const auto& retired) {
+                if (!epochs.canReuse(retired.first)) {
+                    return false;
+                }
+                auto [first, count] = retired.second;
+                std::fill(m_used.begin() + first, m_used.begin() + first + count, false);
+                return true;
+            };
+            m_retired.erase(std::remove_if(m_retired.begin(), m_retired.end(), reusable), m_retired.end());
+        }
+
+        // Closing a region forgets which of its sectors readers may still read.
+        bool canClose() const {
+            return !m_dirty && m_retired.empty();
+        }
+
+        template <typename F>
+        void forEachStored(F&& f) const {
+            for (int i = 0; i < CHUNKS_PER_REGION; ++i) {
+                if (m_length[i] != 0) {
+                    f(i);
+                }
+            }
+        }
+
+    private:
+        // first fit: the first run of num_sectors free sectors, or the end of the file
+        uint32_t allocate(int num_sectors) {
+            int run = 0;
+            for (uint32_t s = HEADER_SECTORS; s < m_used.size(); ++s) {
+                run = m_used[s] ? 0 : run + 1;
+                if (run == num_sectors) {
+                    uint32_t first = s + 1 - num_sectors;
+                    std::fill(m_used.begin() + first, m_used.begin() + s + 1, true);
+                    return first;
+                }
+            }
+            // extend the file, reusing the free sectors at its end
+            uint32_t first = (uint32_t) m_used.size() - run;
+            m_used.resize(first + num_sectors, true);
+            std::fill(m_used.begin() + first, m_used.end(), true);
+            return first;
+        }
+
+        void map() {
+#ifndef _WIN32
+            unmap();
+            if (m_fd == -1) {
+                m_fd = ::open(m_path.c_str(), O_RDONLY);
+            }
+            struct stat st;
+            if (m_fd == -1 || fstat(m_fd, &st) != 0 || st.st_size == 0) {
+                return;
+            }
+            void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, m_fd, 0);
+            if (map != MAP_FAILED) {
+                m_map = static_cast<const unsigned char*>(map);
+                m_mapSize = st.st_size;
+            }
+#endif
+        }
+
+        void unmap() {
+#ifndef _WIN32
+            if (m_map != nullptr) {
+                munmap(const_cast<unsigned char*>(m_map), m_mapSize);
+                m_map = nullptr;
+                m_mapSize = 0;
+            }
+            if (m_fd != -1) {
+                ::close(m_fd);
+                m_fd = -1;
+            }
+#endif
+        }
+    };
+
+    static int chunk_index(int x, int z) {
+        return (x & (REGION_WIDTH - 1)) + (z & (REGION_WIDTH - 1)) * REGION_WIDTH;
+    }
+
+    static std::string region_path(const std::filesystem::path& directory, int rx, int rz) {
+        return (directory / ("r." + std::to_string(rx) + "." + std::to_string(rz) + ".mcr")).string();
+    }
+
+#ifndef _WIN32
+    // Loads through read-only mappings of the region files, header included,
+    // so a load sees the headers as the last commit before its batch left
+    // them. An entry is only rewritten while its chunk is stored, and the
+    // database does not load a chunk that is being stored (except to
+    // prefetch it, and then it drops the data; see Database.cpp), so a
+    // reader does not see half of an entry's update. Entries that point
+    // outside the file are still treated as not stored.
+    class RegionReader : public Storage {
+        struct Mapping {
+            int fd;
+            const unsigned char* data;
+            size_t size;
+        };
+        std::filesystem::path m_directory;
+        std::shared_ptr<ReaderEpochs> m_epochs;
+        int m_slot;
+        std::map<std::pair<int, int>, Mapping> m_mappings;
+
+    public:
+        RegionReader(const std::filesystem::path& directory, std::shared_ptr<ReaderEpochs> epochs, int slot)
+            : m_directory{ directory }, m_epochs{ std::move(epochs) }, m_slot{ slot } {}
+
+        ~RegionReader() {
+            for (auto& [_, mapping] : m_mappings) {
+                unmap(mapping);
+                ::close(mapping.fd);
+            }
+        }
+
+        void begin() override {
+            m_epochs->slots[m_slot].store(m_epochs->commits.load() + 1);
+        }
+
+        void commit() override {
+            m_epochs->slots[m_slot].store(0);
+        }
+
+        bool load(int x, int z, Buffer& out) override {
+            out.clear();
+            Mapping* mapping = getMapping(x >> 5, z >> 5);
+            if (mapping == nullptr) {
+                return false;
+            }
+            if (mapping->size < (size_t) HEADER_SECTORS * SECTOR_SIZE) {
+                remap(*mapping);
+                if (mapping->size < (size_t) HEADER_SECTORS * SECTOR_SIZE) {
+                    return false; // the writer is creating the file
+                }
+            }
+            const unsigned char* entry = mapping->data + chunk_index(x, z) * 8;
+            uint32_t first = read_u32(entry);
+            uint32_t length = read_u32(entry + 4);
+            if (length == 0 || first < HEADER_SECTORS) {
+                return false;
+            }
+            size_t offset = (size_t) first * SECTOR_SIZE;
+            if (offset + length > mapping->size) {
+                remap(*mapping); // the file has grown
+                if (offset + length > mapping->size) {
+                    return false;
+                }
+            }
+            out.assign(mapping->data + offset, mapping->data + offset + length);
+            return true;
+        }
+
+        void store(int, int, const Buffer&) override {
+            assert(false && "a RegionReader only loads");
+        }
+
+        std::vector<std::pair<int, int>> keys() override {
+            return {};
+        }
+
+        bool loadSeed(int&) override {
+            return false;
+        }
+
+        void storeSeed(int) override {
+            assert(false && "a RegionReader only loads");
+        }
+
+    private:
+        // Returns nullptr if the region file does not exist yet. That is
+        // not remembered, since the writer may create it at any time.
+        Mapping* getMapping(int rx, int rz) {
+            auto itr = m_mappings.find({ rx, rz });
+            if (itr != m_mappings.end()) {
+                return &itr->second;
+            }
+            int fd = ::open(region_path(m_directory, rx, rz).c_str(), O_RDONLY);
+            if (fd == -1) {
+                return nullptr;
+            }
+            if (m_mappings.size() >= MAX_OPEN_REGIONS) {
+                for (auto& [_, mapping] : m_mappings) {
+                    unmap(mapping);
+                    ::close(mapping.fd);
+                }
+                m_mappings.clear();
+            }
+            Mapping& mapping = m_mappings[{ rx, rz }];
+            mapping = { fd, nullptr, 0 };
+            remap(mapping);
+            return &mapping;
+        }
+
+        static void remap(Mapping& mapping) {
+            unmap(mapping);
+            struct stat st;
+            if (fstat(mapping.fd, &st) != 0 || st.st_size == 0) {
+                return;
+            }
+            void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, mapping.fd, 0);
+            if (data != MAP_FAILED) {
+                mapping.data = static_cast<const unsigned char*>(data);
+                mapping.size = st.st_size;
+            }
+        }
+
+        static void unmap(Mapping& mapping) {
+            if (mapping.data != nullptr) {
+                munmap(const_cast<unsigned char*>(mapping.data), mapping.size);
+                mapping.data = nullptr;
+                mapping.size = 0;
+            }
+        }
+    };
+#endif
+
+    class RegionStorage : public Storage {
+        std::filesystem::path m_directory;
+        std::map<std::pair<int, int>, Region*> m_regions;
+        std::shared_ptr<ReaderEpochs> m_epochs;
+        int m_numReaders;
+        bool m_inBatch;
+
+    public:
+        explicit RegionStorage(const std::filesystem::path& directory)
+            : m_directory{ directory }, m_epochs{ std::make_shared<ReaderEpochs>() }, m_numReaders{ 0 }, m_inBatch{ false } {}
+
+        ~RegionStorage() {
+            commitRegions();
+            for (const auto& [_, region] : m_regions) {
+                delete region;
+            }
+        }
+
+        void begin() override {
+            m_inBatch = true;
+        }
+
+        void commit() override {
+            commitRegions();
+            m_inBatch = false;
+        }
+
+        Storage* openReader() override {
+#ifndef _WIN32
+            if (m_numReaders < MAX_READERS) {
+                return new RegionReader(m_directory, m_epochs, m_numReaders++);
+            }
+#endif
+            return nullptr;
+        }
+
+        bool load(int x, int z, Buffer& out) override {
+            Region* region = getRegion(x >> 5, z >> 5, false);
+            if (region == nullptr) {
+                out.clear();
+                return false;
+            }
+            return region->load(chunk_index(x, z), out);
+        }
+
+        void store(int x, int z, const Buffer& data) override {
+            Region* region = getRegion(x >> 5, z >> 5, true);
+            if (region != nullptr) {
+                region->store(chunk_index(x, z), data);
+                if (!m_inBatch) {
+                    commitRegions();
+                }
+            }
+        }
+
+        std::vector<std::pair<int, int>> keys() override {
+            std::vector<std::pair<int, int>> result;
+            for (const auto& entry : std::filesystem::directory_iterator(m_directory)) {
+                int rx, rz;
+                char end;
+                std::string name = entry.path().filename().string();
+                if (std::sscanf(name.c_str(), "r.%d.%d.mc%c", &rx, &rz, &end) != 3 || end != 'r') {
+                    continue;
+                }
+                Region* region = getRegion(rx, rz, false);
+                if (region != nullptr) {
+                    region->forEachStored([&](int i) {
+                        result.emplace_back(rx * REGION_WIDTH + i % REGION_WIDTH, rz * REGION_WIDTH + i / REGION_WIDTH);
+                    });
+                }
+            }
+            return result;
+        }
+
+        bool loadSeed(int& seed) override {
+            std::FILE* file = std::fopen((m_directory / "seed").string().c_str(), "r");
+            if (file == nullptr) {
+                return false;
+            }
+            bool found = std::fscanf(file, "%d", &seed) == 1;
+            std::fclose(file);
+            return found;
+        }
+
+        // written to another file first, so that a crash can not leave a
+        // world without a seed
+        void storeSeed(int seed) override {
+            std::filesystem::path path = m_directory / "seed", temp = m_directory / "seed.tmp";
+            std::FILE* file = std::fopen(temp.string().c_str(), "w");
+            if (file == nullptr) {
+                return;
+            }
+            std::fprintf(file, "%d\n", seed);
+            std::fclose(file);
+            std::error_code error;
+            std::filesystem::rename(temp, path, error);
+        }
+
+    private:
+        // All the data first, then the headers (see the top of this file).
+        void commitRegions() {
+            std::vector<Region*> dirty;
+            for (const auto& [_, region] : m_regions) {
+                if (region->isDirty()) {
+                    region->syncData();
+                    dirty.push_back(region);
+                }
+            }
+            unsigned long long commit = m_epochs->commits.load() + 1;
+            for (Region* region : dirty) {
+                region->writeHeader(commit);
+            }
+            if (!dirty.empty()) {
+                m_epochs->commits.store(commit);
+            }
+            for (const auto& [_, region] : m_regions) {
+                region->reclaim(*m_epochs);
+            }
+        }
+
+        // Open (or if create is true, create) the region file. Returns
+        // nullptr if it does not exist and create is false.
+        Region* getRegion(int rx, int rz, bool create) {
+            auto itr = m_regions.find({ rx, rz });
+            if (itr != m_regions.end()) {
+                return itr->second;
+            }
+            std::string path = region_path(m_directory, rx, rz);
+            std::FILE* file = std::fopen(path.c_str(), "r+b");
+            if (file == nullptr && create) {
+                file = std::fopen(path.c_str(), "w+b");
+            }
+            if (file == nullptr) {
+                return nullptr;
+            }
+            if (m_regions.size() >= MAX_OPEN_REGIONS) {
+                // the player has moved far away from most of these. Regions
+                // with stores that are not committed, or with sectors that a
+                // reader may still read, stay open.
+                for (auto itr = m_regions.begin(); itr != m_regions.end();) {
+                    if (itr->second->canClose()) {
+                        delete itr->second;
+                        itr = m_regions.erase(itr);
+                    } else {
+                        ++itr;
+                    }
+                }
+            }
+            Region* region = new Region(path, file);
+            m_regions.emplace(std::make_pair(rx, rz), region);
+            return region;
+        }
+    };
+
+    Storage* open_region_storage(const char* directory) {
+        std::error_code error;
+        std::filesystem::create_directories(directory, error);
+        if (!std::filesystem::is_directory(directory)) {
+            std::cout << "Could not open region directory " << directory << std::endl;
+            return nullptr;
+        }
+        return new RegionStorage(directory);
+    }
+
+}
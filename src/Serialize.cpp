@@ -0,0 +1,197 @@
+#include "Chunk.h"
+#include "Block.h"
+#include "Constants.h"
+#include "TerrainGen.h"
+#include <vector>
+#include <iostream>
+#include <cstring>
+#include <cstdint>
+#include <cassert>
+
+// Chunks are saved to the database in this format:
+//   header (8 bytes):  'M' 'C' 'C' 'K', version, encoding, generator version
+//                      (2 bytes, little-endian, 0 in a snapshot)
+// followed by one of two encodings:
+//   ENCODING_PALETTE_RLE (a full snapshot):
+//     for each subchunk, from the bottom up: Chunk::BlockList::encode()
+//   ENCODING_DELTA (only the blocks that differ from generated terrain):
+//     the seed given to generateTerrain() (4 bytes, little-endian), then for
+//     each changed block, in chunk_index() order: the number of unchanged
+//     blocks since the previous change (varint) and the block id (1 byte)
+// Most of a chunk is long vertical runs of stone or air, so a snapshot takes
+// a few KB instead of BLOCKS_PER_CHUNK bytes. A chunk with a few player
+// edits is only a few bytes as a delta, but loading it means generating the
+// terrain again. serialize() writes whichever encoding is smaller.
+//
+// A delta is only correct as long as generateTerrain() and the structures
+// produce the same blocks as when it was saved, so it records
+// GENERATOR_VERSION (see TerrainGen.h). A delta saved by another version is
+// not applied to the new terrain: deserialize() reports it and fails, so the
+// chunk is generated again, and the saved data stays in the database until
+// the chunk is edited and saved. Deltas saved before the version was
+// recorded have version 0.
+//
+// Worlds saved before this format existed store each chunk as a raw array of
+// BLOCKS_PER_CHUNK block ids with no header. Block ids are far below 'M', so
+// these can never be mistaken for a chunk with a header.
+
+static constexpr unsigned char MAGIC[4] = { 'M', 'C', 'C', 'K' };
+static constexpr int HEADER_SIZE = 8;
+static constexpr unsigned char FORMAT_VERSION = 1;
+
+enum Encoding : unsigned char {
+    ENCODING_PALETTE_RLE = 1,
+    ENCODING_DELTA = 2,
+};
+
+// terrain generated for deltas, reused so that saves and loads don't allocate
+static thread_local std::vector<Block::BlockType> generated;
+
+static void write_header(std::vector<unsigned char>& out, Encoding encoding, int generator = 0) {
+    out.insert(out.end(), MAGIC, MAGIC + 4);
+    out.push_back(FORMAT_VERSION);
+    out.push_back(encoding);
+    out.push_back((unsigned char) generator);
+    out.push_back((unsigned char) (generator >> 8));
+}
+
+static void write_varint(std::vector<unsigned char>& out, unsigned int value) {
+    for (; value >= 0x80; value >>= 7) {
+        out.push_back((unsigned char) (value | 0x80));
+    }
+    out.push_back((unsigned char) value);
+}
+
+static bool read_varint(const unsigned char*& in, const unsigned char* end, unsigned int& value) {
+    value = 0;
+    for (int shift = 0; in < end && shift < 32; shift += 7) {
+        unsigned char byte = *in++;
+        value |= (unsigned int) (byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Replace the contents of out with this chunk, as a delta against the terrain
+// that generateTerrain(seed) creates or as a full snapshot, whichever is
+// smaller. If allowDelta is false it is always a snapshot.
+void Chunk::serialize(std::vector<unsigned char>& out, int seed, bool allowDelta) const {
+    assert(m_status >= Status::TERRAIN);
+    takeSnapshot().serialize(out, seed, allowDelta);
+}
+
+// The snapshot is encoded straight from each BlockList's packed data.
+void Chunk::Snapshot::serialize(std::vector<unsigned char>& out, int seed, bool allowDelta) const {
+    out.clear();
+    write_header(out, ENCODING_PALETTE_RLE);
+    for (const BlockList& blocks : m_blocks) {
+        blocks.encode(out);
+    }
+    size_t snapshot_size = out.size();
+    if (!allowDelta) {
+        return;
+    }
+
+    generated.resize(BLOCKS_PER_CHUNK);
+    generateTerrain(m_X, m_Z, *m_noise, generated.data(), seed);
+    size_t delta_start = out.size();
+    write_header(out, ENCODING_DELTA, GENERATOR_VERSION);
+    for (int i = 0; i < 4; ++i) {
+        out.push_back((unsigned char) ((uint32_t) seed >> (i * 8)));
+    }
+    int last_change = -1;
+    for (int y = 0; y < NUM_SUBCHUNKS && out.size() - delta_start < snapshot_size; ++y) {
+        Block::BlockType* blocks = m_blocks[y].get_all();
+        const Block::BlockType* base = generated.data() + y * BLOCKS_PER_SUBCHUNK;
+        for (int i = 0; i < BLOCKS_PER_SUBCHUNK; ++i) {
+            if (blocks[i] != base[i]) {
+                int index = y * BLOCKS_PER_SUBCHUNK + i;
+                write_varint(out, index - last_change - 1);
+                out.push_back((unsigned char) blocks[i]);
+                last_change = index;
+            }
+        }
+        delete[] blocks;
+    }
+    size_t delta_size = out.size() - delta_start;
+    if (delta_size < snapshot_size) {
+        std::memmove(out.data(), out.data() + delta_start, delta_size);
+        out.resize(delta_size);
+    } else {
+        out.resize(snapshot_size);
+    }
+}
+
+// Replace the contents of out with a snapshot of blocks, as if they were the
+// blocks of a chunk, without making the chunk (see tools/Pregenerate.cpp).
+void Chunk::serializeBlocks(const Block::BlockType* blocks, std::vector<unsigned char>& out) {
+    out.clear();
+    write_header(out, ENCODING_PALETTE_RLE);
+    BlockList list;
+    for (int y = 0; y < NUM_SUBCHUNKS; ++y) {
+        list.create(blocks + y * BLOCKS_PER_SUBCHUNK, BLOCKS_PER_SUBCHUNK);
+        list.encode(out);
+    }
+}
+
+// Fill this chunk with data that was saved by serialize() (or with a raw
+// array of blocks saved by an older version). Returns false if the data is
+// not a chunk this version can read, in which case the chunk is unchanged.
+bool Chunk::deserialize(const unsigned char* data, int size) {
+    assert(m_status == Status::LOADING);
+    const unsigned char* in = data;
+    if (size == BLOCKS_PER_CHUNK && std::memcmp(in, MAGIC, 4) != 0) {
+        addBlockData(reinterpret_cast<const Block::BlockType*>(in));
+        return true;
+    }
+    if (size < HEADER_SIZE || std::memcmp(in, MAGIC, 4) != 0 || in[4] != FORMAT_VERSION) {
+        return false;
+    }
+    const unsigned char* end = in + size;
+    Encoding encoding = static_cast<Encoding>(in[5]);
+    int generator = in[6] | (in[7] << 8);
+    in += HEADER_SIZE;
+    if (encoding == ENCODING_PALETTE_RLE) {
+        for (Subchunk* subchunk : m_subchunks) {
+            in = subchunk->m_blocks.decode(in, end, BLOCKS_PER_SUBCHUNK);
+            if (in == nullptr) {
+                for (Subchunk* sc : m_subchunks) {
+                    sc->m_blocks.deleteAll();
+                }
+                return false;
+            }
+        }
+        setTerrain();
+        return true;
+    }
+    if (encoding == ENCODING_DELTA && generator != GENERATOR_VERSION) {
+        std::cout << "Chunk (" << m_X << ", " << m_Z << ") was saved as changes to the terrain of generator version "
+                  << generator << ", not " << GENERATOR_VERSION << ". Generating it again without the changes." << std::endl;
+        return false;
+    }
+    if (encoding == ENCODING_DELTA && end - in >= 4) {
+        uint32_t seed = in[0] | (in[1] << 8) | (in[2] << 16) | ((uint32_t) in[3] << 24);
+        in += 4;
+        generated.resize(BLOCKS_PER_CHUNK);
+        generateTerrain(generated.data(), (int) seed);
+        long long index = -1;
+        while (in < end) {
+            unsigned int skip;
+            if (!read_varint(in, end, skip) || in == end) {
+                return false;
+            }
+            index += (long long) skip + 1;
+            int block = *in++;
+            if (index >= BLOCKS_PER_CHUNK || block >= (int) Block::BlockType::NUM_BLOCK_TYPES ||
+                !Block::isReal(static_cast<Block::BlockType>(block))) {
+                return false;
+            }
+            generated[index] = static_cast<Block::BlockType>(block);
+        }
+        addBlockData(generated.data());
+        return true;
+    }
+    return false;
+}
@@ -1,10 +1,14 @@
 #include "Shader.h"
 #include "Texture.h"
-#include <glad/glad.h>
 #include <sglm/sglm.h>
+#include <string>
+
+#ifndef MC_HEADLESS
+
+#include <glad/glad.h>
 #include <iostream>
 #include <fstream>
-#include <string>
+#include <cstring>
 #include <cassert>
 
 Shader::Shader(const std::string& vertexFilePath, const std::string& fragmentFilePath) {
@@ -108,3 +112,20 @@ int Shader::getUniformLocation(const std::string& name) {
     assert(m_uniforms[index] != -1);
     return m_uniforms[index];
 }
+
+#else
+
+// Headless builds have no OpenGL context, so a shader is never compiled and
+// setting a uniform does nothing.
+
+Shader::Shader(const std::string& /* vertexFilePath */, const std::string& /* fragmentFilePath */) :
+m_shaderID{ 0 }, m_uniforms{} {}
+Shader::~Shader() {}
+void Shader::bind() const {}
+void Shader::unbind() const {}
+void Shader::addTexture(const Texture* /* texture */, const std::string& /* name */) {}
+void Shader::addUniform1i(const std::string& /* name */, int /* v0 */) {}
+void Shader::addUniform3f(const std::string& /* name */, float /* f1 */, float /* f2 */, float /* f3 */) {}
+void Shader::addUniformMat4f(const std::string& /* name */, const sglm::mat4& /* matrix */) {}
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef SPSC_RING_H_INCLUDED
+#define SPSC_RING_H_INCLUDED
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+// A bounded queue between exactly one producer thread and one consumer
+// thread, without locks. The producer only writes m_tail and the consumer
+// only writes m_head, each on its own cache line. The slots are allocated
+// once, so pushing and popping never allocate.
+template <typename T, std::size_t CAPACITY>
+class SpscRing {
+    static_assert(CAPACITY > 0 && (CAPACITY & (CAPACITY - 1)) == 0, "CAPACITY must be a power of 2");
+
+    alignas(64) std::atomic<std::size_t> m_head{ 0 }; // next slot to pop
+    alignas(64) std::atomic<std::size_t> m_tail{ 0 }; // next slot to push
+    alignas(64) T m_slots[CAPACITY];
+
+public:
+    // producer only. Returns false if the ring is full.
+    bool push(const T& value) {
+        std::size_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail - m_head.load(std::memory_order_acquire) == CAPACITY) {
+            return false;
+        }
+        m_slots[tail & (CAPACITY - 1)] = value;
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // consumer only. Appends everything in the ring to out and returns the
+    // number of values appended.
+    std::size_t popAll(std::vector<T>& out) {
+        std::size_t head = m_head.load(std::memory_order_relaxed);
+        std::size_t tail = m_tail.load(std::memory_order_acquire);
+        for (std::size_t i = head; i != tail; ++i) {
+            out.push_back(m_slots[i & (CAPACITY - 1)]);
+        }
+        m_head.store(tail, std::memory_order_release);
+        return tail - head;
+    }
+
+    // any thread, but the ring may change before the caller looks at it
+    std::size_t size() const {
+        return m_tail.load(std::memory_order_acquire) - m_head.load(std::memory_order_acquire);
+    }
+};
+
+#endif
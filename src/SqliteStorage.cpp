@@ -0,0 +1,205 @@
+#include "Storage.h"
+#include <sqlite3/sqlite3.h>
+#include <iostream>
+#include <algorithm>
+#include <string>
+#include <cassert>
+
+namespace database {
+
+    static const char* CREATE_TABLE = "CREATE TABLE IF NOT EXISTS mcdb_table (x INT,"
+        "z INT, data BLOB NOT NULL, CONSTRAINT mcdb_pk PRIMARY KEY (x, z));";
+    static const char* SELECT_ROW = "SELECT data FROM mcdb_table WHERE x = ? AND z = ?";
+    static const char* INSERT_ROW = "INSERT OR REPLACE INTO mcdb_table VALUES (?, ?, ?)";
+    static const char* SELECT_KEYS = "SELECT x, z FROM mcdb_table";
+
+    // values that belong to the whole world, such as its seed
+    static const char* CREATE_META_TABLE = "CREATE TABLE IF NOT EXISTS mcdb_meta (name TEXT PRIMARY KEY, value INT);";
+    static const char* SELECT_SEED = "SELECT value FROM mcdb_meta WHERE name = 'seed'";
+    static const char* INSERT_SEED = "INSERT OR REPLACE INTO mcdb_meta VALUES ('seed', ?)";
+
+    // loadBatch() reads each run of keys with the same x and consecutive z
+    // with one range query, in primary key order
+    static const char* SELECT_RANGE = "SELECT z, data FROM mcdb_table WHERE x = ? AND z BETWEEN ? AND ?";
+
+    // Write-ahead logging lets a commit append to the log instead of
+    // rewriting pages, and with synchronous=NORMAL the log is only synced at
+    // checkpoints. page_size only applies to a new database file.
+    static const char* PRAGMAS = "PRAGMA page_size = 16384;"
+        "PRAGMA journal_mode = WAL;"
+        "PRAGMA synchronous = NORMAL;"
+        "PRAGMA cache_size = -32768;" // 32 MB
+        "PRAGMA temp_store = MEMORY;";
+
+    // Readers share the database file through the OS page cache, so they
+    // get a smaller cache of their own.
+    static const char* READER_PRAGMAS = "PRAGMA cache_size = -8192;" // 8 MB
+        "PRAGMA temp_store = MEMORY;";
+
+    static inline void check(int error_code, int sqlite_call_index) {
+#ifndef NDEBUG
+        if (error_code != SQLITE_OK && error_code != SQLITE_DONE && error_code != SQLITE_ROW) {
+            std::cout << "Error on sqlite call #" << sqlite_call_index << std::endl;
+            std::cout << "SQLiteError: " << sqlite3_errstr(error_code) << std::endl;
+        }
+#else
+        (void) error_code, sqlite_call_index; // avoid unused variable warnings
+#endif
+    }
+
+    // In WAL mode any number of read-only connections can read while one
+    // connection writes. Each reader sees the database as it was when its
+    // transaction began.
+    class SqliteStorage : public Storage {
+        std::string m_fileName;
+        sqlite3* m_db;
+        sqlite3_stmt* m_selectStmt;
+        sqlite3_stmt* m_insertStmt; // nullptr for a reader
+        sqlite3_stmt* m_rangeStmt;
+
+    public:
+        SqliteStorage(const char* file_name, sqlite3* db, bool reader) : m_fileName{ file_name },
+        m_db{ db }, m_selectStmt{ nullptr }, m_insertStmt{ nullptr }, m_rangeStmt{ nullptr } {
+            if (reader) {
+                check(sqlite3_exec(m_db, READER_PRAGMAS, nullptr, nullptr, nullptr), 30);
+            } else {
+                check(sqlite3_exec(m_db, PRAGMAS, nullptr, nullptr, nullptr), 18);
+                check(sqlite3_exec(m_db, CREATE_TABLE, nullptr, nullptr, nullptr), 3);
+                check(sqlite3_exec(m_db, CREATE_META_TABLE, nullptr, nullptr, nullptr), 31);
+                check(sqlite3_prepare_v2(m_db, INSERT_ROW, -1, &m_insertStmt, nullptr), 5);
+            }
+            check(sqlite3_prepare_v2(m_db, SELECT_ROW, -1, &m_selectStmt, nullptr), 4);
+            check(sqlite3_prepare_v2(m_db, SELECT_RANGE, -1, &m_rangeStmt, nullptr), 21);
+        }
+
+        ~SqliteStorage() {
+            check(sqlite3_finalize(m_rangeStmt), 22);
+            check(sqlite3_finalize(m_selectStmt), 14);
+            check(sqlite3_finalize(m_insertStmt), 15);
+            check(sqlite3_close(m_db), 17);
+        }
+
+        void begin() override {
+            check(sqlite3_exec(m_db, "BEGIN", nullptr, nullptr, nullptr), 19);
+        }
+
+        void commit() override {
+            check(sqlite3_exec(m_db, "COMMIT", nullptr, nullptr, nullptr), 20);
+        }
+
+        bool load(int x, int z, Buffer& out) override {
+            out.clear();
+            check(sqlite3_bind_int(m_selectStmt, 1, x), 6);
+            check(sqlite3_bind_int(m_selectStmt, 2, z), 7);
+            bool found = sqlite3_step(m_selectStmt) == SQLITE_ROW;
+            if (found) {
+                // the blob is only valid until the statement is reset
+                int blob_size = sqlite3_column_bytes(m_selectStmt, 0);
+                const unsigned char* blob_data = static_cast<const unsigned char*>(sqlite3_column_blob(m_selectStmt, 0));
+                out.assign(blob_data, blob_data + blob_size);
+            }
+            check(sqlite3_reset(m_selectStmt), 8);
+            return found;
+        }
+
+        void loadBatch(const std::vector<std::pair<int, int>>& keys,
+                       const std::vector<Buffer*>& out, std::vector<bool>& found) override {
+            found.assign(keys.size(), false);
+            std::vector<size_t> order(keys.size());
+            for (size_t i = 0; i < order.size(); ++i) {
+                order[i] = i;
+                out[i]->clear();
+            }
+            std::sort(order.begin(), order.end(), [&keys](size_t a, size_t b) { return keys[a] < keys[b]; });
+            for (size_t first = 0; first < order.size();) {
+                // keys[order[first..last)] have the same x and consecutive z
+                auto [x, z] = keys[order[first]];
+                size_t last = first + 1;
+                while (last < order.size() && keys[order[last]].first == x && keys[order[last]].second - z <= 1) {
+                    z = keys[order[last++]].second;
+                }
+                check(sqlite3_bind_int(m_rangeStmt, 1, x), 23);
+                check(sqlite3_bind_int(m_rangeStmt, 2, keys[order[first]].second), 24);
+                check(sqlite3_bind_int(m_rangeStmt, 3, z), 25);
+                size_t next = first;
+                while (sqlite3_step(m_rangeStmt) == SQLITE_ROW) {
+                    int row_z = sqlite3_column_int(m_rangeStmt, 0);
+                    int blob_size = sqlite3_column_bytes(m_rangeStmt, 1);
+                    const unsigned char* blob_data = static_cast<const unsigned char*>(sqlite3_column_blob(m_rangeStmt, 1));
+                    for (; next < last && keys[order[next]].second <= row_z; ++next) {
+                        if (keys[order[next]].second == row_z) {
+                            out[order[next]]->assign(blob_data, blob_data + blob_size);
+                            found[order[next]] = true;
+                        }
+                    }
+                }
+                check(sqlite3_reset(m_rangeStmt), 26);
+                first = last;
+            }
+        }
+
+        void store(int x, int z, const Buffer& data) override {
+            assert(m_insertStmt != nullptr);
+            check(sqlite3_bind_int(m_insertStmt, 1, x), 9);
+            check(sqlite3_bind_int(m_insertStmt, 2, z), 10);
+            check(sqlite3_bind_blob(m_insertStmt, 3, data.data(), (int) data.size(), SQLITE_STATIC), 11);
+            check(sqlite3_step(m_insertStmt), 12);
+            check(sqlite3_reset(m_insertStmt), 13);
+        }
+
+        std::vector<std::pair<int, int>> keys() override {
+            std::vector<std::pair<int, int>> result;
+            sqlite3_stmt* stmt = nullptr;
+            check(sqlite3_prepare_v2(m_db, SELECT_KEYS, -1, &stmt, nullptr), 27);
+            while (sqlite3_step(stmt) == SQLITE_ROW) {
+                result.emplace_back(sqlite3_column_int(stmt, 0), sqlite3_column_int(stmt, 1));
+            }
+            check(sqlite3_finalize(stmt), 28);
+            return result;
+        }
+
+        bool loadSeed(int& seed) override {
+            sqlite3_stmt* stmt = nullptr;
+            check(sqlite3_prepare_v2(m_db, SELECT_SEED, -1, &stmt, nullptr), 32);
+            bool found = sqlite3_step(stmt) == SQLITE_ROW;
+            if (found) {
+                seed = sqlite3_column_int(stmt, 0);
+            }
+            check(sqlite3_finalize(stmt), 33);
+            return found;
+        }
+
+        void storeSeed(int seed) override {
+            assert(m_insertStmt != nullptr);
+            sqlite3_stmt* stmt = nullptr;
+            check(sqlite3_prepare_v2(m_db, INSERT_SEED, -1, &stmt, nullptr), 34);
+            check(sqlite3_bind_int(stmt, 1, seed), 35);
+            check(sqlite3_step(stmt), 36);
+            check(sqlite3_finalize(stmt), 37);
+        }
+
+        Storage* openReader() override {
+            sqlite3* db = nullptr;
+            int error = sqlite3_open_v2(m_fileName.c_str(), &db, SQLITE_OPEN_READONLY, nullptr);
+            if (error != SQLITE_OK) {
+                check(error, 29);
+                sqlite3_close(db);
+                return nullptr;
+            }
+            return new SqliteStorage(m_fileName.c_str(), db, true);
+        }
+    };
+
+    Storage* open_sqlite_storage(const char* file_name) {
+        check(sqlite3_initialize(), 1);
+        sqlite3* db = nullptr;
+        int error = sqlite3_open(file_name, &db);
+        if (error != SQLITE_OK) {
+            std::cout << "Could not open " << file_name << ": " << sqlite3_errstr(error) << std::endl;
+            sqlite3_close(db);
+            return nullptr;
+        }
+        return new SqliteStorage(file_name, db, false);
+    }
+
+}
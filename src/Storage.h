@@ -0,0 +1,67 @@
+#ifndef STORAGE_H_INCLUDED
+#define STORAGE_H_INCLUDED
+
+#include "Database.h"
+#include <vector>
+#include <utility>
+#include <cstddef>
+
+namespace database {
+
+    // Where the chunks of a world are saved. Each Storage is only used by one
+    // thread at a time: the database writer thread owns the one that stores,
+    // and each reader thread owns one from openReader() (tools/ConvertWorld.cpp
+    // uses two directly). Chunks are opaque blobs (see Serialize.cpp) keyed
+    // by their chunk coordinates.
+    class Storage {
+    public:
+        virtual ~Storage() = default;
+
+        // Stores and loads between begin() and commit() are one batch. A
+        // backend may make the batch atomic and only write it at commit().
+        virtual void begin() {}
+        virtual void commit() {}
+
+        // Replace the contents of out with the chunk's data. Returns false
+        // (and leaves out empty) if the chunk has never been stored.
+        virtual bool load(int x, int z, Buffer& out) = 0;
+        virtual void store(int x, int z, const Buffer& data) = 0;
+
+        // Load keys[i] into *out[i] and set found[i] for every i. Backends
+        // that can read many chunks with one query override this.
+        virtual void loadBatch(const std::vector<std::pair<int, int>>& keys,
+                               const std::vector<Buffer*>& out, std::vector<bool>& found) {
+            found.resize(keys.size());
+            for (std::size_t i = 0; i < keys.size(); ++i) {
+                found[i] = load(keys[i].first, keys[i].second, *out[i]);
+            }
+        }
+
+        // every chunk that has been stored (for converting worlds)
+        virtual std::vector<std::pair<int, int>> keys() = 0;
+
+        // The seed the world's terrain is generated with. Returns false if
+        // no seed has been stored, as in worlds saved before it was, which
+        // were all generated with WORLD_SEED.
+        virtual bool loadSeed(int& seed) = 0;
+        virtual void storeSeed(int seed) = 0;
+
+        // Open another connection to the same world that only loads, so that
+        // loads can run on other threads while this one stores. A load sees
+        // every store that was committed before its batch began. Returns
+        // nullptr if the backend can not do this, in which case all loads go
+        // through this Storage.
+        virtual Storage* openReader() { return nullptr; }
+    };
+
+    // Returns nullptr if the storage could not be opened.
+    Storage* open_storage(Backend backend, const char* path);
+    Storage* open_sqlite_storage(const char* file_name); // in SqliteStorage.cpp
+    Storage* open_region_storage(const char* directory); // in RegionStorage.cpp
+
+    // Parses "sqlite" or "region". Returns false for anything else.
+    bool parse_backend(const char* name, Backend& backend);
+
+}
+
+#endif
@@ -1,203 +1,330 @@
 #include "Structure.h"
+#include "Random.h"
 
-#include <random>
+#include "Profiler.h"
+
+#include <map>
+#include <array>
+#include <vector>
+#include <shared_mutex>
+#include <algorithm>
+#include <cstdlib>
 #include <cassert>
 
-// mt is the engine which generates the random numbers
-static std::mt19937 mt;
+// A region is evicted as a whole once the player is far away from it.
+static constexpr int REGION_WIDTH = Structure::REGION_WIDTH;
+static constexpr int CHUNKS_PER_REGION = REGION_WIDTH * REGION_WIDTH;
 
-static std::uniform_int_distribution<std::mt19937::result_type> tree_height(6, 12);
-static std::uniform_int_distribution<std::mt19937::result_type> giant_tree_height(20, 30);
+struct Region {
+    std::array<std::vector<Structure>, CHUNKS_PER_REGION> chunks; // the structures starting in each chunk
+    long long count = 0;
+    long long bytes = 0;
+};
 
+// Terrain generation reads the index while generateStructures() adds to it,
+// possibly on other threads.
+static std::map<std::pair<int, int>, Region> regions;
+static long long resident_count = 0, resident_bytes = 0;
+static std::shared_mutex structures_mutex;
 
-static std::map<std::pair<int, int>, std::vector<Structure>> structures;
+static int floor_div(int a, int b) {
+    return a / b - (a % b < 0 ? 1 : 0);
+}
 
-void Structure::create(StructureType type, int start_x, int start_z) {
-    Structure s = Structure(type, start_x, start_z);
-    for (auto itr = s.m_structure_blocks.begin(); itr != s.m_structure_blocks.end(); ++itr) {
-        std::pair<int, int> key = itr->first;
-        if (structures.find(key) == structures.end()) {
-            structures[key] = std::vector<Structure>();
-        }
-        structures[key].push_back(s);
-    }
+std::pair<int, int> Structure::getRegion(int cx, int cz) {
+    return { floor_div(cx, REGION_WIDTH), floor_div(cz, REGION_WIDTH) };
 }
 
-Structure::Structure(StructureType type, int start_x, int start_z) :
-m_startX{ start_x }, m_startZ{ start_z }, m_type{ type } {
-    switch (type) {
-        case StructureType::OAK_TREE:
-            generateOakTree(start_x, start_z);
-            break;
-        case StructureType::JUNGLE_TREE:
-            generateJungleTree(start_x, start_z);
-            break;
-        case StructureType::GIANT_JUNGLE_TREE:
-            generateGiantJungleTree(start_x, start_z);
-            break;
-        case StructureType::JUNGLE_BUSH:
-            generateJungleBush(start_x, start_z);
-            break;
-        default:
-            throw "Unhandled Structure type";
-    }
+static int index_in_region(int cx, int cz) {
+    auto [rx, rz] = Structure::getRegion(cx, cz);
+    return (cx - rx * REGION_WIDTH) * REGION_WIDTH + (cz - rz * REGION_WIDTH);
 }
 
-std::vector<Structure> Structure::getStructures(int cx, int cz) {
-    if (structures.find({ cx, cz }) == structures.end()) {
-        return { };
+// the structures that start in chunk (cx, cz), or nullptr if they have not
+// been created. The caller holds structures_mutex.
+static const std::vector<Structure>* find_chunk(int cx, int cz) {
+    auto itr = regions.find(Structure::getRegion(cx, cz));
+    if (itr == regions.end()) {
+        return nullptr;
     }
-    return structures[{ cx, cz }];
+    return &itr->second.chunks[index_in_region(cx, cz)];
 }
 
-StructureType Structure::getType() const {
-    return m_type;
+static void update_counters() {
+    profiler::set(profiler::Counter::STRUCTURES, resident_count);
+    profiler::set(profiler::Counter::STRUCTURE_BYTES, resident_bytes);
 }
 
-std::pair<int, int> Structure::getStart() const {
-    return { m_startX, m_startZ };
+void Structure::createRegion(int rx, int rz, const std::vector<StructureStart>& starts, int seed) {
+    // build the region before taking the lock, it only depends on the seed
+    Region region;
+    for (const StructureStart& start : starts) {
+        int cx = floor_div(start.x, CHUNK_WIDTH), cz = floor_div(start.z, CHUNK_WIDTH);
+        assert(getRegion(cx, cz) == std::make_pair(rx, rz));
+        region.chunks[index_in_region(cx, cz)].push_back(Structure(start.type, start.x, start.z, seed));
+    }
+    region.count = (long long) starts.size();
+    region.bytes = (long long) sizeof(Region);
+    for (const std::vector<Structure>& chunk : region.chunks) {
+        region.bytes += (long long) (chunk.capacity() * sizeof(Structure));
+    }
+    structures_mutex.lock();
+    if (regions.find({ rx, rz }) == regions.end()) {
+        resident_count += region.count;
+        resident_bytes += region.bytes;
+        regions.emplace(std::make_pair(rx, rz), std::move(region));
+        update_counters();
+    }
+    structures_mutex.unlock();
 }
 
-std::vector<s_block> Structure::getBlocks(int cx, int cz) const {
-    std::pair<int, int> chunk = { cx, cz };
-    if (m_structure_blocks.find(chunk) == m_structure_blocks.end()) {
-        return { };
-    }
-    return m_structure_blocks.at(chunk);
+bool Structure::isCreated(int cx, int cz) {
+    structures_mutex.lock_shared();
+    bool created = find_chunk(cx, cz) != nullptr;
+    structures_mutex.unlock_shared();
+    return created;
 }
 
-static std::pair<int, int> getChunk(int x, int z) {
-    int cx;
-    if (x >= 0) {
-        cx = x / CHUNK_WIDTH;
-    } else {
-        cx = x / CHUNK_WIDTH - 1;
-        if (x % CHUNK_WIDTH == 0) {
-            ++cx;
+void Structure::evictFarFrom(int cx, int cz, int radius) {
+    structures_mutex.lock();
+    for (auto itr = regions.begin(); itr != regions.end();) {
+        // distance from (cx, cz) to the closest chunk of the region
+        int x0 = itr->first.first * REGION_WIDTH, z0 = itr->first.second * REGION_WIDTH;
+        int dx = std::max({ x0 - cx, 0, cx - (x0 + REGION_WIDTH - 1) });
+        int dz = std::max({ z0 - cz, 0, cz - (z0 + REGION_WIDTH - 1) });
+        if (dx * dx + dz * dz > radius * radius) {
+            resident_count -= itr->second.count;
+            resident_bytes -= itr->second.bytes;
+            itr = regions.erase(itr);
+        } else {
+            ++itr;
         }
     }
-    int cz;
-    if (z >= 0) {
-        cz = z / CHUNK_WIDTH;
-    } else {
-        cz = z / CHUNK_WIDTH - 1;
-        if (z % CHUNK_WIDTH == 0) {
-            ++cz;
-        }
-    }
-    return { cx, cz };
+    update_counters();
+    structures_mutex.unlock();
 }
 
-void Structure::addBlock(int x, int y, int z, Block::BlockType block) {
-    std::pair<int, int> chunk = getChunk(x, z);
-    if (m_structure_blocks.find(chunk) == m_structure_blocks.end()) {
-        m_structure_blocks[chunk] = std::vector<s_block>();
-    }
-    x = x - chunk.first * CHUNK_WIDTH;
-    z = z - chunk.second * CHUNK_WIDTH;
-    assert(x >= 0 && x < CHUNK_WIDTH);
-    assert(z >= 0 && z < CHUNK_WIDTH);
-    m_structure_blocks[chunk].push_back({ x, y, z, block });
+void Structure::clearAll() {
+    structures_mutex.lock();
+    regions.clear();
+    resident_count = 0;
+    resident_bytes = 0;
+    update_counters();
+    structures_mutex.unlock();
 }
 
-void Structure::generateOakTree(int start_x, int start_z) {
-    mt.seed(start_x * start_z);
-    int height = tree_height(mt);
+// The blocks of one type and variant of structure, relative to its start
+// column, in the order they are placed, and the box they are in.
+struct Template {
+    struct TemplateBlock {
+        signed char x, y, z;
+        Block::BlockType block;
+    };
+    std::vector<TemplateBlock> blocks;
+    int minX = 0, maxX = 0, minZ = 0, maxZ = 0;
+
+    void addBlock(int x, int y, int z, Block::BlockType block) {
+        blocks.push_back({ (signed char) x, (signed char) y, (signed char) z, block });
+        minX = std::min(minX, x);
+        maxX = std::max(maxX, x);
+        minZ = std::min(minZ, z);
+        maxZ = std::max(maxZ, z);
+    }
+};
 
+static constexpr int NUM_STRUCTURE_TYPES = (int) StructureType::NUM_STRUCTURE_TYPES;
+
+// the heights a structure of each type can have. There is a template (a
+// variant) for each height.
+static constexpr int MIN_HEIGHT[NUM_STRUCTURE_TYPES] = { 6, 6, 20, 0 };
+static constexpr int MAX_HEIGHT[NUM_STRUCTURE_TYPES] = { 12, 12, 30, 0 };
+
+static void generateOakTree(Template& t, int height) {
     for (int i = 0; i < height; ++i) {
-        addBlock(start_x, i, start_z, Block::BlockType::OAK_LOG);
+        t.addBlock(0, i, 0, Block::BlockType::OAK_LOG);
     }
     
     Block::BlockType LEAF = Block::BlockType::OAK_LEAVES;
     for (int i = -2; i <= 2; ++i) {
         for (int j = -2; j <= 2; ++j) {
             if (i == 0 && j == 0) {
-                addBlock(start_x, height, start_z, LEAF);
+                t.addBlock(0, height, 0, LEAF);
                 continue;
             }
-            addBlock(start_x + i, height - 3, start_z + j, LEAF);
-            addBlock(start_x + i, height - 2, start_z + j, LEAF);
+            t.addBlock(i, height - 3, j, LEAF);
+            t.addBlock(i, height - 2, j, LEAF);
             if (std::abs(i) < 2 && std::abs(j) < 2) {
-                addBlock(start_x + i, height - 1, start_z + j, LEAF);
+                t.addBlock(i, height - 1, j, LEAF);
                 if (std::abs(i + j) == 1) {
-                    addBlock(start_x + i, height, start_z + j, LEAF);
+                    t.addBlock(i, height, j, LEAF);
                 }
             }
         }
     }
 }
 
-void Structure::generateJungleTree(int start_x, int start_z) {
-    mt.seed(start_x * start_z);
-    int height = tree_height(mt);
-
+static void generateJungleTree(Template& t, int height) {
     for (int i = 0; i < height; ++i) {
-        addBlock(start_x, i, start_z, Block::BlockType::JUNGLE_LOG);
+        t.addBlock(0, i, 0, Block::BlockType::JUNGLE_LOG);
     }
 
     Block::BlockType LEAF = Block::BlockType::JUNGLE_LEAVES;
     for (int i = -2; i <= 2; ++i) {
         for (int j = -2; j <= 2; ++j) {
             if (i == 0 && j == 0) {
-                addBlock(start_x, height, start_z, LEAF);
+                t.addBlock(0, height, 0, LEAF);
                 continue;
             }
-            addBlock(start_x + i, height - 3, start_z + j, LEAF);
-            addBlock(start_x + i, height - 2, start_z + j, LEAF);
+            t.addBlock(i, height - 3, j, LEAF);
+            t.addBlock(i, height - 2, j, LEAF);
             if (std::abs(i) < 2 && std::abs(j) < 2) {
-                addBlock(start_x + i, height - 1, start_z + j, LEAF);
+                t.addBlock(i, height - 1, j, LEAF);
                 if (std::abs(i + j) == 1) {
-                    addBlock(start_x + i, height, start_z + j, LEAF);
+                    t.addBlock(i, height, j, LEAF);
                 }
             }
         }
     }
 }
 
-
-void Structure::generateGiantJungleTree(int start_x, int start_z) {
-    int height = giant_tree_height(mt);
+static void generateGiantJungleTree(Template& t, int height) {
     Block::BlockType WOOD = Block::BlockType::JUNGLE_LOG;
     Block::BlockType LEAF = Block::BlockType::JUNGLE_LEAVES;
     for (int y = 0; y <= height; ++y) {
-        addBlock(start_x,     y, start_z,     WOOD);
-        addBlock(start_x + 1, y, start_z,     WOOD);
-        addBlock(start_x,     y, start_z + 1, WOOD);
-        addBlock(start_x + 1, y, start_z + 1, WOOD);
+        t.addBlock(0, y, 0, WOOD);
+        t.addBlock(1, y, 0, WOOD);
+        t.addBlock(0, y, 1, WOOD);
+        t.addBlock(1, y, 1, WOOD);
     }
     for (int i = -8; i <= 8; ++i) {
         for (int j = -8; j <= 8; ++j) {
             int dist_sq = (i * i) + (j * j);
             if (dist_sq <= 36) {
-                addBlock(start_x + i + 1, height - 1, start_z + j + 1, LEAF);
-                addBlock(start_x + i + 1, height,     start_z + j + 1, LEAF);
-                addBlock(start_x + i + 1, height + 1, start_z + j + 1, LEAF);
+                t.addBlock(i + 1, height - 1, j + 1, LEAF);
+                t.addBlock(i + 1, height,     j + 1, LEAF);
+                t.addBlock(i + 1, height + 1, j + 1, LEAF);
             }
             else if (dist_sq <= 49) {
-                addBlock(start_x + i + 1, height - 1, start_z + j + 1, LEAF);
-                addBlock(start_x + i + 1, height, start_z + j + 1, LEAF);
+                t.addBlock(i + 1, height - 1, j + 1, LEAF);
+                t.addBlock(i + 1, height, j + 1, LEAF);
             }
             else if (dist_sq <= 64) {
-                addBlock(start_x + i + 1, height - 1, start_z + j + 1, LEAF);
+                t.addBlock(i + 1, height - 1, j + 1, LEAF);
             }
         }
     }
 }
 
-void Structure::generateJungleBush(int start_x, int start_z) {
-    addBlock(start_x, 0, start_z, Block::BlockType::JUNGLE_LOG);
+static void generateJungleBush(Template& t) {
+    t.addBlock(0, 0, 0, Block::BlockType::JUNGLE_LOG);
     for (int i = -2; i <= 2; ++i) {
         for (int j = -2; j <= 2; ++j) {
             if (i == 0 && j == 0) {
-                addBlock(start_x, 1, start_z, Block::BlockType::JUNGLE_LEAVES);
+                t.addBlock(0, 1, 0, Block::BlockType::JUNGLE_LEAVES);
             }
             else if (i == -2 || j == -2 || i == 2 || j == 2) {
-                addBlock(start_x + i, 0, start_z + j, Block::BlockType::JUNGLE_LEAVES);
+                t.addBlock(i, 0, j, Block::BlockType::JUNGLE_LEAVES);
             }
             else {
-                addBlock(start_x + i, 0, start_z + j, Block::BlockType::JUNGLE_LEAVES);
-                addBlock(start_x + i, 1, start_z + j, Block::BlockType::JUNGLE_LEAVES);
+                t.addBlock(i, 0, j, Block::BlockType::JUNGLE_LEAVES);
+                t.addBlock(i, 1, j, Block::BlockType::JUNGLE_LEAVES);
+            }
+        }
+    }
+}
+
+static std::array<std::vector<Template>, NUM_STRUCTURE_TYPES> make_templates() {
+    std::array<std::vector<Template>, NUM_STRUCTURE_TYPES> templates;
+    for (int type = 0; type < NUM_STRUCTURE_TYPES; ++type) {
+        for (int height = MIN_HEIGHT[type]; height <= MAX_HEIGHT[type]; ++height) {
+            Template t;
+            switch (static_cast<StructureType>(type)) {
+                case StructureType::OAK_TREE:
+                    generateOakTree(t, height);
+                    break;
+                case StructureType::JUNGLE_TREE:
+                    generateJungleTree(t, height);
+                    break;
+                case StructureType::GIANT_JUNGLE_TREE:
+                    generateGiantJungleTree(t, height);
+                    break;
+                case StructureType::JUNGLE_BUSH:
+                    generateJungleBush(t);
+                    break;
+                default:
+                    throw "Unhandled Structure type";
             }
+            assert(t.minX >= -Structure::MAX_REACH * CHUNK_WIDTH && t.maxX < Structure::MAX_REACH * CHUNK_WIDTH);
+            assert(t.minZ >= -Structure::MAX_REACH * CHUNK_WIDTH && t.maxZ < Structure::MAX_REACH * CHUNK_WIDTH);
+            t.blocks.shrink_to_fit();
+            templates[type].push_back(std::move(t));
+        }
+    }
+    return templates;
+}
+
+static const Template& get_template(StructureType type, int variant) {
+    static const std::array<std::vector<Template>, NUM_STRUCTURE_TYPES> templates = make_templates();
+    return templates[(int) type][variant];
+}
+
+Structure::Structure(StructureType type, int start_x, int start_z, int seed) :
+m_type{ type }, m_variant{ 0 }, m_startX{ start_x }, m_startZ{ start_z } {
+    int min = MIN_HEIGHT[(int) type], max = MAX_HEIGHT[(int) type];
+    if (max > min) {
+        Random rng(seed, start_x, start_z, RandomPurpose::STRUCTURE_SHAPE);
+        m_variant = (unsigned char) (rng.range(min, max) - min);
+    }
+}
+
+bool Structure::getStructures(int cx, int cz, std::vector<Structure>& result) {
+    result.clear();
+    structures_mutex.lock_shared();
+    for (int x = cx - MAX_REACH; x <= cx + MAX_REACH; ++x) {
+        for (int z = cz - MAX_REACH; z <= cz + MAX_REACH; ++z) {
+            const std::vector<Structure>* starting = find_chunk(x, z);
+            if (starting == nullptr) {
+                structures_mutex.unlock_shared();
+                result.clear();
+                return false;
+            }
+            for (const Structure& s : *starting) {
+                if (s.touches(cx, cz)) {
+                    result.push_back(s);
+                }
+            }
+        }
+    }
+    structures_mutex.unlock_shared();
+    std::sort(result.begin(), result.end(), [](const Structure& a, const Structure& b) {
+        return a.getStart() < b.getStart();
+    });
+    return true;
+}
+
+// true if the box of the structure's template overlaps chunk (cx, cz)
+bool Structure::touches(int cx, int cz) const {
+    const Template& t = get_template(m_type, m_variant);
+    int x = cx * CHUNK_WIDTH - m_startX, z = cz * CHUNK_WIDTH - m_startZ;
+    return t.maxX >= x && t.minX < x + CHUNK_WIDTH && t.maxZ >= z && t.minZ < z + CHUNK_WIDTH;
+}
+
+StructureType Structure::getType() const {
+    return m_type;
+}
+
+std::pair<int, int> Structure::getStart() const {
+    return { m_startX, m_startZ };
+}
+
+void Structure::getBlocks(int cx, int cz, std::vector<s_block>& out) const {
+    const Template& t = get_template(m_type, m_variant);
+    // the chunk's corner, relative to the start
+    int x0 = cx * CHUNK_WIDTH - m_startX, z0 = cz * CHUNK_WIDTH - m_startZ;
+    for (const Template::TemplateBlock& b : t.blocks) {
+        int x = b.x - x0, z = b.z - z0;
+        if (x >= 0 && x < CHUNK_WIDTH && z >= 0 && z < CHUNK_WIDTH) {
+            out.push_back({ x, b.y, z, b.block });
         }
     }
 }
@@ -3,36 +3,64 @@
 
 #include "Block.h"
 
-#include <map>
 #include <vector>
 #include <tuple>
 
-enum class StructureType {
-    OAK_TREE, JUNGLE_TREE, GIANT_JUNGLE_TREE, JUNGLE_BUSH
+enum class StructureType : unsigned char {
+    OAK_TREE, JUNGLE_TREE, GIANT_JUNGLE_TREE, JUNGLE_BUSH, NUM_STRUCTURE_TYPES
 };
 
 typedef std::tuple<int, int, int, Block::BlockType> s_block;
 
+// a structure that starts in the column (x, z) (world coordinates)
+struct StructureStart {
+    StructureType type;
+    int x, z;
+};
+
+// A structure is only its type, start column and variant (the height of a
+// tree). Its blocks are in an immutable template that all structures of the
+// same type and variant share (see Structure.cpp).
+//
+// Structures are kept in an index, which any thread can use, under the
+// chunk they start in. Their placement is made for a whole region of
+// REGION_WIDTH x REGION_WIDTH chunks at once (see TerrainGen.cpp), and the
+// regions far from the player are evicted. The structures of a region only
+// depend on the seed and the noise, so evicted ones are created again the
+// same way when they are needed. getStructures() returns them sorted by
+// start column, so the terrain they are part of does not depend on which
+// thread created them or in which order.
 class Structure {
     StructureType m_type;
+    unsigned char m_variant; // which of the type's templates
     int m_startX, m_startZ;
-    std::map<std::pair<int, int>, std::vector<s_block>> m_structure_blocks;
 
 public:
-    static std::vector<Structure> getStructures(int cx, int cz);
-    static void create(StructureType type, int start_x, int start_z);
+    // A structure has blocks at most this many chunks away from its start.
+    static constexpr int MAX_REACH = 1;
+    static constexpr int REGION_WIDTH = 8; // chunks
+
+    // Replace the contents of result with the structures that have blocks in
+    // chunk (cx, cz). Returns false (and leaves result empty) if the
+    // structures of a chunk within MAX_REACH have not been created.
+    static bool getStructures(int cx, int cz, std::vector<Structure>& result);
+    // Add the structures that start in region (rx, rz) to the index. Does
+    // nothing if the region's structures are already in it.
+    static void createRegion(int rx, int rz, const std::vector<StructureStart>& starts, int seed);
+    static std::pair<int, int> getRegion(int cx, int cz);
+    static bool isCreated(int cx, int cz); // true if the structures of the chunk's region are in the index
+    // Evict every region with no chunk within radius chunks of (cx, cz).
+    static void evictFarFrom(int cx, int cz, int radius);
+    static void clearAll(); // empty the index (for benchmarks)
     StructureType getType() const;
     std::pair<int, int> getStart() const;
-    std::vector<s_block> getBlocks(int cx, int cz) const;
+    // Append the blocks of this structure that are in chunk (cx, cz) to out.
+    // x and z are relative to the chunk and y to the ground at the start.
+    void getBlocks(int cx, int cz, std::vector<s_block>& out) const;
 
 private:
-    Structure(StructureType type, int start_x, int start_z);
-    void addBlock(int x, int y, int z, Block::BlockType block);
-    void generateOakTree(int start_x, int start_z);
-    void generateJungleTree(int start_x, int start_z);
-    void generateGiantJungleTree(int start_x, int start_z);
-    void generateJungleBush(int start_x, int start_z);
-
+    Structure(StructureType type, int start_x, int start_z, int seed);
+    bool touches(int cx, int cz) const;
 };
 
 #endif
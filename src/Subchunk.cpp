@@ -1,24 +1,41 @@
 #include "Chunk.h"
 #include "Block.h"
 #include "Constants.h"
+#include "Profiler.h"
 
 #include <iostream>
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <vector>
 #include <cassert>
 
+// every face of a subchunk can be seen from every other face
+static constexpr unsigned long long ALL_VISIBLE = (1ull << (NUM_DIRECTIONS * NUM_DIRECTIONS)) - 1;
+
 Chunk::Subchunk::Subchunk(int y) : m_Y{ y } {
     m_mesh_size = -1;
+    m_visibility = ALL_VISIBLE;
+    m_visitedFrame = 0;
 }
 
 void Chunk::Subchunk::updateMesh(const Chunk* this_chunk) {
+    PROFILE_ZONE(profiler::Zone::MESH);
     m_mesh.erase();
     unsigned int lim = m_mesh_size == -1 ? 120000 : m_mesh_size + 1024;
     vertex_attrib_t* data = nullptr;
+    Block::BlockType* blocks = m_blocks.get_all();
+    updateVisibility(blocks);
     while (true) {
         try {
             data = new vertex_attrib_t[lim];
-            unsigned int size = getVertexData(this_chunk, lim * sizeof(vertex_attrib_t), data);
+            std::array<unsigned int, Mesh::NUM_RANGES> rangeCounts;
+            unsigned int size = getVertexData(this_chunk, blocks, lim * sizeof(vertex_attrib_t), data, rangeCounts);
             assert(size <= lim * sizeof(vertex_attrib_t));
             m_mesh.generate(size, data, true, this_chunk->m_X, m_Y, this_chunk->m_Z);
+            m_mesh.setRanges(rangeCounts);
             m_mesh_size = size / sizeof(vertex_attrib_t);
             delete[] data;
             break;
@@ -31,6 +48,97 @@ void Chunk::Subchunk::updateMesh(const Chunk* this_chunk) {
             delete[] data;
         }
     }
+    delete[] blocks;
+}
+
+// Flood fill each group of connected blocks that are not solid and record
+// which faces of the subchunk it touches. Any two faces touched by the same
+// group can be seen from each other. Each column of blocks along y is a bit
+// mask, so the fill goes a column at a time.
+void Chunk::Subchunk::updateVisibility(const Block::BlockType* blocks) {
+    static_assert(SUBCHUNK_HEIGHT == 32, "a column is a 32-bit mask");
+    constexpr int NUM_COLUMNS = CHUNK_WIDTH * CHUNK_WIDTH;
+    constexpr unsigned int ALL_FACES = (1u << NUM_DIRECTIONS) - 1;
+    // 1 for the blocks that can be seen through
+    static const std::array<uint32_t, (int) Block::BlockType::NUM_BLOCK_TYPES> see_through = [] {
+        std::array<uint32_t, (int) Block::BlockType::NUM_BLOCK_TYPES> see_through = {};
+        for (int type = 0; type < (int) Block::BlockType::NUM_BLOCK_TYPES; ++type) {
+            Block::BlockType block = static_cast<Block::BlockType>(type);
+            see_through[type] = !Block::isReal(block) || !Block::isSolid(block);
+        }
+        return see_through;
+    }();
+
+    // the blocks of each column (x * CHUNK_WIDTH + z) that are not solid and
+    // not filled yet, bit y for block y
+    std::array<uint32_t, NUM_COLUMNS> open;
+    int num_open = 0;
+    for (int column = 0; column < NUM_COLUMNS; ++column) {
+        const Block::BlockType* b = blocks + column * SUBCHUNK_HEIGHT;
+        uint32_t mask = 0;
+        for (int y = SUBCHUNK_HEIGHT - 1; y >= 0; --y) {
+            mask = (mask << 1) | see_through[(int) b[y]];
+        }
+        open[column] = mask;
+        num_open += std::popcount(mask);
+    }
+    if (num_open == 0 || num_open == BLOCKS_PER_SUBCHUNK) {
+        m_visibility = num_open == 0 ? 0 : ALL_VISIBLE;
+        return;
+    }
+
+    // reused by every call so that it does not allocate: columns and the
+    // blocks in them to fill from
+    thread_local std::vector<std::pair<int, uint32_t>> stack;
+    m_visibility = 0;
+    for (int start = 0; start < NUM_COLUMNS; ++start) {
+        while (open[start] != 0) {
+            unsigned int faces = 0;
+            stack.push_back({ start, open[start] & (~open[start] + 1) });
+            while (!stack.empty()) {
+                auto [column, seeds] = stack.back();
+                stack.pop_back();
+                uint32_t filled = seeds & open[column];
+                if (filled == 0) {
+                    continue;
+                }
+                // grow the seeds into the runs of open blocks they are in
+                while (true) {
+                    uint32_t grown = (filled | (filled << 1) | (filled >> 1)) & open[column];
+                    if (grown == filled)
+                        break;
+                    filled = grown;
+                }
+                open[column] &= ~filled;
+                faces |= (filled & 1u) << MINUS_Y;
+                faces |= (filled >> (SUBCHUNK_HEIGHT - 1)) << PLUS_Y;
+
+                // the face of the subchunk in each direction, or the column next to this one
+                int x = column / CHUNK_WIDTH, z = column % CHUNK_WIDTH;
+                auto next = [&](bool onFace, Direction face, int neighbor) {
+                    if (onFace) {
+                        faces |= 1u << face;
+                    } else if (filled & open[neighbor]) {
+                        stack.push_back({ neighbor, filled });
+                    }
+                };
+                next(x == CHUNK_WIDTH - 1, PLUS_X, column + CHUNK_WIDTH);
+                next(x == 0, MINUS_X, column - CHUNK_WIDTH);
+                next(z == CHUNK_WIDTH - 1, PLUS_Z, column + 1);
+                next(z == 0, MINUS_Z, column - 1);
+            }
+            if (faces == ALL_FACES) {
+                // every face can be seen from every other
+                m_visibility = ALL_VISIBLE;
+                return;
+            }
+            for (int face = 0; face < NUM_DIRECTIONS; ++face) {
+                if (faces & (1u << face)) {
+                    m_visibility |= (unsigned long long) faces << (face * NUM_DIRECTIONS);
+                }
+            }
+        }
+    }
 }
 
 static inline bool inbounds(int x, int y, int z) {
@@ -38,12 +146,22 @@ static inline bool inbounds(int x, int y, int z) {
         y < SUBCHUNK_HEIGHT - 1 && z < CHUNK_WIDTH - 1;
 }
 
-unsigned int Chunk::Subchunk::getVertexData(const Chunk* this_chunk, int byte_lim,
-                                            vertex_attrib_t* data) const {
+// blocks: every block of this subchunk (from BlockList::get_all())
+// The faces are sorted into the ranges of Mesh::NUM_RANGES, and the number of
+// vertices in each range is written to rangeCounts.
+unsigned int Chunk::Subchunk::getVertexData(const Chunk* this_chunk, const Block::BlockType* blocks,
+                                            int byte_lim, vertex_attrib_t* data,
+                                            std::array<unsigned int, Mesh::NUM_RANGES>& rangeCounts) const {
     assert(this_chunk->m_status >= Status::TERRAIN);
     vertex_attrib_t* start = data; // record the current byte address
-    Block::BlockType* blocks = m_blocks.get_all();
     int y_offs = m_Y * SUBCHUNK_HEIGHT;
+    // reused by every call so that it does not allocate: the direction of
+    // each face in data, and the faces sorted by range
+    thread_local std::vector<Direction> face_dirs;
+    thread_local std::vector<vertex_attrib_t> sorted;
+    // the check below stops at most one block (6 faces) past byte_lim
+    face_dirs.resize(byte_lim / (ATTRIBS_PER_FACE * sizeof(vertex_attrib_t)) + 6);
+    Direction* dirs = face_dirs.data();
 
     for (int x = 0; x < CHUNK_WIDTH; ++x) {
         for (int z = 0; z < CHUNK_WIDTH; ++z) {
@@ -67,7 +185,9 @@ unsigned int Chunk::Subchunk::getVertexData(const Chunk* this_chunk, int byte_li
                         blocks[index + 1],
                         blocks[index - 1],
                     };
-                    data += Block::getBlockData(block, x, y, z, data, surrounding);
+                    int size = Block::getBlockData(block, x, y, z, data, surrounding, dirs);
+                    data += size;
+                    dirs += size / ATTRIBS_PER_FACE;
                 }
                 else {
                     std::array<Block::BlockType, NUM_DIRECTIONS> surrounding = {
@@ -78,7 +198,9 @@ unsigned int Chunk::Subchunk::getVertexData(const Chunk* this_chunk, int byte_li
                         this_chunk->get(x,     y + y_offs + 1, z    ),
                         this_chunk->get(x,     y + y_offs - 1, z    ),
                     };
-                    data += Block::getBlockData(block, x, y, z, data, surrounding);
+                    int size = Block::getBlockData(block, x, y, z, data, surrounding, dirs);
+                    data += size;
+                    dirs += size / ATTRIBS_PER_FACE;
                 }
                 // if we are almost about to go over the byte limit, don't risk it 
                 if ((int) ((data - start) * sizeof(vertex_attrib_t)) > byte_lim - 512) {
@@ -88,7 +210,27 @@ unsigned int Chunk::Subchunk::getVertexData(const Chunk* this_chunk, int byte_li
             }
         }
     }
-    delete[] blocks;
+
+    // sort the faces by range, keeping their order within each range
+    int num_faces = (int) (dirs - face_dirs.data());
+    rangeCounts.fill(0);
+    for (int face = 0; face < num_faces; ++face) {
+        rangeCounts[std::min((int) face_dirs[face], (int) NUM_DIRECTIONS)] += VERTICES_PER_FACE;
+    }
+    std::array<unsigned int, Mesh::NUM_RANGES> next;
+    unsigned int offset = 0;
+    for (int range = 0; range < Mesh::NUM_RANGES; ++range) {
+        next[range] = offset;
+        offset += rangeCounts[range] * ATTRIBS_PER_VERTEX;
+    }
+    sorted.resize(num_faces * ATTRIBS_PER_FACE);
+    for (int face = 0; face < num_faces; ++face) {
+        unsigned int& to = next[std::min((int) face_dirs[face], (int) NUM_DIRECTIONS)];
+        std::memcpy(&sorted[to], start + face * ATTRIBS_PER_FACE, ATTRIBS_PER_FACE * sizeof(vertex_attrib_t));
+        to += ATTRIBS_PER_FACE;
+    }
+    std::memcpy(start, sorted.data(), sorted.size() * sizeof(vertex_attrib_t));
+
     // return the number of bytes that were initialized
     return (unsigned int) ((data - start) * sizeof(vertex_attrib_t));
 }
@@ -1,46 +1,40 @@
 #include "Chunk.h"
 #include "Block.h"
 #include "Structure.h"
+#include "TerrainGen.h"
+#include "Profiler.h"
+#include "Random.h"
 #include <FastNoiseLite/FastNoiseLite.h>
 
-#include <random>
+#include <memory>
+#include <algorithm>
 #include <vector>
 #include <tuple>
 #include <cmath>
 #include <cassert>
 #include <iostream>
 
-enum class Biome {
-    DESERT, JUNGLE, FOREST, PLAINS, TUNDRA,
-};
-
+// Only written by initNoise(). GetNoise() is const, so after that any number
+// of threads can generate chunks at once.
 static FastNoiseLite terrain_height; // simplex noise that determines the ground height
 static FastNoiseLite biome; // cellular noise that determines the biome
 static FastNoiseLite noise3d; // simplex 3d noise used for cave generation
+static int world_seed; // of the noise and the structures
 
-// mt is the engine which generates the random numbers
-static std::mt19937 mt;
-
-static std::uniform_int_distribution<std::mt19937::result_type> forest_noise(1, 300);
-static std::uniform_int_distribution<std::mt19937::result_type> plains_noise(1, 1500);
-static std::uniform_int_distribution<std::mt19937::result_type> desert_noise(1, 80);
-static std::uniform_int_distribution<std::mt19937::result_type> jungle_noise(1, 600);
-
-constexpr int WATER_HEIGHT = 35;
-
-void Chunk::initNoise() {
-    noise3d.SetSeed(1337);
+void Chunk::initNoise(int seed) {
+    world_seed = seed;
+    noise3d.SetSeed(seed);
     noise3d.SetNoiseType(FastNoiseLite::NoiseType_OpenSimplex2);
     noise3d.SetFractalType(FastNoiseLite::FractalType_FBm);
     noise3d.SetFrequency(0.008f);
 
-    terrain_height.SetSeed(1337);
+    terrain_height.SetSeed(seed);
     terrain_height.SetFractalOctaves(5);
     terrain_height.SetNoiseType(FastNoiseLite::NoiseType_OpenSimplex2);
     terrain_height.SetFractalType(FastNoiseLite::FractalType_FBm);
     terrain_height.SetFrequency(0.003f);
 
-    biome.SetSeed(1337);
+    biome.SetSeed(seed);
     biome.SetFrequency(0.007f);
     biome.SetNoiseType(FastNoiseLite::NoiseType_Cellular);
     biome.SetCellularDistanceFunction(FastNoiseLite::CellularDistanceFunction_Hybrid);
@@ -50,7 +44,7 @@ void Chunk::initNoise() {
     biome.SetFractalType(FastNoiseLite::FractalType_DomainWarpIndependent);
 }
 
-double map(double x, double in_min, double in_max, double out_min, double out_max) {
+static double map(double x, double in_min, double in_max, double out_min, double out_max) {
     return (x - in_min) * (out_max - out_min) / (in_max - in_min) + out_min;
 }
 
@@ -73,35 +67,247 @@ Biome getBiome(int x, int z) {
         return Biome::TUNDRA;
 }
 
+// Caves are where the cave noise is within CAVE_THRESHOLD of 0. They stay
+// CAVE_ROOF blocks below the surface and above the bottom of the world.
+static constexpr float CAVE_THRESHOLD = 0.05f;
+static constexpr int CAVE_ROOF = 6;
+static constexpr int CAVE_FLOOR = 5;
+
+// The column of lattice point (i, j) of a chunk, from the neighbor's field
+// that has the same column, or nullptr if there is none. Sets layers to the
+// number of layers the neighbor sampled.
+static const float* shared_cave_column(const std::array<const NoiseField*, 4>& neighbors,
+                                       int i, int j, int& layers) {
+    constexpr int LAST = CAVE_LATTICE_WIDTH - 1;
+    const NoiseField* n;
+    if (i == 0 && (n = neighbors[MINUS_X]) != nullptr) {
+        layers = n->caveLayers;
+        return n->cave[LAST][j];
+    }
+    if (i == LAST && (n = neighbors[PLUS_X]) != nullptr) {
+        layers = n->caveLayers;
+        return n->cave[0][j];
+    }
+    if (j == 0 && (n = neighbors[MINUS_Z]) != nullptr) {
+        layers = n->caveLayers;
+        return n->cave[i][LAST];
+    }
+    if (j == LAST && (n = neighbors[PLUS_Z]) != nullptr) {
+        layers = n->caveLayers;
+        return n->cave[i][0];
+    }
+    return nullptr;
+}
+
+// Evaluate each noise for the whole chunk in its own pass, so that each
+// pass only touches one noise's code and state.
+void fillNoiseField(int cx, int cz, NoiseField& field, const std::array<const NoiseField*, 4>& neighbors) {
+    for (int x = 0; x < CHUNK_WIDTH; ++x) {
+        for (int z = 0; z < CHUNK_WIDTH; ++z) {
+            int height = getHeight(cx * CHUNK_WIDTH + x, cz * CHUNK_WIDTH + z);
+            assert(height >= 0 && height < CHUNK_HEIGHT);
+            field.height[x * CHUNK_WIDTH + z] = (unsigned char) height;
+        }
+    }
+    for (int x = 0; x < CHUNK_WIDTH; ++x) {
+        for (int z = 0; z < CHUNK_WIDTH; ++z) {
+            field.biome[x * CHUNK_WIDTH + z] = getBiome(cx * CHUNK_WIDTH + x, cz * CHUNK_WIDTH + z);
+        }
+    }
+
+    // the highest block that can be part of a cave and the lattice layer above it
+    int top = *std::max_element(field.height, field.height + CHUNK_WIDTH * CHUNK_WIDTH) - CAVE_ROOF;
+    field.caveLayers = top < CAVE_FLOOR ? 0 : std::min(top / CAVE_STEP + 2, CAVE_LATTICE_HEIGHT);
+    for (int i = 0; i < CAVE_LATTICE_WIDTH; ++i) {
+        for (int j = 0; j < CAVE_LATTICE_WIDTH; ++j) {
+            float* column = field.cave[i][j];
+            int copied = 0;
+            const float* shared = shared_cave_column(neighbors, i, j, copied);
+            copied = shared == nullptr ? 0 : std::min(copied, field.caveLayers);
+            std::copy(shared, shared + copied, column);
+            double x = cx * CHUNK_WIDTH + i * CAVE_STEP, z = cz * CHUNK_WIDTH + j * CAVE_STEP;
+            for (int l = copied; l < field.caveLayers; ++l) {
+                column[l] = noise3d.GetNoise(x, (double) (l * CAVE_STEP), z);
+            }
+        }
+    }
+}
+
+// getHeight() of the column (x, z) in world coordinates, from the noise
+// field of chunk (cx, cz) if the column is in that chunk
+static int height_at(const NoiseField& noise, int cx, int cz, int x, int z) {
+    x -= cx * CHUNK_WIDTH;
+    z -= cz * CHUNK_WIDTH;
+    if (x >= 0 && x < CHUNK_WIDTH && z >= 0 && z < CHUNK_WIDTH) {
+        return noise.getHeight(x, z);
+    }
+    return getHeight(x + cx * CHUNK_WIDTH, z + cz * CHUNK_WIDTH);
+}
+
+// Structures are placed on a jittered grid. Each CELL_WIDTH x CELL_WIDTH
+// cell of columns has one candidate column, at a random offset that keeps
+// the candidates of neighboring cells at least 2 columns apart, and only
+// the candidates' noise is evaluated. The chance that a candidate gets a
+// structure gives about the same number of trees per chunk as rolling for
+// every column did. Jungle cells have a second candidate that can only be a
+// bush, because rolling for every column gave them about 1.5 bushes.
+static constexpr int CELL_WIDTH = 4;
+static constexpr int CELLS_PER_REGION = Structure::REGION_WIDTH * CHUNK_WIDTH / CELL_WIDTH;
+
+// Add the structures of the region that chunk (cx, cz) is in to the
+// structure index, if they are not already in it
+static void create_structures(int cx, int cz) {
+    if (Structure::isCreated(cx, cz)) {
+        return;
+    }
+    static thread_local std::vector<StructureStart> starts;
+    starts.clear();
+    auto [rx, rz] = Structure::getRegion(cx, cz);
+    for (int i = 0; i < CELLS_PER_REGION; ++i) {
+        for (int j = 0; j < CELLS_PER_REGION; ++j) {
+            int cell_x = (rx * CELLS_PER_REGION + i) * CELL_WIDTH;
+            int cell_z = (rz * CELLS_PER_REGION + j) * CELL_WIDTH;
+            Random rng(world_seed, cell_x, cell_z, RandomPurpose::STRUCTURE);
+            int X = cell_x + rng.range(0, CELL_WIDTH - 2);
+            int Z = cell_z + rng.range(0, CELL_WIDTH - 2);
+            // the height noise costs the most, so it is only evaluated for
+            // candidates that would get a structure
+            Biome b = getBiome(X, Z);
+            StructureType type;
+            if (b == Biome::JUNGLE) {
+                int val = rng.range(1, 75);
+                if (val <= 2)
+                    type = StructureType::GIANT_JUNGLE_TREE;
+                else if (val <= 14)
+                    type = StructureType::JUNGLE_TREE;
+                else
+                    type = StructureType::JUNGLE_BUSH;
+            }
+            else if (b == Biome::FOREST && rng.range(1, 15) <= 8) {
+                type = StructureType::OAK_TREE;
+            }
+            else if (b == Biome::PLAINS && rng.range(1, 375) <= 4) {
+                type = StructureType::OAK_TREE;
+            }
+            else {
+                continue;
+            }
+            if (getHeight(X, Z) > WATER_HEIGHT) {
+                starts.push_back({ type, X, Z });
+            }
+            if (b == Biome::JUNGLE) {
+                // any other column of the cell. 61/75 + 51/75 bushes per
+                // cell is the 56/600 per column of rolling for every column.
+                int column = rng.range(0, CELL_WIDTH * CELL_WIDTH - 2);
+                column += column >= (X - cell_x) * CELL_WIDTH + (Z - cell_z);
+                int bush_x = cell_x + column / CELL_WIDTH;
+                int bush_z = cell_z + column % CELL_WIDTH;
+                if (rng.range(1, 75) <= 51 && getBiome(bush_x, bush_z) == Biome::JUNGLE &&
+                    getHeight(bush_x, bush_z) > WATER_HEIGHT) {
+                    starts.push_back({ StructureType::JUNGLE_BUSH, bush_x, bush_z });
+                }
+            }
+        }
+    }
+    Structure::createRegion(rx, rz, starts, world_seed);
+}
+
+// The noise field made by setLoading(), or a new one if it has not been
+// called for this chunk.
+std::shared_ptr<const NoiseField> Chunk::getNoiseField() const {
+    if (m_noise != nullptr) {
+        return m_noise;
+    }
+    std::shared_ptr<NoiseField> noise = std::make_shared<NoiseField>();
+    fillNoiseField(m_X, m_Z, *noise);
+    return noise;
+}
+
+// Replace the blocks of column (x, z) that are part of a cave with air. The
+// cave noise of the chunk's lattice is interpolated (trilinearly) at every
+// block that can be part of a cave.
+static void carve_caves(const NoiseField& noise, int x, int z, int height, Block::BlockType* column) {
+    int top = height - CAVE_ROOF;
+    if (top < CAVE_FLOOR) {
+        return;
+    }
+    // first between the 4 lattice columns around this one, for each layer
+    int i = x / CAVE_STEP, j = z / CAVE_STEP;
+    float fx = (float) (x % CAVE_STEP) / CAVE_STEP, fz = (float) (z % CAVE_STEP) / CAVE_STEP;
+    const float* c00 = noise.cave[i][j];
+    const float* c10 = noise.cave[i + 1][j];
+    const float* c01 = noise.cave[i][j + 1];
+    const float* c11 = noise.cave[i + 1][j + 1];
+    int layers = top / CAVE_STEP + 2;
+    assert(layers <= noise.caveLayers);
+    float values[CAVE_LATTICE_HEIGHT];
+    for (int l = 0; l < layers; ++l) {
+        float a = c00[l] + (c10[l] - c00[l]) * fx;
+        float b = c01[l] + (c11[l] - c01[l]) * fx;
+        values[l] = a + (b - a) * fz;
+    }
+    // then between the layers. The interpolated value lies between the values
+    // of the two layers, so a layer gap with both of them on the same side of
+    // the threshold has no cave blocks and is skipped.
+    for (int l = CAVE_FLOOR / CAVE_STEP; l * CAVE_STEP <= top; ++l) {
+        float low = values[l], high = values[l + 1];
+        if ((low > CAVE_THRESHOLD && high > CAVE_THRESHOLD) ||
+            (low < -CAVE_THRESHOLD && high < -CAVE_THRESHOLD)) {
+            continue;
+        }
+        float step = (high - low) / CAVE_STEP;
+        int first = std::max(l * CAVE_STEP, CAVE_FLOOR);
+        int last = std::min(l * CAVE_STEP + CAVE_STEP - 1, top);
+        for (int y = first; y <= last; ++y) {
+            float value = low + step * (y - l * CAVE_STEP);
+            if (std::abs(value) <= CAVE_THRESHOLD) {
+                column[y] = Block::BlockType::AIR;
+            }
+        }
+    }
+}
+
+// reused by generateTerrain() so that it does not allocate
+static thread_local std::vector<Structure> structures;
+static thread_local std::vector<s_block> structure_blocks;
+
 // fill data (a 1D array of BLOCKS_PER_CHUNK blocks) with
 // the type of each block in the chunk
 void Chunk::generateTerrain(Block::BlockType* data, int seed) const {
-    mt.seed(seed ^ (m_X + 100000) ^ (m_Z + 100000));
+    generateTerrain(m_X, m_Z, *getNoiseField(), data, seed);
+}
+
+// the same for the chunk at (cx, cz), which does not have to exist
+void Chunk::generateTerrain(int cx, int cz, const NoiseField& noise, Block::BlockType* data, int seed) {
+    PROFILE_ZONE(profiler::Zone::TERRAIN_GEN);
 
     std::fill(data, data + BLOCKS_PER_CHUNK, Block::BlockType::AIR);
 
     for (int x = 0; x < CHUNK_WIDTH; ++x) {
         for (int z = 0; z < CHUNK_WIDTH; ++z) {
-            int nx = x + CHUNK_WIDTH * m_X;
-            int nz = z + CHUNK_WIDTH * m_Z;
-            int height = getHeight(nx, nz);
-            for (int y = 0; y <= height; ++y) {
-                // double a = y < height - 5 ? 0.05 : 0.00;
-                // if (abs(noise3d.GetNoise((double) nx, (double) y, (double) nz)) > a) {
-                data[Chunk::chunk_index(x, y, z)] = Block::BlockType::STONE;
-            // }
+            int height = noise.getHeight(x, z);
+            // the column is made contiguously and then copied into data,
+            // where its blocks are contiguous within each subchunk
+            Block::BlockType column[CHUNK_HEIGHT];
+            int top = std::max(height, WATER_HEIGHT);
+            std::fill(column, column + height + 1, Block::BlockType::STONE);
+            carve_caves(noise, x, z, height, column);
+            if (height <= WATER_HEIGHT) {
+                std::fill(column + height, column + WATER_HEIGHT + 1, Block::BlockType::WATER);
+            }
+            for (int y = 0; y <= top; y += SUBCHUNK_HEIGHT) {
+                int count = std::min(SUBCHUNK_HEIGHT, top + 1 - y);
+                std::copy(column + y, column + y + count, data + Chunk::chunk_index(x, y, z));
             }
             if (height <= WATER_HEIGHT) {
-                for (int y = height; y <= WATER_HEIGHT; ++y) {
-                    data[Chunk::chunk_index(x, y, z)] = Block::BlockType::WATER;
-                }
                 continue;
             }
             data[Chunk::chunk_index(x, height - 3, z)] = Block::BlockType::DIRT;
             data[Chunk::chunk_index(x, height - 2, z)] = Block::BlockType::DIRT;
             data[Chunk::chunk_index(x, height - 1, z)] = Block::BlockType::DIRT;
             data[Chunk::chunk_index(x, height, z)] = Block::BlockType::GRASS;
-            Biome b = getBiome(nx, nz);
+            Biome b = noise.getBiome(x, z);
+            Random rng(seed, cx * CHUNK_WIDTH + x, cz * CHUNK_WIDTH + z, RandomPurpose::DECORATION);
             int val;
             switch (b) {
                 case Biome::DESERT:
@@ -109,7 +315,7 @@ void Chunk::generateTerrain(Block::BlockType* data, int seed) const {
                     data[Chunk::chunk_index(x, height - 2, z)] = Block::BlockType::SAND;
                     data[Chunk::chunk_index(x, height - 1, z)] = Block::BlockType::SAND;
                     data[Chunk::chunk_index(x, height, z)] = Block::BlockType::SAND;
-                    val = desert_noise(mt);
+                    val = rng.range(1, 80);
                     if (val == 1) {
                         data[Chunk::chunk_index(x, height + 1, z)] = Block::BlockType::CACTUS;
                         data[Chunk::chunk_index(x, height + 2, z)] = Block::BlockType::CACTUS;
@@ -120,7 +326,7 @@ void Chunk::generateTerrain(Block::BlockType* data, int seed) const {
                     }
                     break;
                 case Biome::FOREST:
-                    val = forest_noise(mt);
+                    val = rng.range(1, 300);
                     if (val < 50)
                         data[Chunk::chunk_index(x, height + 1, z)] = Block::BlockType::GRASS_PLANT;
                     else if (val < 51)
@@ -131,7 +337,7 @@ void Chunk::generateTerrain(Block::BlockType* data, int seed) const {
                         data[Chunk::chunk_index(x, height + 1, z)] = Block::BlockType::RED_FLOWER;
                     break;
                 case Biome::PLAINS:
-                    val = plains_noise(mt);
+                    val = rng.range(1, 1500);
                     if (val < 300)
                         data[Chunk::chunk_index(x, height + 1, z)] = Block::BlockType::GRASS_PLANT;
                     else if (val < 350)
@@ -150,17 +356,24 @@ void Chunk::generateTerrain(Block::BlockType* data, int seed) const {
             }
         }
     }
-    std::vector<Structure> structures = Structure::getStructures(m_X, m_Z);
+    // The structures of the chunks around this one were evicted if the
+    // player was far away, or never created if they are not in the World.
+    while (!Structure::getStructures(cx, cz, structures)) {
+        for (int x = cx - Structure::MAX_REACH; x <= cx + Structure::MAX_REACH; ++x) {
+            for (int z = cz - Structure::MAX_REACH; z <= cz + Structure::MAX_REACH; ++z) {
+                create_structures(x, z);
+            }
+        }
+    }
     for (const Structure& s : structures) {
-        std::vector<s_block> structure_blocks = s.getBlocks(m_X, m_Z);
+        structure_blocks.clear();
+        s.getBlocks(cx, cz, structure_blocks);
         std::pair<int, int> start = s.getStart();
-        int height = getHeight(start.first, start.second);
+        int height = height_at(noise, cx, cz, start.first, start.second);
         for (const s_block& sb : structure_blocks) {
             const auto& [x, y, z, block] = sb;
             if (s.getType() == StructureType::JUNGLE_BUSH) {
-                int X = m_X * CHUNK_WIDTH + x;
-                int Z = m_Z * CHUNK_WIDTH + z;
-                height = getHeight(X, Z);
+                height = noise.getHeight(x, z);
             }
             data[Chunk::chunk_index(x, y + height, z)] = block;
         }
@@ -168,36 +381,7 @@ void Chunk::generateTerrain(Block::BlockType* data, int seed) const {
 }
 
 void Chunk::generateStructures() {
-    mt.seed(1337 ^ (m_X + 100000) ^ (m_Z + 100000));
-    for (int x = 0; x < CHUNK_WIDTH; ++x) {
-        for (int z = 0; z < CHUNK_WIDTH; ++z) {
-            int X = m_X * CHUNK_WIDTH + x;
-            int Z = m_Z * CHUNK_WIDTH + z;
-            Biome b = getBiome(X, Z);
-            int height = getHeight(X, Z);
-            if (height <= WATER_HEIGHT)
-                continue;
-            if (b == Biome::JUNGLE) {
-                int val = jungle_noise(mt);
-                if (val < 2) {
-                    Structure::create(StructureType::GIANT_JUNGLE_TREE, X, Z);
-                } else  if (val < 8) {
-                    Structure::create(StructureType::JUNGLE_TREE, X, Z);
-                } else if (val < 64) {
-                    Structure::create(StructureType::JUNGLE_BUSH, X, Z);
-                }
-            }
-            else if (b == Biome::FOREST) {
-                if (forest_noise(mt) <= 10) {
-                    Structure::create(StructureType::OAK_TREE, X, Z);
-                }
-            }
-            else if (b == Biome::PLAINS) {
-                if (plains_noise(mt) == 1) {
-                    Structure::create(StructureType::OAK_TREE, X, Z);
-                }
-            }
-        }
-    }
+    PROFILE_ZONE(profiler::Zone::STRUCTURE_GEN);
+    create_structures(m_X, m_Z);
     m_status = Status::STRUCTURES;
 }
@@ -0,0 +1,55 @@
+#ifndef TERRAIN_GEN_H_INCLUDED
+#define TERRAIN_GEN_H_INCLUDED
+
+#include "Constants.h"
+#include <array>
+
+// Noise functions used by Chunk::generateTerrain() and
+// Chunk::generateStructures(). Implementation in TerrainGen.cpp.
+// Chunk::initNoise() must be called before any of these are used. After that
+// they can be called from any number of threads at once.
+
+enum class Biome : unsigned char {
+    DESERT, JUNGLE, FOREST, PLAINS, TUNDRA, NUM_BIOMES
+};
+
+inline constexpr int WATER_HEIGHT = 35;
+
+// Saved in every delta (see Serialize.cpp). Bump it whenever
+// Chunk::generateTerrain() or the structures can produce different blocks
+// for the same seed, so that old deltas are not applied to new terrain.
+inline constexpr int GENERATOR_VERSION = 4;
+
+// The cave noise is sampled at every CAVE_STEP-th block in each direction
+// and interpolated in between.
+inline constexpr int CAVE_STEP = 4;
+inline constexpr int CAVE_LATTICE_WIDTH = CHUNK_WIDTH / CAVE_STEP + 1;
+inline constexpr int CAVE_LATTICE_HEIGHT = CHUNK_HEIGHT / CAVE_STEP + 1;
+
+int getHeight(int x, int z);
+Biome getBiome(int x, int z);
+
+// getHeight() and getBiome() of every column of one chunk, and the cave
+// noise at the chunk's lattice points. Terrain generation, decoration and
+// delta saves all need them, so a chunk evaluates the noise once in
+// setLoading() and keeps the result.
+struct NoiseField {
+    unsigned char height[CHUNK_WIDTH * CHUNK_WIDTH];
+    Biome biome[CHUNK_WIDTH * CHUNK_WIDTH];
+    // [x][z][y] in lattice coordinates. Only the lowest caveLayers layers are
+    // sampled, which is enough for every block that can be part of a cave.
+    float cave[CAVE_LATTICE_WIDTH][CAVE_LATTICE_WIDTH][CAVE_LATTICE_HEIGHT];
+    int caveLayers;
+
+    // x and z are relative to the chunk
+    int getHeight(int x, int z) const { return height[x * CHUNK_WIDTH + z]; }
+    Biome getBiome(int x, int z) const { return biome[x * CHUNK_WIDTH + z]; }
+};
+
+// neighbors are the fields of the chunks next to chunk (cx, cz), indexed by
+// PLUS_X, MINUS_X, PLUS_Z and MINUS_Z, or nullptr. The lattice points on a
+// shared side are copied from the neighbor instead of sampled again.
+void fillNoiseField(int cx, int cz, NoiseField& field,
+                    const std::array<const NoiseField*, 4>& neighbors = {});
+
+#endif
@@ -1,6 +1,8 @@
 #include "Constants.h"
 #include "Shader.h"
 #include "Player.h"
+#include "World.h"
+#include "Profiler.h"
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
 #include <imgui/imgui.h>
@@ -8,6 +10,7 @@
 #include <imgui/imgui_impl_opengl3.h>
 #include <cassert>
 #include <iostream>
+#include <cstdio>
 
 void initialize_HUD();
 void resize_HUD(int width, int height);
@@ -63,6 +66,50 @@ void render_HUD(Shader* shader) {
     glDrawArrays(GL_TRIANGLES, 0, 6);
 }
 
+// draw a histogram of the last profiler::HISTORY_SIZE frames
+static void plot_history(const char* label, const profiler::History& history, const char* unit) {
+    float max = 0.0f;
+    for (float value : history.values) {
+        max = value > max ? value : max;
+    }
+    int latest = (history.offset + profiler::HISTORY_SIZE - 1) % profiler::HISTORY_SIZE;
+    char overlay[64];
+    std::snprintf(overlay, sizeof(overlay), "%.2f %s (max %.2f)", history.values[latest], unit, max);
+    ImGui::PlotHistogram(label, history.values, profiler::HISTORY_SIZE, history.offset,
+                         overlay, 0.0f, max > 0.0f ? max : 1.0f, ImVec2(0, 40));
+}
+
+static void render_profiler() {
+    plot_history("frame", profiler::frame_history(), "ms");
+    for (int z = 0; z < profiler::NUM_ZONES; ++z) {
+        profiler::Zone zone = static_cast<profiler::Zone>(z);
+        plot_history(profiler::name(zone), profiler::zone_history(zone), "ms");
+        profiler::ZoneTotals totals = profiler::totals(zone);
+        ImGui::Text("    %lld calls, avg %.3f ms, max %.3f ms", totals.count,
+                    totals.count > 0 ? totals.total_ms / totals.count : 0.0, totals.max_ms);
+    }
+    plot_history("GL upload", profiler::counter_history(profiler::Counter::GL_UPLOAD_BYTES), "bytes");
+    plot_history("vertices drawn", profiler::counter_history(profiler::Counter::VERTICES_DRAWN), "vertices");
+    plot_history("vertices culled", profiler::counter_history(profiler::Counter::VERTICES_CULLED), "vertices");
+    plot_history("db requests", profiler::counter_history(profiler::Counter::DB_REQUEST_QUEUE), "queued");
+    plot_history("db results", profiler::counter_history(profiler::Counter::DB_RESULT_QUEUE), "queued");
+    ImGui::Text("Prefetched loads: %lld", profiler::get(profiler::Counter::DB_PREFETCH_HITS));
+    ImGui::Text("Cancelled loads: %lld (%lld read before they were cancelled)",
+                profiler::get(profiler::Counter::LOADS_CANCELLED),
+                profiler::get(profiler::Counter::LOADS_STALE));
+    ImGui::Text("Chunks: %lld empty, %lld structures, %lld loading, %lld terrain, %lld full",
+                profiler::get(profiler::Counter::CHUNKS_EMPTY),
+                profiler::get(profiler::Counter::CHUNKS_STRUCTURES),
+                profiler::get(profiler::Counter::CHUNKS_LOADING),
+                profiler::get(profiler::Counter::CHUNKS_TERRAIN),
+                profiler::get(profiler::Counter::CHUNKS_FULL));
+    ImGui::Text("Structures: %lld (%.1f KB)", profiler::get(profiler::Counter::STRUCTURES),
+                profiler::get(profiler::Counter::STRUCTURE_BYTES) / 1024.0);
+    ImGui::Text("LOD tiles: %lld (%.1f MB)", profiler::get(profiler::Counter::LOD_TILES),
+                profiler::get(profiler::Counter::LOD_BYTES) / (1024.0 * 1024.0));
+    ImGui::Text("Press F4 to save a trace to %s", TRACE_FILE);
+}
+
 void render_imgui_window(ImGuiIO& io, const Player& player) {
     static bool show_demo_window = false;
     static ImVec4 color = ImVec4(0.2f, 0.3f, 0.8f, 1.0f);
@@ -106,11 +153,24 @@ void render_imgui_window(ImGuiIO& io, const Player& player) {
     auto [rendered, total] = player.chunks_rendered;
     ImGui::Text("SubChunks rendered: %d, total: %d (%.2f%%)",
                 rendered, total, (float) rendered / total * 100.0f);
+    ImGui::Text("SubChunks occluded: %d", player.chunks_occluded);
+    // occlusion queries
+    bool queries = World::getOcclusionQueries();
+    if (ImGui::Checkbox("Occlusion queries", &queries)) {
+        World::setOcclusionQueries(queries);
+    }
+    int drawn = rendered + player.chunks_hidden;
+    ImGui::Text("SubChunks hidden by queries: %d (%.2f%% skipped)", player.chunks_hidden,
+                drawn > 0 ? (float) player.chunks_hidden / drawn * 100.0f : 0.0f);
     // fov
     ImGui::Text("FOV: %.2f", player.getFOV());
     // display fps
     ImGui::Text("Application average %.3f ms/frame (%.1f FPS)",
                 1000.0f / io.Framerate, io.Framerate);
+    // per-stage timings and counters
+    if (ImGui::CollapsingHeader("Profiler")) {
+        render_profiler();
+    }
     ImGui::Checkbox("Demo Window", &show_demo_window);
 
     ImGui::End();
@@ -6,6 +6,8 @@
 #include "Face.h"
 #include "Block.h"
 #include "Database.h"
+#include "Profiler.h"
+#include "Structure.h"
 
 #include <new>
 #include <map>
@@ -15,6 +17,8 @@
 #include <chrono>
 #include <set>
 #include <vector>
+#include <array>
+#include <algorithm>
 
 #ifdef NDEBUG
 #define SGLM_NO_PRINT
@@ -22,8 +26,30 @@
 #define SGLM_IMPLEMENTATION
 #include <sglm/sglm.h>
 
-World::World(Shader* shader, Player* player) : m_shader{ shader },
-m_player{ player }, m_chunkLoaderThreadShouldClose{ false } {
+// Occlusion queries are off by default: their results arrive a frame late,
+// so a subchunk that comes into view from behind a hill can be missing for
+// a frame, and on some drivers the queries cost more than they save.
+// world_bench_gl --occlusion-queries measures what they skip.
+bool World::occlusion_queries = false;
+
+bool World::getOcclusionQueries() {
+    return World::occlusion_queries;
+}
+
+void World::setOcclusionQueries(bool enabled) {
+    World::occlusion_queries = enabled;
+}
+
+World::World(Shader* shader, Shader* lodShader, Player* player) : m_shader{ shader },
+m_lodShader{ lodShader }, m_player{ player }, m_loadGeneration{ 0 }, m_lastAutosave{ std::chrono::steady_clock::now() }, m_frame{ 0 },
+m_chunkLoaderThreadShouldClose{ false }, m_numChunks{ 0 },
+m_numGenerated{ 0 }, m_numLoaded{ 0 }, m_numMeshed{ 0 } {
+    // any opaque block will do, its texture is never seen
+    std::array<Block::BlockType, NUM_DIRECTIONS> surrounding;
+    surrounding.fill(Block::BlockType::AIR);
+    vertex_attrib_t data[ATTRIBS_PER_FACE * 6];
+    int size = Block::getBlockData(Block::BlockType::STONE, 0, 0, 0, data, surrounding);
+    m_box.generate(size * sizeof(vertex_attrib_t), data, false);
     m_chunkLoaderThread = std::thread(&World::LoadChunks, this);
 }
 
@@ -31,14 +57,23 @@ World::~World() {
     m_chunkLoaderThreadShouldClose = true;
     m_chunkLoaderThread.join();
     assert(m_chunks.empty());
+    Mesh::deleteReleasedQueries();
 }
 
+// chunks that were edited are saved at least this often, so that a crash
+// loses at most this much of the player's work
+static constexpr std::chrono::seconds AUTOSAVE_INTERVAL(30);
+
+// low-detail tiles are small, so more of them than chunks are uploaded per frame
+static constexpr int LOD_UPLOADS_PER_FRAME = 16;
+
 // called once every frame
 // mineBlock: true if the player has pressed the left mouse button. If the
 // player is looking at a block, it will be mined.
 // Update a max of 5 chunks per frame. This will prevent lag spikes if there
 // are suddenly 40+ chunks to load
 void World::update(bool mineBlock) {
+    PROFILE_ZONE(profiler::Zone::UPDATE);
     checkViewRayCollisions();
 
     // mine block we are looking at
@@ -50,6 +85,10 @@ void World::update(bool mineBlock) {
         chunk->put(isect.x, isect.y + SUBCHUNK_HEIGHT * isect.cy, isect.z, Block::BlockType::AIR);
     }
 
+    if (std::chrono::steady_clock::now() - m_lastAutosave >= AUTOSAVE_INTERVAL) {
+        autosave();
+    }
+
     int numUpdated = 0;
     m_chunksMutex.lock();
     for (const auto& [_, chunk] : m_chunks) {
@@ -58,6 +97,32 @@ void World::update(bool mineBlock) {
             break;
     }
     m_chunksMutex.unlock();
+    m_numMeshed += numUpdated;
+    m_lod.upload(LOD_UPLOADS_PER_FRAME);
+    Mesh::deleteReleasedQueries(); // of the chunks the chunk loader thread removed
+    m_player->updateFarPlane();
+}
+
+// Take a snapshot of every chunk that was edited since it was last saved.
+// The snapshots share their block data with the chunks, so this is cheap.
+// The chunk loader thread serializes and stores them (see storeSnapshots()).
+void World::autosave() {
+    PROFILE_ZONE(profiler::Zone::AUTOSAVE);
+    m_lastAutosave = std::chrono::steady_clock::now();
+    m_chunksMutex.lock();
+    m_snapshotsMutex.lock();
+    for (const auto& [pos, chunk] : m_chunks) {
+        if (chunk->wasUpdated() && chunk->getStatus() >= Chunk::Status::TERRAIN) {
+            m_snapshots.insert_or_assign(pos, chunk->takeSnapshot());
+            chunk->updateHandled();
+        }
+    }
+    m_snapshotsMutex.unlock();
+    m_chunksMutex.unlock();
+}
+
+World::Stats World::getStats() const {
+    return { m_numChunks, m_numGenerated, m_numLoaded, m_numMeshed };
 }
 
 // determine if the player is looking at a block (if yes, we
@@ -105,7 +170,56 @@ void World::checkViewRayCollisions() {
     }
 }
 
+// Find the subchunks that can be seen from the player's subchunk through
+// blocks that are not solid, and visit them (see Chunk::visit()). From the
+// player's subchunk, the search goes from one subchunk to the next in the
+// frustum, but only through pairs of faces that can be seen from each other
+// (see Chunk::connects()) and never back in a direction it has come from.
+// Returns the frame the subchunks were visited in, or 0 if the player is not
+// in a loaded chunk and every subchunk in the frustum has to be rendered.
+// The caller must hold m_chunksMutex.
+unsigned int World::findVisible() {
+    const sglm::vec3& pos = m_player->getPosition();
+    auto itr = m_chunks.find(m_player->getPlayerChunk());
+    if (itr == m_chunks.end() || pos.y < 0.0f) {
+        return 0;
+    }
+    if (++m_frame == 0) {
+        ++m_frame;
+    }
+    const sglm::frustum& frustum = m_player->getFrustum();
+    // above the world, the search starts at the top of the player's chunk
+    int y = std::min((int) pos.y / SUBCHUNK_HEIGHT, NUM_SUBCHUNKS - 1);
+    Direction from = pos.y >= CHUNK_HEIGHT ? PLUS_Y : NO_DIR;
+    itr->second->visit(y, m_frame);
+    m_visibleQueue.clear();
+    m_visibleQueue.push_back({ itr->second, y, from, 0 });
+    for (size_t i = 0; i < m_visibleQueue.size(); ++i) {
+        VisibleStep step = m_visibleQueue[i];
+        for (int d = 0; d < NUM_DIRECTIONS; ++d) {
+            Direction to = static_cast<Direction>(d);
+            Direction back = static_cast<Direction>(d ^ 1);
+            if ((step.travelled & (1 << back)) ||
+                (step.from != NO_DIR && !step.chunk->connects(step.y, step.from, to))) {
+                continue;
+            }
+            Chunk* next = step.chunk;
+            int next_y = step.y + (to == PLUS_Y) - (to == MINUS_Y);
+            if (to < PLUS_Y) {
+                next = step.chunk->getNeighbor(to).second;
+            }
+            if (next == nullptr || next_y < 0 || next_y >= NUM_SUBCHUNKS ||
+                !next->inFrustum(next_y, frustum) || !next->visit(next_y, m_frame)) {
+                continue;
+            }
+            m_visibleQueue.push_back({ next, next_y, back, (unsigned char) (step.travelled | (1 << to)) });
+        }
+    }
+    return m_frame;
+}
+
 void World::renderAll() {
+    PROFILE_ZONE(profiler::Zone::RENDER);
     // send the view and projection matrices to the shader
     m_shader->addUniformMat4f("u1_view", m_player->getViewMatrix());
     m_shader->addUniformMat4f("u2_projection", m_player->getProjectionMatrix());
@@ -123,31 +237,102 @@ void World::renderAll() {
     // render chunks
     int rendered = 0, total = 0;
     m_chunksMutex.lock();
+    Chunk::View view;
+    view.frustum = &m_player->getFrustum();
+    view.camera = m_player->getPosition();
+    view.frame = findVisible();
+    view.occlusionQueries = occlusion_queries && view.frame != 0;
+    view.occluded = 0;
+    view.hidden = 0;
     for (const auto& [_, chunk] : m_chunks) {
-        rendered += chunk->render(m_shader, m_player->getFrustum());
+        rendered += chunk->render(m_shader, view);
         total += NUM_SUBCHUNKS;
     }
+    // query the subchunks against the depth buffer of this frame, for the next
+    if (view.occlusionQueries) {
+        Mesh::startQueries();
+        for (const auto& [_, chunk] : m_chunks) {
+            chunk->queryOcclusion(m_shader, view, m_box);
+        }
+        Mesh::endQueries();
+    }
     m_chunksMutex.unlock();
     m_player->chunks_rendered = { rendered, total };
+    m_player->chunks_occluded = view.occluded;
+    m_player->chunks_hidden = view.hidden;
+
+    m_lodShader->addUniformMat4f("u1_view", m_player->getViewMatrix());
+    m_lodShader->addUniformMat4f("u2_projection", m_player->getProjectionMatrix());
+    m_lod.render(m_lodShader, m_player->getFrustum());
 }
 
+// saved chunks up to this many chunks beyond the render distance are read
+// ahead from the database
+static constexpr int PREFETCH_DIST = 2;
+
+// At most this many chunks wait for the database at once, so the database
+// queues stay short when the player moves faster than chunks can be loaded.
+// The chunks closest to the player are requested first.
+static constexpr size_t MAX_LOADS_IN_FLIGHT = 64;
+
 static inline bool within_distance(int px, int pz, int cx, int cz, int dist) {
     int dist_sq = (px - cx) * (px - cx) + (pz - cz) * (pz - cz);
     return dist_sq <= dist * dist;
 }
 
-static void checkIfUpdated(Chunk* chunk, const std::pair<int, int>& pos) {
-    if (chunk->wasUpdated()) {
+// A chunk can only be removed once none of its neighbors is FULL. The main
+// thread un-renders at most a few chunks per frame, so when the player moves
+// fast the chunks at the un-render distance can still be FULL when their
+// neighbors are beyond the load radius. A chunk without terrain never makes
+// a neighbor FULL, so this cannot change before the chunk is removed.
+static bool has_full_neighbor(const Chunk* chunk) {
+    for (int d = 0; d < 4; ++d) {
+        const Chunk* neighbor = chunk->getNeighbor(d).second;
+        if (neighbor != nullptr && neighbor->getStatus() == Chunk::Status::FULL) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Serialize and store the snapshots taken by autosave(). Returns true if
+// there were any. Called by the chunk loader thread, which is the only
+// thread that stores chunks, so a snapshot is always stored before any newer
+// version of the same chunk.
+bool World::storeSnapshots() {
+    std::map<std::pair<int, int>, Chunk::Snapshot> snapshots;
+    m_snapshotsMutex.lock();
+    snapshots.swap(m_snapshots);
+    m_snapshotsMutex.unlock();
+    for (const auto& [pos, snapshot] : snapshots) {
+        database::Buffer* data = database::acquire_buffer();
+        snapshot.serialize(*data, database::world_seed());
+        database::request_store(pos.first, pos.second, data);
+    }
+    return !snapshots.empty();
+}
+
+// Store a chunk whose block data is about to be deleted if it was edited
+// since it was last saved. A snapshot of it that is waiting to be stored is
+// dropped, because the chunk's blocks are at least as new.
+void World::storeIfUpdated(Chunk* chunk, const std::pair<int, int>& pos) {
+    m_snapshotsMutex.lock();
+    bool updated = m_snapshots.erase(pos) > 0 || chunk->wasUpdated();
+    chunk->updateHandled();
+    m_snapshotsMutex.unlock();
+    if (updated) {
         auto& [cx, cz] = pos;
-        database::request_store(cx, cz, BLOCKS_PER_CHUNK, chunk->getBlockData());
-        chunk->updateHandled();
+        database::Buffer* data = database::acquire_buffer();
+        chunk->serialize(*data, database::world_seed());
+        database::request_store(cx, cz, data);
     }
 }
 
 void World::LoadChunks() {
     using namespace std::chrono_literals;
+    std::vector<database::Query> results;
     while (!m_chunkLoaderThreadShouldClose) {
-        bool updateMade = false;
+        bool updateMade = storeSnapshots();
         auto [px, pz] = m_player->getPlayerChunk();
 
         // Make sure that all chunks within Player::getLoadRadius() of the player are loaded
@@ -163,6 +348,8 @@ void World::LoadChunks() {
         }
         
         // Loop through every chunk:
+        // If a chunk is outside the player's un-render distance and is still waiting
+        //     for the database, cancel its load
         // If a chunk is beyond the player's load radius, unload it
         // If a chunk has Status::EMPTY, generate structures for it
         // If a chunk is within the player's render distance and view frustum and does not
@@ -172,13 +359,22 @@ void World::LoadChunks() {
         // 
         std::vector<std::pair<std::pair<int, int>, Chunk*>> need_to_remove;
         need_to_remove.reserve(64);
+        std::vector<std::pair<int, std::pair<int, int>>> need_to_load; // (distance squared, position)
+        std::array<int, (int) Chunk::Status::FULL + 1> status_counts = {};
         for (const auto& [pos, chunk] : m_chunks) {
             const auto& [cx, cz] = pos;
+            if (chunk->getStatus() == Chunk::Status::LOADING && !within_distance(px, pz, cx, cz, Player::getUnRenderDist())) {
+                cancelLoad(cx, cz, chunk);
+                updateMade = true;
+            }
+            ++status_counts[(int) chunk->getStatus()];
             if (!within_distance(px, pz, cx, cz, Player::getLoadRadius())) {
                 if (chunk->getStatus() <= Chunk::Status::STRUCTURES) {
-                    need_to_remove.push_back({ pos, chunk });
+                    if (!has_full_neighbor(chunk)) {
+                        need_to_remove.push_back({ pos, chunk });
+                    }
                 } else {
-                    checkIfUpdated(chunk, pos);
+                    storeIfUpdated(chunk, pos);
                     chunk->setToDelete();
                 }
                 updateMade = true;
@@ -200,14 +396,18 @@ void World::LoadChunks() {
                     }
                 }
                 if (contains) {
-                    database::request_load(cx, cz);
-                    assert(m_chunks.find({ cx, cz }) != m_chunks.end());
-                    (*m_chunks.find({ cx, cz })).second->setLoading();
-                    updateMade = true;
+                    need_to_load.push_back({ (cx - px) * (cx - px) + (cz - pz) * (cz - pz), pos });
+                }
+            }
+            else if (chunk->getStatus() < Chunk::Status::LOADING && within_distance(px, pz, cx, cz, Player::getRenderDist() + PREFETCH_DIST)) {
+                // read ahead the saved chunks the player is moving towards
+                const sglm::vec3& dir = m_player->getDirection();
+                if ((cx - px) * dir.x + (cz - pz) * dir.z > 0.0f) {
+                    database::request_prefetch(cx, cz);
                 }
             }
             else if (chunk->getStatus() >= Chunk::Status::TERRAIN && !within_distance(px, pz, cx, cz, Player::getUnRenderDist())) {
-                checkIfUpdated(chunk, pos);
+                storeIfUpdated(chunk, pos);
                 chunk->setToDelete();
                 updateMade = true;
             }
@@ -216,25 +416,66 @@ void World::LoadChunks() {
             auto& [x, z] = pos;
             removeChunk(x, z, chunk);
         }
+        if (!need_to_remove.empty()) {
+            // no chunk that is left needs the structures of these regions
+            Structure::evictFarFrom(px, pz, Player::getLoadRadius() + Structure::MAX_REACH);
+        }
+        std::sort(need_to_load.begin(), need_to_load.end());
+        for (size_t i = 0; i < need_to_load.size() && m_loading.size() < MAX_LOADS_IN_FLIGHT; ++i) {
+            const auto& [cx, cz] = need_to_load[i].second;
+            assert(m_chunks.find({ cx, cz }) != m_chunks.end());
+            m_loading[{ cx, cz }] = ++m_loadGeneration;
+            database::request_load(cx, cz, m_loadGeneration);
+            (*m_chunks.find({ cx, cz })).second->setLoading();
+            updateMade = true;
+        }
+        profiler::set(profiler::Counter::CHUNKS_EMPTY, status_counts[(int) Chunk::Status::EMPTY]);
+        profiler::set(profiler::Counter::CHUNKS_STRUCTURES, status_counts[(int) Chunk::Status::STRUCTURES]);
+        profiler::set(profiler::Counter::CHUNKS_LOADING, status_counts[(int) Chunk::Status::LOADING]);
+        profiler::set(profiler::Counter::CHUNKS_TERRAIN, status_counts[(int) Chunk::Status::TERRAIN]);
+        profiler::set(profiler::Counter::CHUNKS_FULL, status_counts[(int) Chunk::Status::FULL]);
+
+        if (m_lod.update(px, pz, Player::getRenderDist(), Player::getLodDist())) {
+            updateMade = true;
+        }
 
         // load chunks from the database
-        database::Query q = database::get_load_result();
-        while (q.type != database::QUERY_NONE) {
+        results.clear();
+        database::get_load_results(results);
+        for (const database::Query& q : results) {
             assert(q.type == database::QUERY_LOAD);
+            auto loading = m_loading.find({ q.x, q.z });
+            if (loading == m_loading.end() || loading->second != q.generation) {
+                // the load was cancelled after the database read the chunk
+                database::release_buffer(q.data);
+                profiler::add(profiler::Counter::LOADS_STALE, 1);
+                continue;
+            }
             assert(m_chunks.find({ q.x, q.z }) != m_chunks.end());
             const auto& [pos, chunk] = *m_chunks.find({ q.x, q.z });
+            auto [player_x, player_z] = m_player->getPlayerChunk();
+            if (!within_distance(player_x, player_z, q.x, q.z, Player::getUnRenderDist())) {
+                // the player moved away while the chunk was loading, so its
+                // terrain would be deleted right after it was created
+                database::release_buffer(q.data);
+                cancelLoad(q.x, q.z, chunk);
+                updateMade = true;
+                continue;
+            }
+            m_loading.erase(loading);
             assert(chunk->getStatus() == Chunk::Status::LOADING);
-            if (q.data != nullptr) {
-                chunk->addBlockData(reinterpret_cast<const Block::BlockType*>(q.data));
-                delete[] q.data;
+            bool loaded = q.data != nullptr && chunk->deserialize(q.data->data(), (int) q.data->size());
+            database::release_buffer(q.data);
+            if (loaded) {
+                ++m_numLoaded;
             } else {
                 Block::BlockType* data = new Block::BlockType[BLOCKS_PER_CHUNK];
-                chunk->generateTerrain(data, 1337);
+                chunk->generateTerrain(data, database::world_seed());
                 chunk->addBlockData(data);
                 delete[] data;
+                ++m_numGenerated;
             }
             updateMade = true;
-            q = database::get_load_result();
         }
 
         if (!updateMade) {
@@ -242,10 +483,15 @@ void World::LoadChunks() {
         }
     }
 
-    // thread is closing, unload all chunks
+    // thread is closing, save what changed since the last autosave and
+    // unload all chunks
+    storeSnapshots();
     for (const auto& [pos, chunk] : m_chunks) {
-        if (chunk->getStatus() >= Chunk::Status::TERRAIN) {
-            checkIfUpdated(chunk, pos);
+        if (chunk->getStatus() == Chunk::Status::LOADING) {
+            cancelLoad(pos.first, pos.second, chunk);
+        }
+        else if (chunk->getStatus() >= Chunk::Status::TERRAIN) {
+            storeIfUpdated(chunk, pos);
             chunk->deleteBlockData();
         }
     }
@@ -265,6 +511,7 @@ void World::addChunk(int x, int z) {
     m_chunksMutex.lock();
     m_chunks.emplace(std::make_pair(x, z), newChunk);
     m_chunksMutex.unlock();
+    ++m_numChunks;
 
     // add neighbors to the new chunk.
     auto px = m_chunks.find({ x + 1, z });
@@ -289,6 +536,16 @@ void World::addChunk(int x, int z) {
     }
 }
 
+// The chunk goes back to Status::STRUCTURES. If its load result arrives
+// anyway, it is dropped because the chunk is no longer in m_loading.
+void World::cancelLoad(int x, int z, Chunk* chunk) {
+    assert(m_loading.find({ x, z }) != m_loading.end());
+    database::cancel_load(x, z);
+    m_loading.erase({ x, z });
+    chunk->cancelLoading();
+    profiler::add(profiler::Counter::LOADS_CANCELLED, 1);
+}
+
 void World::removeChunk(int x, int z, Chunk* chunk) {
     assert(m_chunks.find({ x, z }) != m_chunks.end());
     assert(chunk->getStatus() < Chunk::Status::TERRAIN);
@@ -296,5 +553,6 @@ void World::removeChunk(int x, int z, Chunk* chunk) {
     m_chunksMutex.lock();
     m_chunks.erase({ x, z });
     m_chunksMutex.unlock();
+    --m_numChunks;
     delete chunk; // calls destructor, removes neighbors
 }
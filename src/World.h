@@ -4,32 +4,88 @@
 #include "Chunk.h"
 #include "Shader.h"
 #include "Player.h"
+#include "LodTerrain.h"
 #include <sglm/sglm.h>
 #include <map>
+#include <vector>
 #include <mutex>
 #include <thread>
+#include <atomic>
+#include <chrono>
 
 class World {
+    static bool occlusion_queries;
+
+public:
+    // running totals since this World was created (read by the benchmarks)
+    struct Stats {
+        int chunks;    // chunks that currently exist (any Status)
+        int generated; // chunks whose terrain was created by generateTerrain()
+        int loaded;    // chunks whose terrain was loaded from the database
+        int meshed;    // chunks that reached Status::FULL
+    };
+
+private:
     std::map<std::pair<int, int>, Chunk*> m_chunks;
     Shader* m_shader;
+    Shader* m_lodShader;
     Player* m_player;
+    LodTerrain m_lod; // beyond the render distance
+    Mesh m_box;       // a 1x1x1 cube, drawn for occlusion queries
+
+    // Chunks waiting for a load from the database, with the generation the
+    // load was requested with. Only used by the chunk loader thread.
+    std::map<std::pair<int, int>, unsigned int> m_loading;
+    unsigned int m_loadGeneration;
+
+    // Snapshots of edited chunks taken by autosave() that the chunk loader
+    // thread has not stored yet. Guarded by m_snapshotsMutex, which also
+    // guards clearing a chunk's wasUpdated() flag.
+    std::map<std::pair<int, int>, Chunk::Snapshot> m_snapshots;
+    std::mutex m_snapshotsMutex;
+    std::chrono::steady_clock::time_point m_lastAutosave; // main thread only
+
+    // a subchunk reached by findVisible(), through its face from, after
+    // moving in the directions in the bit mask travelled
+    struct VisibleStep {
+        Chunk* chunk;
+        int y;
+        Direction from;
+        unsigned char travelled;
+    };
+    std::vector<VisibleStep> m_visibleQueue; // main thread only
+    unsigned int m_frame;                    // the last frame of findVisible()
 
     bool m_chunkLoaderThreadShouldClose;
     std::thread m_chunkLoaderThread;
     std::mutex m_chunksMutex;
 
+    std::atomic<int> m_numChunks;
+    std::atomic<int> m_numGenerated;
+    std::atomic<int> m_numLoaded;
+    std::atomic<int> m_numMeshed;
+
 public:
-    World(Shader* shader, Player* player);
+    static bool getOcclusionQueries();
+    static void setOcclusionQueries(bool enabled);
+
+    World(Shader* shader, Shader* lodShader, Player* player);
     ~World();
     void update(bool mineBlock);
     void renderAll();
+    Stats getStats() const;
 
 private:
     void checkViewRayCollisions();
+    unsigned int findVisible();
+    void autosave();
 
     void LoadChunks();
     void addChunk(int x, int z);
     void removeChunk(int x, int z, Chunk* chunk);
+    void cancelLoad(int x, int z, Chunk* chunk);
+    bool storeSnapshots();
+    void storeIfUpdated(Chunk* chunk, const std::pair<int, int>& pos);
 };
 
 #endif
@@ -0,0 +1,59 @@
+// Copies every chunk of a world, and its seed, from one storage backend to
+// another (see Storage.h). The chunk data is copied as it is, so chunks saved
+// in an older format are still read by Chunk::deserialize() after the
+// conversion.
+//
+// Usage: convert_world FROM_BACKEND FROM_PATH TO_BACKEND TO_PATH
+//   e.g. convert_world sqlite MCDB.db region world
+
+#include "Storage.h"
+
+#include <iostream>
+
+int main(int argc, char** argv) {
+    database::Backend from_backend, to_backend;
+    if (argc != 5 || !database::parse_backend(argv[1], from_backend) ||
+        !database::parse_backend(argv[3], to_backend)) {
+        std::cerr << "usage: convert_world FROM_BACKEND FROM_PATH TO_BACKEND TO_PATH\n"
+                     "backends: sqlite, region\n";
+        return 1;
+    }
+    database::Storage* from = database::open_storage(from_backend, argv[2]);
+    database::Storage* to = database::open_storage(to_backend, argv[4]);
+    if (from == nullptr || to == nullptr) {
+        delete from;
+        delete to;
+        return 1;
+    }
+
+    int seed;
+    if (from->loadSeed(seed)) {
+        to->storeSeed(seed);
+    }
+
+    // commit every BATCH_SIZE chunks so a large world is not one transaction
+    constexpr int BATCH_SIZE = 1024;
+    std::vector<std::pair<int, int>> keys = from->keys();
+    database::Buffer data;
+    int copied = 0;
+    long long bytes = 0;
+    to->begin();
+    for (const auto& [x, z] : keys) {
+        if (!from->load(x, z, data)) {
+            std::cerr << "could not load chunk (" << x << ", " << z << ")\n";
+            continue;
+        }
+        to->store(x, z, data);
+        bytes += data.size();
+        if (++copied % BATCH_SIZE == 0) {
+            to->commit();
+            to->begin();
+            std::cerr << copied << " / " << keys.size() << " chunks\n";
+        }
+    }
+    to->commit();
+    delete from;
+    delete to;
+    std::cout << "copied " << copied << " chunks (" << bytes / 1024 << " KB)\n";
+    return copied == (int) keys.size() ? 0 : 1;
+}
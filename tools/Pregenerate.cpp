@@ -0,0 +1,200 @@
+// Generates the chunks of an area of a world ahead of time, so that players
+// who join later load them instead of generating them. The chunks are
+// generated on every core and stored as full snapshots (see Serialize.cpp),
+// BATCH_SIZE chunks per transaction. Chunks that are already in the world
+// are skipped, so a run that was interrupted continues where its last
+// committed batch ended, and chunks that players have edited are kept.
+//
+// Usage: pregenerate BACKEND PATH [--seed N] [--threads N]
+//                    (--radius R [--center X Z] | --rect X0 Z0 X1 Z1)
+//   e.g. pregenerate sqlite MCDB.db --radius 64
+//
+// --radius generates every chunk within R chunks of chunk (X, Z), which is
+// (0, 0) by default, and --rect every chunk from (X0, Z0) to (X1, Z1). The
+// seed is stored in the world, and the game plays the world with it. It is
+// the world's own seed by default, or WORLD_SEED for a new world, and a
+// --seed that differs from the seed of a world that has one is refused.
+// Progress is printed to stderr.
+
+#include "Constants.h"
+#include "Block.h"
+#include "Chunk.h"
+#include "Structure.h"
+#include "Storage.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <set>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+// chunks per transaction, and per round of generation
+static constexpr int BATCH_SIZE = 1024;
+
+static void usage() {
+    std::cerr << "usage: pregenerate BACKEND PATH [--seed N] [--threads N]\n"
+                 "                   (--radius R [--center X Z] | --rect X0 Z0 X1 Z1)\n"
+                 "backends: sqlite, region\n";
+}
+
+// Run work(i) for every i in [0, count) on threads threads (including this one).
+template <typename Work>
+static void run_parallel(int threads, int count, Work&& work) {
+    std::atomic<int> next{ 0 };
+    auto worker = [&] {
+        for (int i = next++; i < count; i = next++)
+            work(i);
+    };
+    std::vector<std::thread> pool;
+    for (int t = 1; t < threads; ++t)
+        pool.emplace_back(worker);
+    worker();
+    for (std::thread& t : pool)
+        t.join();
+}
+
+int main(int argc, char** argv) {
+    database::Backend backend;
+    if (argc < 3 || !database::parse_backend(argv[1], backend)) {
+        usage();
+        return 1;
+    }
+    const char* path = argv[2];
+    int seed = WORLD_SEED;
+    bool seed_given = false;
+    int threads = std::max(1, (int) std::thread::hardware_concurrency());
+    int radius = -1, center_x = 0, center_z = 0;
+    bool rect = false;
+    int x0 = 0, z0 = 0, x1 = 0, z1 = 0;
+    for (int i = 3; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--seed" && i + 1 < argc) {
+            seed = std::atoi(argv[++i]);
+            seed_given = true;
+        } else if (arg == "--threads" && i + 1 < argc) {
+            threads = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--radius" && i + 1 < argc) {
+            radius = std::max(0, std::atoi(argv[++i]));
+        } else if (arg == "--center" && i + 2 < argc) {
+            center_x = std::atoi(argv[++i]);
+            center_z = std::atoi(argv[++i]);
+        } else if (arg == "--rect" && i + 4 < argc) {
+            rect = true;
+            x0 = std::atoi(argv[++i]);
+            z0 = std::atoi(argv[++i]);
+            x1 = std::atoi(argv[++i]);
+            z1 = std::atoi(argv[++i]);
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    if (rect == (radius >= 0)) {
+        usage();
+        return 1;
+    }
+    if (radius >= 0) {
+        x0 = center_x - radius;
+        z0 = center_z - radius;
+        x1 = center_x + radius;
+        z1 = center_z + radius;
+    }
+
+    database::Storage* storage = database::open_storage(backend, path);
+    if (storage == nullptr) {
+        return 1;
+    }
+    std::vector<std::pair<int, int>> stored = storage->keys();
+    std::set<std::pair<int, int>> skip(stored.begin(), stored.end());
+
+    // a world saved before worlds had a seed was generated with WORLD_SEED
+    int world_seed = WORLD_SEED;
+    bool has_seed = storage->loadSeed(world_seed) || !stored.empty();
+    if (has_seed && seed_given && seed != world_seed) {
+        std::cerr << path << " is generated with seed " << world_seed << ", not " << seed << "\n";
+        delete storage;
+        return 1;
+    }
+    if (has_seed) {
+        seed = world_seed;
+    }
+    storage->storeSeed(seed);
+
+    // Region by region, so that the chunks of a batch share the structures
+    // of as few regions as possible (see Structure::REGION_WIDTH).
+    std::vector<std::pair<int, int>> chunks;
+    int skipped = 0;
+    for (int x = std::min(x0, x1); x <= std::max(x0, x1); ++x) {
+        for (int z = std::min(z0, z1); z <= std::max(z0, z1); ++z) {
+            int dx = x - center_x, dz = z - center_z;
+            if (radius >= 0 && dx * dx + dz * dz > radius * radius) {
+                continue;
+            }
+            if (skip.count({ x, z })) {
+                ++skipped;
+                continue;
+            }
+            chunks.push_back({ x, z });
+        }
+    }
+    std::sort(chunks.begin(), chunks.end(), [](const auto& a, const auto& b) {
+        auto ra = Structure::getRegion(a.first, a.second);
+        auto rb = Structure::getRegion(b.first, b.second);
+        return ra != rb ? ra < rb : a < b;
+    });
+    std::cerr << chunks.size() << " chunks to generate, " << skipped << " already stored, "
+              << threads << " threads\n";
+
+    Block::initBlockData();
+    Chunk::initNoise(seed);
+    std::vector<database::Buffer> blobs(BATCH_SIZE);
+    long long bytes = 0;
+    double generate_seconds = 0.0, store_seconds = 0.0;
+    Clock::time_point start = Clock::now();
+    for (size_t first = 0; first < chunks.size(); first += BATCH_SIZE) {
+        int count = (int) std::min(chunks.size() - first, (size_t) BATCH_SIZE);
+        Clock::time_point batch_start = Clock::now();
+        run_parallel(threads, count, [&](int i) {
+            // reused by each thread so that it does not allocate
+            thread_local std::vector<Block::BlockType> data(BLOCKS_PER_CHUNK);
+            auto [x, z] = chunks[first + i];
+            Chunk chunk(x, z);
+            chunk.generateStructures();
+            chunk.generateTerrain(data.data(), seed);
+            Chunk::serializeBlocks(data.data(), blobs[i]);
+        });
+        Clock::time_point generated = Clock::now();
+
+        storage->begin();
+        for (int i = 0; i < count; ++i) {
+            storage->store(chunks[first + i].first, chunks[first + i].second, blobs[i]);
+            bytes += blobs[i].size();
+        }
+        storage->commit();
+        // the next batch is in other regions, apart from its border
+        Structure::clearAll();
+        Clock::time_point stored_at = Clock::now();
+
+        generate_seconds += std::chrono::duration<double>(generated - batch_start).count();
+        store_seconds += std::chrono::duration<double>(stored_at - generated).count();
+        double seconds = std::chrono::duration<double>(stored_at - start).count();
+        size_t done = first + count;
+        std::cerr << done << " / " << chunks.size() << " chunks, "
+                  << (int) (done / seconds) << " chunks/s\n";
+    }
+    delete storage;
+
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    std::cout << "generated " << chunks.size() << " chunks (" << bytes / 1024 << " KB) in "
+              << seconds << " s, " << (int) (chunks.size() / std::max(seconds, 1e-9))
+              << " chunks/s (" << generate_seconds << " s generating, " << store_seconds
+              << " s storing)\n";
+    return 0;
+}